@@ -35,16 +35,51 @@
 #include <linux/input.h>
 #include <linux/mutex.h>
 #include <linux/slab.h>
+#include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
+#include <linux/gpio/machine.h>
+#include <linux/platform_device.h>
+#include <linux/spi/spi.h>
+#include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/bitops.h>
+#include <linux/of.h>
+#include <linux/of_address.h>
+#include <linux/of_irq.h>
+#include <linux/kthread.h>
+#include <linux/workqueue.h>
+#include <linux/sched.h>
+#include <linux/wait_bit.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/async.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/version.h>
+#include <linux/srcu.h>
+#include <linux/rcupdate.h>
+#include <linux/string.h>
+#include <linux/configfs.h>
+#include <linux/uaccess.h>
+#include <linux/leds.h>
+#include <linux/clk.h>
 
 #include <linux/ioport.h>
 #include <asm/io.h>
 
+#define CREATE_TRACE_POINTS
+#include "mk_arcade_joystick_rpi_trace.h"
+#include "mk_arcade_joystick_rpi_state.h"
+
 
 MODULE_AUTHOR("Matthieu Proucelle");
 MODULE_DESCRIPTION("GPIO and MCP23017 Arcade Joystick Driver");
 MODULE_LICENSE("GPL");
 
-#define MK_MAX_DEVICES	 10
+#define MK_MAX_DEVICES	 10	/* entries in each pad list parameter */
 
 #ifdef RPI2
 #define PERI_BASE        0x3F000000
@@ -54,14 +89,24 @@ MODULE_LICENSE("GPL");
 
 #define GPIO_BASE                (PERI_BASE + 0x200000) /* GPIO controller */
 
-#define INP_GPIO(g) *(gpio+((g)/10)) &= ~(7<<(((g)%10)*3))
-#define OUT_GPIO(g) *(gpio+((g)/10)) |=  (1<<(((g)%10)*3))
-#define GPIO_READ(g)  *(gpio + 13) &= (1<<(g))
+/*
+ * All register access goes through mk_readl()/mk_writel(), defined below for
+ * the hardware and by the userspace simulator (sim/) for its models.
+ */
+#define GPIO_GPSET0	7
+#define GPIO_GPCLR0	10
+#define GPIO_GPLEV0	13
+#define GPIO_GPPUD	37
+#define GPIO_GPPUDCLK0	38
+
+#define INP_GPIO(g) mk_writel(gpio, (g)/10, mk_readl(gpio, (g)/10) & ~(7<<(((g)%10)*3)))
+#define OUT_GPIO(g) mk_writel(gpio, (g)/10, mk_readl(gpio, (g)/10) | (1<<(((g)%10)*3)))
+#define GPIO_LEV mk_readl(gpio, GPIO_GPLEV0)
 
-#define SET_GPIO_ALT(g,a) *(gpio+(((g)/10))) |= (((a)<=3?(a)+4:(a)==4?3:2)<<(((g)%10)*3))
+#define SET_GPIO_ALT(g,a) mk_writel(gpio, (g)/10, mk_readl(gpio, (g)/10) | (((a)<=3?(a)+4:(a)==4?3:2)<<(((g)%10)*3)))
 
-#define GPIO_SET *(gpio+7)
-#define GPIO_CLR *(gpio+10)
+#define GPIO_SET(v) mk_writel(gpio, GPIO_GPSET0, v)
+#define GPIO_CLR(v) mk_writel(gpio, GPIO_GPCLR0, v)
 
 #define BSC0_BASE		(PERI_BASE + 0x205000) /* /dev/i2c-0 -- HAT    interface */
 #define BSC1_BASE		(PERI_BASE + 0x804000) /* /dev/i2c-1 -- Normal interface */
@@ -73,26 +118,45 @@ MODULE_LICENSE("GPL");
  */
 #define MPC23017_GPIOA_MODE		0x00
 #define MPC23017_GPIOB_MODE		0x01
+#define MPC23017_GPINTENA		0x04
+#define MPC23017_INTCONA		0x08
+#define MPC23017_IOCON			0x0a
 #define MPC23017_GPIOA_PULLUPS_MODE	0x0c
 #define MPC23017_GPIOB_PULLUPS_MODE	0x0d
 #define MPC23017_GPIOA_READ             0x12
 #define MPC23017_GPIOB_READ             0x13
+#define MPC23017_OLATA			0x14
+
+#define MPC23017_IOCON_MIRROR		(1 << 6)	/* INTA and INTB both signal a change on either port */
+#define MPC23017_IOCON_SEQOP		(1 << 5)	/* byte mode : the address pointer toggles between GPIOA and GPIOB */
+#define MPC23017_IOCON_HAEN		(1 << 3)	/* MCP23S17 : the chip only answers to its A2..A0 address */
+
+#define MCP23S17_OPCODE			0x40		/* 0 1 0 0 A2 A1 A0 R/W */
+#define MCP23S17_READ			0x01
+#define MCP23S17_MAX_HZ			10000000
+
+#define MCP3008_START			0x01
+#define MCP3008_SINGLE			0x80		/* single ended, channel in bits 6..4 */
+#define MCP3008_CHANNELS		8
+#define MCP3008_MAX			1023
+#define MCP3008_MAX_HZ			3600000		/* at 5V, 1350000 at 2.7V */
+
+#define MK_MCP23017_INIT_TRIES		3
 
 /*
  * Defines for I2C peripheral (aka BSC, or Broadcom Serial Controller)
  */
 
-#define BSC0_C		*(bsc0 + 0x00)
-#define BSC0_S		*(bsc0 + 0x01)
-#define BSC0_DLEN	*(bsc0 + 0x02)
-#define BSC0_A		*(bsc0 + 0x03)
-#define BSC0_FIFO	*(bsc0 + 0x04)
+#define BSC_C		0x00
+#define BSC_S		0x01
+#define BSC_DLEN	0x02
+#define BSC_A		0x03
+#define BSC_FIFO	0x04
+#define BSC_DIV		0x05
+#define BSC_CLKT	0x07
 
-#define BSC1_C		*(bsc1 + 0x00)
-#define BSC1_S		*(bsc1 + 0x01)
-#define BSC1_DLEN	*(bsc1 + 0x02)
-#define BSC1_A		*(bsc1 + 0x03)
-#define BSC1_FIFO	*(bsc1 + 0x04)
+#define bsc_read(b, reg)	mk_readl((b)->regs, reg)
+#define bsc_write(b, reg, v)	mk_writel((b)->regs, reg, v)
 
 #define BSC_C_I2CEN	(1 << 15)
 #define BSC_C_INTR	(1 << 10)
@@ -118,9 +182,27 @@ MODULE_LICENSE("GPL");
 
 #define CLEAR_STATUS	BSC_S_CLKT|BSC_S_ERR|BSC_S_DONE
 
+#define BSC_CORE_CLK	250000000	/* BSC clock source when the DT gives none : the BCM2835 VPU core clock */
+#define BSC_CDIV_MAX	0xfffe
+#define BSC_CLKT_TOUT	0x40		/* SCL clocks a slave may stretch before the transfer ends with CLKT */
+
+#define MK_I2C_SLACK_NS		100000	/* added to the wire time of every transfer for its deadline */
+
+#define MK_PAD_FAIL_MAX		3	/* failed reads in a row before a chip is quarantined */
+#define MK_QUARANTINE_MIN_MS	100
+#define MK_QUARANTINE_MAX_MS	10000
+
 static volatile unsigned *gpio;
-static volatile unsigned *bsc0;
-static volatile unsigned *bsc1;
+
+#ifndef MK_SIM
+static inline u32 mk_readl(volatile unsigned *base, int reg) {
+    return base[reg];
+}
+
+static inline void mk_writel(volatile unsigned *base, int reg, u32 val) {
+    base[reg] = val;
+}
+#endif
 
 struct mk_config {
     int args[MK_MAX_DEVICES];
@@ -149,6 +231,138 @@ static struct gpio_config gpio_cfg __initdata;
 module_param_array_named(gpio, gpio_cfg.mk_arcade_gpio_maps_custom, int, &(gpio_cfg.nargs), 0);
 MODULE_PARM_DESC(gpio, "Numbers of custom GPIO for Arcade Joystick");
 
+static struct mk_config gpiod_cfg __initdata;
+module_param_array_named(gpiod, gpiod_cfg.args, int, &(gpiod_cfg.nargs), 0);
+MODULE_PARM_DESC(gpiod, "Read each map pad through gpiolib instead of the BCM2835 registers, 0 or 1 per pad in map order");
+
+static char *gpiod_chip = "pinctrl-bcm2835";
+module_param(gpiod_chip, charp, 0);
+MODULE_PARM_DESC(gpiod_chip, "Label of the gpiolib chip of the gpiod pads, its lines numbered like BCM GPIOs (default pinctrl-bcm2835)");
+
+static struct mk_config hc165_cfg __initdata;
+module_param_array_named(hc165, hc165_cfg.args, int, &(hc165_cfg.nargs), 0);
+MODULE_PARM_DESC(hc165, "GPIOs of a 74HC165 chain : load (SH/LD), clock (CLK), data (QH of the chip next to the Pi)");
+
+static unsigned int hc165_pads __initdata;
+module_param(hc165_pads, uint, 0);
+MODULE_PARM_DESC(hc165_pads, "Pads on the 74HC165 chain, two chips (16 inputs) each");
+
+static unsigned int hc165_delay_ns = 50;
+module_param(hc165_delay_ns, uint, 0);
+MODULE_PARM_DESC(hc165_delay_ns, "Half period of the 74HC165 clock and load pulse width in ns (default 50), raise it for long wires");
+
+static struct mk_config mcp23s17_cfg __initdata;
+module_param_array_named(mcp23s17, mcp23s17_cfg.args, int, &(mcp23s17_cfg.nargs), 0);
+MODULE_PARM_DESC(mcp23s17, "Enable MCP23S17 Controllers on spi_dev, by hardware address (0-7, the A2..A0 pins)");
+
+static char *spi_dev __initdata = "spi0.0";
+module_param(spi_dev, charp, 0);
+MODULE_PARM_DESC(spi_dev, "SPI device of the MCP23S17 chips, all on its chip select (default spi0.0), it must not be bound to spidev");
+
+static unsigned int spi_speed_hz __initdata = MCP23S17_MAX_HZ;
+module_param(spi_speed_hz, uint, 0);
+MODULE_PARM_DESC(spi_speed_hz, "SPI clock of the MCP23S17 chips in Hz (default and max 10000000)");
+
+static struct mk_config mcp3008_cfg __initdata;
+module_param_array_named(mcp3008, mcp3008_cfg.args, int, &(mcp3008_cfg.nargs), 0);
+MODULE_PARM_DESC(mcp3008, "Enable MCP3008 Analog Controllers, 3 channels (0-7) per pad : X, Y and throttle, -1 for an axis not wired");
+
+static char *adc_spi_dev __initdata = "spi0.1";
+module_param(adc_spi_dev, charp, 0);
+MODULE_PARM_DESC(adc_spi_dev, "SPI device of the MCP3008 (default spi0.1), it must not be bound to spidev");
+
+static unsigned int adc_speed_hz __initdata = 1350000;
+module_param(adc_speed_hz, uint, 0);
+MODULE_PARM_DESC(adc_speed_hz, "SPI clock of the MCP3008 in Hz (default 1350000, max 3600000 with a 5V supply)");
+
+static unsigned int adc_deadzone __initdata = 8;
+module_param(adc_deadzone, uint, 0);
+MODULE_PARM_DESC(adc_deadzone, "Initial deadzone of the analog axes in ADC steps (default 8)");
+
+static unsigned int i2c_speed;
+module_param(i2c_speed, uint, 0);
+MODULE_PARM_DESC(i2c_speed, "I2C bus clock in kHz, 10 to 1000 (default : leave the bus clock as configured)");
+
+static bool i2c_irq __initdata;
+module_param(i2c_irq, bool, 0);
+MODULE_PARM_DESC(i2c_irq, "Read MCP23017 pads with interrupt driven I2C transfers instead of busy waiting");
+
+static struct mk_config debounce_press_cfg __initdata;
+module_param_array_named(debounce_press, debounce_press_cfg.args, int, &(debounce_press_cfg.nargs), 0);
+MODULE_PARM_DESC(debounce_press, "Per pad, polls a press must be stable before it is reported, 1 to 7 (default 1 : no debounce)");
+
+static struct mk_config debounce_release_cfg __initdata;
+module_param_array_named(debounce_release, debounce_release_cfg.args, int, &(debounce_release_cfg.nargs), 0);
+MODULE_PARM_DESC(debounce_release, "Per pad, polls a release must be stable before it is reported, 1 to 7 (default 1 : no debounce)");
+
+static struct mk_config debounce_eager_cfg __initdata;
+module_param_array_named(debounce_eager, debounce_eager_cfg.args, int, &(debounce_eager_cfg.nargs), 0);
+MODULE_PARM_DESC(debounce_eager, "Per pad, report the first edge at once and ignore the input for debounce_press/debounce_release polls after it");
+
+static struct mk_config i2c0_int_cfg __initdata;
+module_param_array_named(i2c0_int, i2c0_int_cfg.args, int, &(i2c0_int_cfg.nargs), 0);
+MODULE_PARM_DESC(i2c0_int, "GPIO wired to the INTA/INTB line of each i2c0 MCP23017, in the same order, -1 for none");
+
+static struct mk_config i2c1_int_cfg __initdata;
+module_param_array_named(i2c1_int, i2c1_int_cfg.args, int, &(i2c1_int_cfg.nargs), 0);
+MODULE_PARM_DESC(i2c1_int, "GPIO wired to the INTA/INTB line of each i2c1 MCP23017, in the same order, -1 for none");
+
+static struct mk_config i2c0_leds_cfg __initdata;
+module_param_array_named(i2c0_leds, i2c0_leds_cfg.args, int, &(i2c0_leds_cfg.nargs), 0);
+MODULE_PARM_DESC(i2c0_leds, "Pins of each i2c0 MCP23017 driven as LED outputs, in the same order, a mask of GPB7..GPB0 GPA7..GPA0 (default 0 : none)");
+
+static struct mk_config i2c1_leds_cfg __initdata;
+module_param_array_named(i2c1_leds, i2c1_leds_cfg.args, int, &(i2c1_leds_cfg.nargs), 0);
+MODULE_PARM_DESC(i2c1_leds, "Pins of each i2c1 MCP23017 driven as LED outputs, in the same order, a mask of GPB7..GPB0 GPA7..GPA0 (default 0 : none)");
+
+static struct mk_config gpio_leds_cfg __initdata;
+module_param_array_named(gpio_leds, gpio_leds_cfg.args, int, &(gpio_leds_cfg.nargs), 0);
+MODULE_PARM_DESC(gpio_leds, "GPIOs driven as LED outputs, high when lit");
+
+static unsigned int i2c_int_poll_ms __initdata = 100;
+module_param(i2c_int_poll_ms, uint, 0);
+MODULE_PARM_DESC(i2c_int_poll_ms, "Safety poll period of the MCP23017 read on change of their INT line, in ms (default 100)");
+
+static bool bus_threads __initdata;
+module_param(bus_threads, bool, 0);
+MODULE_PARM_DESC(bus_threads, "Poll the GPIO pads, i2c-0 and i2c-1 from one real-time thread each, in parallel");
+
+static int bus_cpu[] __initdata = { -1, -1, -1 };
+module_param_array(bus_cpu, int, NULL, 0);
+MODULE_PARM_DESC(bus_cpu, "CPU to pin the gpio,i2c-0,i2c-1 polling threads to, -1 for any (default -1,-1,-1)");
+
+static bool gpio_irq;
+module_param(gpio_irq, bool, 0);
+MODULE_PARM_DESC(gpio_irq, "Report GPIO pads from edge interrupts instead of polling them");
+
+static int gpio_irq_base;
+module_param(gpio_irq_base, int, 0);
+MODULE_PARM_DESC(gpio_irq_base, "gpiolib number of BCM GPIO 0, used to look up pin interrupts (default 0)");
+
+static unsigned int poll_hz __initdata = 100;
+module_param(poll_hz, uint, 0);
+MODULE_PARM_DESC(poll_hz, "Polling rate in Hz, 50 to 2000 (default 100)");
+
+static bool state_page __initdata;
+module_param(state_page, bool, 0);
+MODULE_PARM_DESC(state_page, "Publish the pad states in a read-only page that can be mmap'd from /dev/mk_arcade_joystick");
+
+static unsigned int record;
+module_param(record, uint, 0);
+MODULE_PARM_DESC(record, "Keep the last reads of every pad in debugfs padN/record, up to 16384 (default 0, off)");
+
+static unsigned int poll_rate;
+module_param(poll_rate, uint, 0444);
+MODULE_PARM_DESC(poll_rate, "Measured polling rate over the last second, in Hz");
+
+static unsigned long poll_overruns;
+module_param(poll_overruns, ulong, 0444);
+MODULE_PARM_DESC(poll_overruns, "Poll periods missed because a poll cycle ran late");
+
+static unsigned long irq_latency_max_ns;
+module_param(irq_latency_max_ns, ulong, 0644);
+MODULE_PARM_DESC(irq_latency_max_ns, "Worst edge to input_sync latency seen on interrupt driven pads, write 0 to reset");
+
 enum mk_type {
     MK_NONE = 0,
     MK_ARCADE_GPIO,
@@ -156,20 +370,183 @@ enum mk_type {
     MK_ARCADE_MCP23017,
     MK_ARCADE_GPIO_TFT,
     MK_ARCADE_GPIO_CUSTOM,
+    MK_ARCADE_74HC165,
+    MK_ARCADE_MCP23S17,
+    MK_ARCADE_MCP3008,
     MK_MAX
 };
 
-#define MK_REFRESH_TIME	HZ/100
+#define MK_POLL_HZ_MIN	50
+#define MK_POLL_HZ_MAX	2000
+
+/*
+ * Autofire and macros of a pad, set through its sysfs attributes and read
+ * under RCU by the polls. Times are in timer ticks.
+ */
+#define MK_TIMED_TICKS_MAX	255
+#define MK_MACRO_STEPS		16
+
+struct mk_macro_step {
+    u16 state;              // inputs held during the step
+    u8 ticks;
+};
+
+struct mk_timed {
+    struct rcu_head rcu;
+    u16 autofire_mask;
+    u16 macro_mask;         // macro triggers, not reported themselves
+    u8 autofire_ticks[16];  // while held : pressed that many ticks, then released as many
+    u8 macro_len[16];
+    struct mk_macro_step macro[16][MK_MACRO_STEPS];
+};
+
+/*
+ * Calibration of the analog axes of a pad, in ADC steps, set through its
+ * calibration attribute and read under RCU by the SPI completion. The
+ * scales are Q16 factors from the deadzone edge to the end of the range,
+ * worked out when the calibration is set so that a sample costs a
+ * multiply.
+ */
+#define MK_ADC_AXES	3	/* X, Y, throttle */
+#define MK_ADC_THROTTLE	2
+#define MK_ABS_MAX	32767
+
+struct mk_adc_axis {
+    u16 min;
+    u16 center;             // the min on the throttle, which rests there
+    u16 max;
+    u16 deadzone;
+    u32 scale_lo;           // center - deadzone down to min
+    u32 scale_hi;           // center + deadzone up to max, or min + deadzone for the throttle
+};
+
+struct mk_adc_cal {
+    struct rcu_head rcu;
+    struct mk_adc_axis axes[MK_ADC_AXES];
+};
+
+/*
+ * Every read of a pad goes in a ring allocated with the pad, which the
+ * read is the only writer of : a reader checks that an entry was not
+ * overwritten while it copied it. A replay takes the place of the reads
+ * and the debounce, each entry being due as long after the first one as
+ * it was recorded.
+ */
+#define MK_RECORD_MAX	16384
+
+struct mk_rec_entry {
+    u64 stamp_ns;
+    u32 raw;
+    u32 state;              // debounced, before autofire and macros
+};
+
+struct mk_rec {
+    unsigned long head;     // entries written so far
+    unsigned int mask;      // entries - 1
+    struct mk_rec_entry entries[];
+};
+
+struct mk_replay {
+    int n;
+    int pos;                // entries that came due so far
+    ktime_t offset;         // from the recorded times to the replayed ones, set by the first read
+    struct mk_rec_entry entries[];
+};
+
+/*
+ * Timing histogram with power of two buckets : bucket 0 counts durations
+ * under 1us, bucket i those in [2^(i-1), 2^i) us, the last one the rest.
+ */
+#define MK_HIST_BUCKETS	16
+
+struct mk_hist {
+    u64 count;
+    u64 total_ns;
+    u64 max_ns;
+    u64 buckets[MK_HIST_BUCKETS];
+};
+
+/*
+ * A light on a spare output pin, driven through the LED class. Setting the
+ * brightness of an MCP23017 pin only flips a bit of the levels wanted, from
+ * any context; the next poll of the chip writes them when they differ from
+ * the last ones written, in the same bus slot, so lighting costs no
+ * transfer of its own and never delays a read. A GPIO LED is set at once.
+ */
+struct mk_led {
+    struct led_classdev cdev;
+    unsigned long *on;      // levels wanted of the pad, NULL for a GPIO LED or if not registered
+    int bit;
+    char name[32];
+};
 
 struct mk_pad {
     struct input_dev *dev;
+    int idx;
+    int users;              // evdev and state page openers, the pad is polled while > 0
+    int (*read)(struct mk_pad *pad, u32 *state);    // backend read, picked at setup
     enum mk_type type;
     char phys[32];
     int i2cdev;
     int i2caddr;
+    int hc165_pos;          // place of the pad on the 74HC165 chain, 0 next to the Pi
+    int spi_addr;           // MCP23S17 hardware address, A2..A0
+    int adc_ch[MK_ADC_AXES];        // MCP3008 channel of each axis, -1 if not wired
+    u16 adc_raw[MK_ADC_AXES];       // last samples
+    int abs_last[MK_ADC_AXES];      // last values reported to the input core
+    struct mk_adc_cal __rcu *adc_cal;
     int gpio_maps[12];
+    u32 gpio_mask;          // every GPLEV0 bit used by this pad
+    u32 gpio_bits[12];      // GPLEV0 bit of each button, 0 if unused
+    struct platform_device *gpiod_pdev;     // gpiod backend : the device the pins are claimed for
+    struct gpiod_lookup_table *gpiod_lookup;
+    struct gpio_descs *gpiods;              // every used pin, in button order
+    u8 gpiod_btn[12];       // button of each descriptor
+    bool gpiod_cansleep;    // the chip can only be read from a thread
+    int irqs[12];           // edge interrupt of each button in gpio_irq mode, 0 if none
+    bool irq_driven;
+    bool irqs_masked;       // pin interrupts disabled while the ticks poll the pad
+    struct mutex irq_lock;  // serializes read and report between the pin interrupts
+    ktime_t irq_stamp;      // time of the last edge
+    int int_gpio;           // GPIO wired to the MCP23017 INT line, -1 if none
+    int init_err;           // chip setup result, the pad is dropped when it failed
+    int int_irq;            // MCP23017 INT line interrupt, 0 if the chip is polled every tick
+    unsigned long int_flags;
+    ktime_t next_poll;      // next safety poll of a chip read on INT
+    u16 led_mask;           // MCP23017 pins driven as outputs, GPB7..GPA0
+    u16 led_out;            // their levels last written to the chip
+    unsigned long led_on;   // their levels the LEDs want
+    struct mk_led *leds;    // one per led_mask bit, NULL without any
+    u8 db_press;            // debounce thresholds in polls, 1 when not debounced
+    u8 db_release;
+    bool db_eager;
+    bool debounced;
+    u32 db_state;           // debounced packed state
+    u32 db_cnt[3];          // bit-sliced 3 bit counter of every input
+    u32 last_state;         // last packed state reported to the input core
+    struct mk_timed __rcu *timed;   // NULL when no autofire or macro is set
+    struct mk_rec *rec;     // NULL when the pad is not recorded
+    struct mk_replay __rcu *replay; // NULL when the pad is read
+    u32 timed_held;         // debounced state the last time it was seen
+    unsigned long af_press[16];     // tick each autofire input was pressed on
+    u32 macro_trig;         // trigger of the running macro, 0 if none
+    int macro_step;
+    unsigned long macro_step_end;   // tick the running step ends on
+    unsigned int fails;     // failed reads in a row
+    bool quarantined;       // left out of the polls until next_probe
+    unsigned int backoff_ms;
+    ktime_t next_probe;
+    u64 read_errors;
+    u64 quarantines;
+    u64 frames_emitted;
+    u64 frames_skipped;     // polls with no change, not reported at all
+    u64 events;             // input events emitted
+    struct mk_hist read_hist;
+    struct dentry *debugfs;
 };
 
+#define MK_PAD_INT_PENDING	0
+
 /*
 struct mk_nin_gpio {
     unsigned pad_id;
@@ -183,22 +560,193 @@ struct mk_nin_gpio {
 };
 */
 
+/*
+ * The GPIO block, BSC0 and BSC1 are independent, so in bus_threads mode each
+ * is polled by its own kthread worker, all started from the same tick. The
+ * SPI buses are run by the SPI core, the tick only queues their message.
+ */
+enum mk_bus {
+    MK_BUS_GPIO = 0,
+    MK_BUS_I2C0,
+    MK_BUS_I2C1,
+    MK_BUS_SPI,
+    MK_BUS_ADC,             // the MCP3008, on its own chip select
+    MK_BUS_MAX
+};
+
+struct mk_bus_worker {
+    struct kthread_worker *worker;
+    struct kthread_work work;
+    enum mk_bus bus;
+};
+
+/*
+ * The pads of a bus that someone has open, packed so that a poll walks only
+ * those, grouped by backend. Readers (the tick, the bus workers, the INT
+ * lines and the BSC interrupt) take mk_srcu; mk->mutex holders publish a
+ * new set and free the old one once no reader walks it.
+ */
+enum mk_poll_group {
+    MK_GROUP_LEV,           // GPIO bus : register backed pads, read from one GPLEV0 snapshot
+    MK_GROUP_HC165,         // GPIO bus : pads on the 74HC165 chain, read with one shift
+    MK_GROUP_READ,          // pads read one by one with pad->read
+    MK_GROUP_MAX
+};
+
+struct mk_poll_set {
+    int n;
+    int n_group[MK_GROUP_MAX];
+    struct mk_pad *pads[];  // MK_GROUP_LEV pads first, then MK_GROUP_HC165, then the others
+};
+
 struct mk {
-    struct mk_pad pads[MK_MAX_DEVICES];
-    struct timer_list timer;
+    struct mk_pad **pads;   // the first count are in use
+    int size;
+    struct mk_bus_worker workers[MK_BUS_MAX];
+    struct mk_poll_set __rcu *poll[MK_BUS_MAX];
+    struct hrtimer timer;
+    ktime_t period;
+    ktime_t rate_start;     // start of the poll_rate measurement window
+    unsigned int rate_ticks;
     int pad_count[MK_MAX];
-    int used;
+    int gpio_count;
+    bool gpio_cansleep;     // a gpiod pad needs the GPIO bus polled from a thread
+    struct dentry *debugfs;
+    struct mk_hist lateness_hist;   // timer expiry to callback
+    struct mk_hist poll_hist;       // whole poll cycle
+    struct mk_hist gpio_hist;       // GPIO bus poll
+    u64 rate_events;                // events emitted when the rate window started
+    u32 events_per_sec;
+    int polled;             // pads in the poll lists, the timer runs while > 0
+    unsigned long ticks;    // timer ticks so far, the clock of autofire and macros
+    int state_users;        // state page readers, counted in the users of every pad
+    spinlock_t pads_lock;   // pads and count changing at runtime, against the events_per_sec sum of the timer
+    u64 events_gone;        // events of the pads removed at runtime
     struct mutex mutex;
     int count;
+    struct work_struct replay_end;  // drops the replays that came to their end
+};
+
+/*
+ * One BSC controller. In i2c_irq mode the reads of all pads on the bus are
+ * queued as a batch that the controller interrupt walks through; the batch
+ * is owned by the interrupt handler while MK_BSC_BUSY is set.
+ */
+#define MK_BSC_BUSY	0
+#define MK_BSC_TICK	1	/* the queued bus work is a timer tick, not an INT line */
+#define MK_BSC_MAX_CHIPS	8	/* MCP23017 addresses 0x20..0x27 */
+
+struct mk_bsc {
+    volatile unsigned *regs;
+    unsigned long base;
+    int irq;                // 0 when the bus is read synchronously
+    unsigned long clk_hz;   // rate of the clock CDIV divides, read from the DT at load
+    spinlock_t lock;        // serializes synchronous reads from the timer and the INT lines
+    int n_pads;             // pads on the bus, open or not
+    unsigned long flags;
+    struct mk_pad *batch[MK_BSC_MAX_CHIPS]; // pads to read this time
+    int batch_len;
+    unsigned long batches;  // batches ended, for mk_bsc_wait_batch()
+    int pos;                // pad being read in the batch
+    int rx;
+    u8 buf[2];
+    int leds[MK_BSC_MAX_CHIPS];         // LED levels written before each read, -1 for none
+    bool read[MK_BSC_MAX_CHIPS];        // false for a closed pad, which only has its LEDs written
+    u32 state[MK_BSC_MAX_CHIPS];
+    bool valid[MK_BSC_MAX_CHIPS];
+    ktime_t stamp[MK_BSC_MAX_CHIPS];    // start of each read of the batch
+    unsigned long skipped;  // polls skipped because the previous batch was still running
+    ktime_t xfer_start;     // start of the transfer in flight
+    ktime_t xfer_deadline;  // the transfer in flight is aborted by the next tick after this
+    spinlock_t xfer_lock;   // serializes the DONE interrupt and the abort of a stuck transfer
+    unsigned long errors;   // transfers that ended with BSC_S_ERR (no ACK)
+    unsigned long timeouts; // transfers that ended with BSC_S_CLKT (clock stretch timeout)
+    struct mk_hist xfer_hist;
+    struct mk_hist poll_hist;
+};
+
+static ktime_t mk_int_poll_period;
+static unsigned int mk_i2c_clk_ns;     // one SCL period
+
+// chip setup of the two buses at module load
+static ASYNC_DOMAIN_EXCLUSIVE(mk_async_domain);
+
+// protects the poll sets, see struct mk_poll_set
+DEFINE_STATIC_SRCU(mk_srcu);
+static struct mk_poll_set mk_poll_empty;
+
+static struct mk_bsc mk_bsc[2] = {
+    { .base = BSC0_BASE },  /* /dev/i2c-0 */
+    { .base = BSC1_BASE },  /* /dev/i2c-1 */
+};
+
+/*
+ * A daisy chain of 74HC165 shift registers, two per pad, bit banged on
+ * three GPIOs. One shift reads the chain as far as the last open pad.
+ */
+#define MK_HC165_BITS	16
+
+struct mk_hc165 {
+    int load;               // SH/LD of every chip
+    int clock;              // CLK of every chip
+    int data;               // QH of the chip next to the Pi
+    int n_pads;
+    u16 state[MK_MAX_DEVICES];  // packed state of each pad at the last shift
+    ktime_t stamp;          // time of the last parallel load
+};
+
+static struct mk_hc165 mk_hc165;
+
+/* Pi GPIOs driven as LEDs, written with GPSET0/GPCLR0 as soon as they are set */
+struct mk_gpio_leds {
+    u32 mask;
+    int n;
+    struct mk_led leds[MK_MAX_DEVICES];
+};
+
+static struct mk_gpio_leds mk_gpio_leds;
+
+/*
+ * The MCP23S17 chips behind one SPI chip select, told apart by their
+ * hardware address (IOCON.HAEN). Each tick the reads of all open pads are
+ * queued as one spi_message, a 4 byte full duplex transfer per chip; the
+ * message belongs to the SPI core from spi_async() to its completion,
+ * while MK_SPI_BUSY is set. The MCP3008 on its own chip select is run the
+ * same way, with a 3 byte transfer per channel.
+ */
+#define MK_SPI_BUSY		0
+#define MK_SPI_MAX_CHIPS	8
+#define MK_SPI_MAX_XFERS	8	/* a chip or an ADC channel each */
+#define MK_SPI_XFER_LEN		4	/* opcode, register, GPIOA, GPIOB */
+#define MK_ADC_XFER_LEN		3	/* start, channel, then the 10 bit result in the last 2 bytes */
+
+struct mk_spi {
+    struct spi_device *spi;
+    unsigned long flags;
+    struct spi_message msg;
+    struct spi_transfer xfers[MK_SPI_MAX_XFERS];
+    struct mk_pad *batch[MK_SPI_MAX_XFERS];     // pad of each transfer this time
+    u8 batch_axis[MK_SPI_MAX_XFERS];            // MCP3008 : axis of each transfer
+    int batch_len;
+    ktime_t xfer_start;     // when the message was queued
+    unsigned long errors;   // messages that failed
+    unsigned long skipped;  // polls skipped because the previous message was still running
+    struct mk_hist xfer_hist;
+    // the controller may DMA to and from these, keep them off the lines above
+    u8 tx[MK_SPI_MAX_XFERS][MK_SPI_XFER_LEN] ____cacheline_aligned;
+    u8 rx[MK_SPI_MAX_XFERS][MK_SPI_XFER_LEN] ____cacheline_aligned;
 };
 
+static struct mk_spi *mk_spi;   // kzalloc'd for the DMA buffers, NULL without MCP23S17 pads
+static struct mk_spi *mk_adc;   // NULL without MCP3008 pads
+
 struct mk_subdev {
     unsigned int idx;
 };
 
 static struct mk *mk_base;
 
-static const int mk_data_size = 16;
+static struct mk_state_page *mk_state;     // NULL unless state_page is set
 
 static const int mk_max_arcade_buttons = 12;
 static const int mk_max_mcp_arcade_buttons = 16;
@@ -208,10 +756,12 @@ static const int mk_arcade_gpio_maps[] =       { 4,  17,   27,   22,    10,    9
 // 2nd joystick on the b+ GPIOS                  up, down, left, right, start, select, a,  b,  tr, y,  x,  tl
 static const int mk_arcade_gpio_maps_bplus[] = { 11, 5,    6,    13,    19,    26,     21, 20, 16, 12, 7,  8  };
 
-// Map of the mcp23017 on GPIOA                  up, down, left, right, start, select, a,  b
-static const int mk_arcade_gpioa_maps[] =      { 0,  1,    2,    3,     4,     5,      6,  7 };
-// Map of the mcp23017 on GPIOB                  tr, y,    x,    tl,    c,     tr2,    z,  tl2
-static const int mk_arcade_gpiob_maps[] =      { 0,  1,    2,    3,     4,     5,      6,  7 };
+// Packed pad state, one bit per input, set when pressed :
+//   bit  0..3  up, down, left, right
+//   bit  4..11 start, select, a, b, tr, y, x, tl
+//   bit 12..15 c, tr2, z, tl2 (MCP23017 only)
+// The MCP23017 layout is GPIOA on bits 0..7 and GPIOB on bits 8..15, so its
+// packed state is simply the inverted 16 bit port value.
 
 // Map joystick on the b+ GPIOS with TFT         up, down, left, right, start, select, a,  b,  tr, y,  x,  tl
 static const int mk_arcade_gpio_maps_tft[] =   { 21, 13,   26,   19,    5,     6,      22, 4,  20, 17, 27, 16 };
@@ -220,18 +770,28 @@ static const short mk_arcade_gpio_btn[] = {
 	BTN_START, BTN_SELECT, BTN_A, BTN_B, BTN_TR, BTN_Y, BTN_X, BTN_TL, BTN_C, BTN_TR2, BTN_Z, BTN_TL2
 };
 
+// Input names in packed state order, for the sysfs attributes
+static const char *mk_input_names[] = {
+    "up", "down", "left", "right", "start", "select", "a", "b", "tr", "y", "x", "tl", "c", "tr2", "z", "tl2"
+};
+
+// Analog axes of an MCP3008 pad
+static const char *mk_adc_axis_names[MK_ADC_AXES] = { "x", "y", "throttle" };
+static const short mk_adc_abs[MK_ADC_AXES] = { ABS_X, ABS_Y, ABS_THROTTLE };
+
 static const char *mk_names[] = {
-  NULL, "GPIO Controller 1", "GPIO Controller 2", "MCP23017 Controller", "GPIO Controller w/ TFT" , "GPIO Controller 1 Custom"
+  NULL, "GPIO Controller 1", "GPIO Controller 2", "MCP23017 Controller", "GPIO Controller w/ TFT" , "GPIO Controller 1 Custom",
+  "74HC165 Controller", "MCP23S17 Controller", "MCP3008 Analog Controller"
 };
 
 /* GPIO UTILS */
 static void setGpioPullUps(int pullUps) {
-    *(gpio + 37) = 0x02;
+    mk_writel(gpio, GPIO_GPPUD, 0x02);
     udelay(10);
-    *(gpio + 38) = pullUps;
+    mk_writel(gpio, GPIO_GPPUDCLK0, pullUps);
     udelay(10);
-    *(gpio + 37) = 0x00;
-    *(gpio + 38) = 0x00;
+    mk_writel(gpio, GPIO_GPPUD, 0x00);
+    mk_writel(gpio, GPIO_GPPUDCLK0, 0x00);
 }
 
 static void setGpioAsInput(int gpioNum) {
@@ -250,8 +810,46 @@ static int getPullUpMask(int gpioMap[]){
     return mask;
 }
 
+/* INSTRUMENTATION */
+static void mk_hist_add(struct mk_hist *h, s64 ns) {
+    u64 us;
+    int b = 0;
+
+    if (ns < 0)
+        ns = 0;
+    us = div_u64(ns, NSEC_PER_USEC);
+    if (us)
+        b = min(ilog2(us) + 1, MK_HIST_BUCKETS - 1);
+
+    h->buckets[b]++;
+    h->count++;
+    h->total_ns += ns;
+    if (ns > h->max_ns)
+        h->max_ns = ns;
+}
+
+static void mk_bsc_xfer_done(struct mk_bsc *b, int addr, bool read, u32 status, ktime_t start) {
+    s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+    if (status & BSC_S_ERR)
+        b->errors++;
+    if ((status & BSC_S_CLKT) || !(status & BSC_S_DONE))
+        b->timeouts++;
+    mk_hist_add(&b->xfer_hist, ns);
+    trace_mk_bsc_xfer(b - mk_bsc, addr, read, status, ns);
+}
+
+static void mk_pad_read_done(struct mk_pad *pad, u32 state, ktime_t start) {
+    s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+    mk_hist_add(&pad->read_hist, ns);
+    trace_mk_pad_read(pad->idx, state, ns);
+}
+
 /* I2C UTILS */
-static void i2c_init(char dev) {
+static void i2c_init(char dev, unsigned int speed_khz) {
+    unsigned int cdiv = 0;
+
     if (dev==0) {                 // Pins 27 & 28 on GPIO header
         INP_GPIO(0);
 	SET_GPIO_ALT(0, 0);
@@ -262,414 +860,3951 @@ static void i2c_init(char dev) {
 	SET_GPIO_ALT(2, 0);
 	INP_GPIO(3);
 	SET_GPIO_ALT(3, 0);
-    } else
+    } else {
         pr_err("Invalid interface number [0,1] (%d)\n",dev);
+        return;
+    }
+
+    // CDIV is rounded down to an even value by the controller, round it up so the bus never runs faster than asked
+    if (speed_khz) {
+        cdiv = clamp_t(unsigned long, round_up(DIV_ROUND_UP(mk_bsc[(int)dev].clk_hz, speed_khz * 1000), 2), 2, BSC_CDIV_MAX);
+        bsc_write(&mk_bsc[(int)dev], BSC_DIV, cdiv);
+        mk_i2c_clk_ns = div_u64((u64)cdiv * NSEC_PER_SEC, mk_bsc[(int)dev].clk_hz);
+        pr_info("i2c-%d clock %lu kHz\n", dev, mk_bsc[(int)dev].clk_hz / cdiv / 1000);
+    }
+    bsc_write(&mk_bsc[(int)dev], BSC_CLKT, BSC_CLKT_TOUT);
 }
 
-static void wait_i2c_done(char dev) {
-    if (dev==0) {
-        while ((!((BSC0_S) & BSC_S_DONE)))
-	    udelay(100);
-    } else if (dev==1) {
-        while ((!((BSC1_S) & BSC_S_DONE)))
-	    udelay(100);
-    } else
-        pr_err("Invalid interface number [0,1] (%d)\n",dev);
+/*
+ * Every transfer gets twice its time on the wire, 9 clocks for the address
+ * and for each byte, plus some slack. A transfer still running past that is
+ * aborted, so a chip that holds the bus costs a bounded time.
+ */
+static ktime_t mk_bsc_deadline(unsigned short len) {
+    return ktime_add_ns(ktime_get(), (len + 1) * 9 * 2 * mk_i2c_clk_ns + MK_I2C_SLACK_NS);
+}
+
+static int mk_bsc_status_err(u32 status) {
+    if (status & BSC_S_ERR)
+        return -EIO;            // no ACK
+    if ((status & BSC_S_CLKT) || !(status & BSC_S_DONE))
+        return -ETIMEDOUT;
+    return 0;
+}
+
+static void mk_bsc_abort(struct mk_bsc *b) {
+    bsc_write(b, BSC_C, BSC_C_CLEAR);   // disables the controller, which ends the transfer
+    bsc_write(b, BSC_S, CLEAR_STATUS);
+}
+
+static u32 wait_i2c_done(struct mk_bsc *b, ktime_t deadline) {
+    u32 status;
+
+    while (!((status = bsc_read(b, BSC_S)) & BSC_S_DONE)) {
+        if (ktime_after(ktime_get(), deadline)) {
+            mk_bsc_abort(b);
+            break;
+        }
+        cpu_relax();
+    }
+    return status;
 }
 
 // Function to write data to an I2C device via the FIFO.  This doesn't refill the FIFO, so writes are limited to 16 bytes
 // including the register address. len specifies the number of bytes in the buffer.
+// Returns 0, -EIO when the device did not ACK or -ETIMEDOUT.
 
-static void i2c_write(char dev, char dev_addr, char reg_addr, char *buf, unsigned short len) {
+static int i2c_write(char dev, char dev_addr, char reg_addr, char *buf, unsigned short len) {
+    struct mk_bsc *b = &mk_bsc[(int)dev];
+    ktime_t start = ktime_get();
+    ktime_t deadline = mk_bsc_deadline(len + 1);
+    u32 status;
     int idx;
 
-    if (dev==0) {
-        BSC0_A = dev_addr;
-	BSC0_DLEN = len + 1; // one byte for the register address, plus the buffer length
-	BSC0_FIFO = reg_addr; // start register address
-	for (idx = 0; idx < len; idx++)
-  	    BSC0_FIFO = buf[idx];
-	BSC0_S = CLEAR_STATUS; // Reset status bits (see #define)
-	BSC0_C = START_WRITE; // Start Write (see #define)
-	wait_i2c_done(dev);
-
-    } else if (dev==1) {
-        BSC1_A = dev_addr;
-	BSC1_DLEN = len + 1; // one byte for the register address, plus the buffer length
-	BSC1_FIFO = reg_addr; // start register address
-	for (idx = 0; idx < len; idx++)
-  	    BSC1_FIFO = buf[idx];
-	BSC1_S = CLEAR_STATUS; // Reset status bits (see #define)
-	BSC1_C = START_WRITE; // Start Write (see #define)
-	wait_i2c_done(dev);
-
-    } else
-        pr_err("Invalid interface number [0,1] (%d)\n",dev);
+    bsc_write(b, BSC_A, dev_addr);
+    bsc_write(b, BSC_DLEN, len + 1); // one byte for the register address, plus the buffer length
+    bsc_write(b, BSC_FIFO, reg_addr); // start register address
+    for (idx = 0; idx < len; idx++)
+        bsc_write(b, BSC_FIFO, buf[idx]);
+    bsc_write(b, BSC_S, CLEAR_STATUS); // Reset status bits (see #define)
+    bsc_write(b, BSC_C, START_WRITE); // Start Write (see #define)
+    status = wait_i2c_done(b, deadline);
+    mk_bsc_xfer_done(b, dev_addr, false, status, start);
+    return mk_bsc_status_err(status);
 }
 
-// Function to read a number of bytes into a  buffer from the FIFO of the I2C controller
+// Function to read a number of bytes into a buffer from the FIFO of the I2C controller, starting at the
+// register the device address pointer currently points to. This is a single read transaction.
+// Returns 0, -EIO when the device did not ACK or -ETIMEDOUT.
 
-static void i2c_read(char dev, char dev_addr, char reg_addr, char *buf, unsigned short len) {
+static int i2c_read_current(char dev, char dev_addr, u8 *buf, unsigned short len) {
+    struct mk_bsc *b = &mk_bsc[(int)dev];
+    ktime_t start = ktime_get();
+    ktime_t deadline = mk_bsc_deadline(len);
     unsigned short bufidx;
+    u32 status;
     bufidx = 0;
 
-    i2c_write(dev, dev_addr, reg_addr, NULL, 0);
     memset(buf, 0, len);             // clear the buffer
 
-    if (dev==0) {
-        BSC0_DLEN = len;
-	BSC0_S = CLEAR_STATUS;       // Reset status bits (see #define)
-	BSC0_C = START_READ;         // Start Read after clearing FIFO (see #define)
-	do {
-	    // Wait for some data to appear in the FIFO
-	    while ((BSC0_S & BSC_S_TA) && !(BSC0_S & BSC_S_RXD));
-	    // Consume the FIFO
-	    while ((BSC0_S & BSC_S_RXD) && (bufidx < len))
-	        buf[bufidx++] = BSC0_FIFO;
-	} while ((!(BSC0_S & BSC_S_DONE)));
-
-    } else if (dev==1) {
-        BSC1_DLEN = len;
-	BSC1_S = CLEAR_STATUS;       // Reset status bits (see #define)
-	BSC1_C = START_READ;         // Start Read after clearing FIFO (see #define)
-	do {
-	    // Wait for some data to appear in the FIFO
-	    while ((BSC1_S & BSC_S_TA) && !(BSC1_S & BSC_S_RXD));
-	    // Consume the FIFO
-	    while ((BSC1_S & BSC_S_RXD) && (bufidx < len))
-	        buf[bufidx++] = BSC1_FIFO;
-	} while ((!(BSC1_S & BSC_S_DONE)));
-
-    } else
-        pr_err("Invalid interface number [0,1] (%d)\n",dev);
+    bsc_write(b, BSC_A, dev_addr);
+    bsc_write(b, BSC_DLEN, len);
+    bsc_write(b, BSC_S, CLEAR_STATUS);       // Reset status bits (see #define)
+    bsc_write(b, BSC_C, START_READ);         // Start Read after clearing FIFO (see #define)
+    for (;;) {
+        status = bsc_read(b, BSC_S);
+        // Consume the FIFO
+        while ((status & BSC_S_RXD) && (bufidx < len)) {
+            buf[bufidx++] = bsc_read(b, BSC_FIFO);
+            status = bsc_read(b, BSC_S);
+        }
+        if (status & BSC_S_DONE)
+            break;
+        if (ktime_after(ktime_get(), deadline)) {
+            mk_bsc_abort(b);
+            break;
+        }
+        cpu_relax();
+    }
+    mk_bsc_xfer_done(b, dev_addr, true, status, start);
+    if (mk_bsc_status_err(status))
+        return mk_bsc_status_err(status);
+    return bufidx == len ? 0 : -EIO;
 }
 
-/*  ------------------------------------------------------------------------------- */
+// Function to read a number of bytes into a buffer starting at register reg_addr : a register address write,
+// then a read transaction.
 
-static void mk_mcp23017_read_packet(struct mk_pad *pad, unsigned char *data) {
-    int i;
-    char resultA, resultB;
-    i2c_read(pad->i2cdev, pad->i2caddr, MPC23017_GPIOA_READ, &resultA, 1);
-    i2c_read(pad->i2cdev, pad->i2caddr, MPC23017_GPIOB_READ, &resultB, 1);
+static int i2c_read(char dev, char dev_addr, char reg_addr, u8 *buf, unsigned short len) {
+    int err = i2c_write(dev, dev_addr, reg_addr, NULL, 0);
 
-    // read direction
-    for (i = 0; i < 4; i++) {
-        data[i] = !((resultA >> mk_arcade_gpioa_maps[i]) & 0x1);
-    }
-    // read buttons on gpioa
-    for (i = 4; i < 8; i++) {
-        data[i] = !((resultA >> mk_arcade_gpioa_maps[i]) & 0x1);
-    }
-    // read buttons on gpiob
-    for (i = 8; i < 16; i++) {
-        data[i] = !((resultB >> (mk_arcade_gpiob_maps[i-8])) & 0x1);
-    }
+    return err ? err : i2c_read_current(dev, dev_addr, buf, len);
 }
 
-static void mk_gpio_read_packet(struct mk_pad * pad, unsigned char *data) {
-    int i;
-
-    for (i = 0; i < mk_max_arcade_buttons; i++) {
-        if(pad->gpio_maps[i] != -1){    // to avoid unused buttons
-            int read = GPIO_READ(pad->gpio_maps[i]);
-            if (read == 0) data[i] = 1;
-            else data[i] = 0;
-        } else data[i] = 0;
-    }
+/*  ------------------------------------------------------------------------------- */
 
-}
+/*
+ * The chip runs in byte mode (IOCON.SEQOP) with its address pointer left on
+ * GPIOA by mk_setup_pad_i2c(). Each 2 byte read returns GPIOA then GPIOB and
+ * toggles the pointer back to GPIOA, so a poll is one read transaction with
+ * no register address write.
+ */
+static int mk_mcp23017_read_packet(struct mk_pad *pad, u32 *state) {
+    u8 result[2];
+    int err = i2c_read_current(pad->i2cdev, pad->i2caddr, result, 2);
 
-static void mk_input_report(struct mk_pad * pad, unsigned char * data) {
-    struct input_dev * dev = pad->dev;
-    int j;
-    input_report_abs(dev, ABS_Y, !data[0]-!data[1]);
-    input_report_abs(dev, ABS_X, !data[2]-!data[3]);
-	if (pad->type == MK_ARCADE_MCP23017) {	// check if MCP23017 and extend with 4.
-		for (j = 4; j < (mk_max_mcp_arcade_buttons); j++) {
-			input_report_key(dev, mk_arcade_gpio_btn[j - 4], data[j]);
-		}
-	}
-	else {
-		for (j = 4; j < mk_max_arcade_buttons; j++) {
-			input_report_key(dev, mk_arcade_gpio_btn[j - 4], data[j]);
-		}
-	}
-    input_sync(dev);
+    // inputs are pulled up, a pressed switch reads 0; the LED pins read their own level
+    *state = ~(result[0] | (result[1] << 8)) & 0xffff & ~pad->led_mask;
+    return err;
 }
 
-static void mk_process_packet(struct mk *mk) {
+// the LED levels to write with the next read, -1 when the chip has them already
+static int mk_mcp23017_leds_due(struct mk_pad *pad) {
+    u16 on = READ_ONCE(pad->led_on) & pad->led_mask;
 
-    unsigned char data[mk_data_size];
-    struct mk_pad *pad;
-    int i;
+    return on != pad->led_out ? on : -1;
+}
 
-    for (i = 0; i < MK_MAX_DEVICES; i++) {
-        pad = &mk->pads[i];
-        if (pad->type == MK_ARCADE_GPIO || pad->type == MK_ARCADE_GPIO_BPLUS || pad->type == MK_ARCADE_GPIO_TFT || pad->type == MK_ARCADE_GPIO_CUSTOM) {
-            mk_gpio_read_packet(pad, data);
-            mk_input_report(pad, data);
-        }
-        if (pad->type == MK_ARCADE_MCP23017) {
-            mk_mcp23017_read_packet(pad, data);
-            mk_input_report(pad, data);
-        }
-    }
+/*
+ * The LED levels go to GPIOA/GPIOB, which sets the output latches : in byte
+ * mode the 2 byte write leaves the address pointer back on GPIOA, so the
+ * read that follows needs no register address write either.
+ */
+static int mk_mcp23017_write_leds(struct mk_pad *pad, u16 on) {
+    char buf[2] = { on & 0xff, on >> 8 };
+    int err = i2c_write(pad->i2cdev, pad->i2caddr, MPC23017_GPIOA_READ, buf, 2);
 
+    if (!err)
+        pad->led_out = on;
+    return err;
 }
 
 /*
- * mk_timer() initiates reads of console pads data.
+ * The chip latches GPIOA when it sends the first data byte, right after the
+ * address byte : 9 clocks after the start of the read transfer.
  */
-
-static void mk_timer(struct timer_list *t) {
-    struct mk *mk = (void *) mk_base;
-    mk_process_packet(mk);
-    mod_timer(&mk->timer, jiffies + MK_REFRESH_TIME);
+static ktime_t mk_mcp23017_sample_time(ktime_t xfer_start) {
+    return ktime_add_ns(xfer_start, 9 * mk_i2c_clk_ns);
 }
 
-static int mk_open(struct input_dev *dev) {
-    struct mk *mk = input_get_drvdata(dev);
+/*
+ * Writes the chip configuration : every input with its pullup, the LED
+ * pins as outputs starting off, the INT setup, byte mode, and the address
+ * pointer left on GPIOA for mk_mcp23017_read_packet().
+ *
+ * Every A/B register pair is written as one 2 byte burst. Out of reset the
+ * address pointer increments from A to B, and when the chip is already in
+ * byte mode it toggles between A and B, so the same burst works in both
+ * cases.
+ */
+static int mk_mcp23017_config(struct mk_pad *pad) {
+    char FF2[2] = { 0xFF, 0xFF };
+    char zero2[2] = { 0, 0 };
+    char in2[2] = { ~pad->led_mask & 0xff, (~pad->led_mask >> 8) & 0xff };
+    char iocon = MPC23017_IOCON_SEQOP;
     int err;
 
-    err = mutex_lock_interruptible(&mk->mutex);
-    if (err)
+    // the latches are cleared before the pins drive them, as in a power cycled chip
+    if (pad->led_mask) {
+        if ((err = i2c_write(pad->i2cdev, pad->i2caddr, MPC23017_OLATA, zero2, 2)))
+            return err;
+        pad->led_out = 0;
+    }
+    if ((err = i2c_write(pad->i2cdev, pad->i2caddr, MPC23017_GPIOA_MODE, in2, 2)))
+        return err;
+    if ((err = i2c_write(pad->i2cdev, pad->i2caddr, MPC23017_GPIOA_PULLUPS_MODE, FF2, 2)))
         return err;
+    // Interrupt on any change of an input of either port, signalled on both INT lines
+    if (pad->int_gpio >= 0) {
+        iocon |= MPC23017_IOCON_MIRROR;
+        if ((err = i2c_write(pad->i2cdev, pad->i2caddr, MPC23017_INTCONA, zero2, 2)))
+            return err;
+        if ((err = i2c_write(pad->i2cdev, pad->i2caddr, MPC23017_GPINTENA, in2, 2)))
+            return err;
+    }
+    if ((err = i2c_write(pad->i2cdev, pad->i2caddr, MPC23017_IOCON, &iocon, 1)))
+        return err;
+    return i2c_write(pad->i2cdev, pad->i2caddr, MPC23017_GPIOA_READ, NULL, 0);
+}
 
-    if (!mk->used++)
-        mod_timer(&mk->timer, jiffies + MK_REFRESH_TIME);
+/*
+ * MCP23S17 register access outside of the polls, from a context that can
+ * sleep. The register map is the MCP23017 one; the opcode byte carries the
+ * hardware address and every access sends its register address, so the
+ * chip runs with the address pointer incrementing (IOCON.SEQOP clear).
+ */
+static int mk_mcp23s17_write(int addr, u8 reg, const u8 *buf, int len) {
+    u8 cmd[4] = { MCP23S17_OPCODE | addr << 1, reg };
 
-    mutex_unlock(&mk->mutex);
-    return 0;
+    memcpy(&cmd[2], buf, min(len, 2));
+    return spi_write_then_read(mk_spi->spi, cmd, 2 + min(len, 2), NULL, 0);
 }
 
-static void mk_close(struct input_dev *dev) {
-    struct mk *mk = input_get_drvdata(dev);
+static int mk_mcp23s17_read(int addr, u8 reg, u8 *buf, int len) {
+    u8 cmd[2] = { MCP23S17_OPCODE | addr << 1 | MCP23S17_READ, reg };
 
-    mutex_lock(&mk->mutex);
-    if (!--mk->used) {
-        del_timer_sync(&mk->timer);
-    }
-    mutex_unlock(&mk->mutex);
+    return spi_write_then_read(mk_spi->spi, cmd, 2, buf, len);
 }
 
-static int __init mk_setup_pad_i2c(struct mk *mk, int idx, char i2cdev, int i2caddr) {
-    int i, err;
-    char FF = 0xFF;
-    struct mk_pad *pad = &mk->pads[idx];
-
-    if (idx>=MK_MAX_DEVICES) {
-        pr_err("Device count exceeds max\n");
-        return -EINVAL;
-    }
+// a pad read on its own, the polls read all the chips in one message
+static int mk_mcp23s17_read_packet(struct mk_pad *pad, u32 *state) {
+    u8 result[2];
+    int err = mk_mcp23s17_read(pad->spi_addr, MPC23017_GPIOA_READ, result, 2);
 
-    if (i2cdev<0 || i2cdev>1) {
-        pr_err("Only i2c-0 and i2c-1 are supported (%d)\n",i2cdev);
-	return -EINVAL;
-    }
+    // inputs are pulled up, a pressed switch reads 0
+    *state = ~(result[0] | (result[1] << 8)) & 0xffff;
+    return err;
+}
 
-    if (i2caddr<0x20 || i2cdev>=0x28) {
-        pr_err("Invalid i2c address for MCP23017 (%2x)\n",i2caddr);
-	return -EINVAL;
-    }
+static int mk_mcp23s17_config(struct mk_pad *pad) {
+    u8 FF2[2] = { 0xFF, 0xFF };
+    u8 iocon = MPC23017_IOCON_HAEN;
+    int err;
 
-    pr_err("Input %d, Pad type : %d\n",idx,MK_ARCADE_MCP23017);
+    if ((err = mk_mcp23s17_write(pad->spi_addr, MPC23017_IOCON, &iocon, 1)))
+        return err;
+    if ((err = mk_mcp23s17_write(pad->spi_addr, MPC23017_GPIOA_MODE, FF2, 2)))
+        return err;
+    return mk_mcp23s17_write(pad->spi_addr, MPC23017_GPIOA_PULLUPS_MODE, FF2, 2);
+}
 
-    if (!(pad->dev = input_allocate_device())) {
-        pr_err("Not enough memory for input device\n");
-        return -ENOMEM;
-    }
 
-    pad->type = MK_ARCADE_MCP23017;
-    pad->i2cdev  = i2cdev;
-    pad->i2caddr = i2caddr;
-    snprintf(pad->phys, sizeof (pad->phys), "input%d", idx);
-    pad->dev->name = mk_names[MK_ARCADE_MCP23017];
-    pad->dev->phys = pad->phys;
-    pad->dev->id.bustype = BUS_PARPORT;
-    pad->dev->id.vendor = 0x0001;
-    pad->dev->id.product = MK_ARCADE_MCP23017;
-    pad->dev->id.version = 0x0100;
+static u32 mk_gpio_read_packet(struct mk_pad *pad, u32 lev) {
+    u32 low = ~lev & pad->gpio_mask;  // inputs are pulled up, a pressed switch reads 0
+    u32 state = 0;
+    int i;
 
-    input_set_drvdata(pad->dev, mk);
+    if (!low)
+        return 0;
 
-    pad->dev->open = mk_open;
-    pad->dev->close = mk_close;
+    for (i = 0; i < mk_max_arcade_buttons; i++)
+        if (low & pad->gpio_bits[i])
+            state |= BIT(i);
 
-    pad->dev->evbit[0] = BIT_MASK(EV_KEY) | BIT_MASK(EV_ABS);
+    return state;
+}
 
-    for (i = 0; i < 2; i++)
-        input_set_abs_params(pad->dev, ABS_X + i, -1, 1, 0, 0);
-    for (i = 0; i < mk_max_mcp_arcade_buttons; i++)
-        __set_bit(mk_arcade_gpio_btn[i], pad->dev->keybit);
+// a register backed pad read on its own, outside of the poll snapshot
+static int mk_gpio_read_lev(struct mk_pad *pad, u32 *state) {
+    *state = mk_gpio_read_packet(pad, GPIO_LEV);
+    return 0;
+}
 
-    i2c_init(pad->i2cdev);
-    udelay(1000);
-    // Put all GPIOA inputs on MCP23017 in INPUT mode
-    i2c_write(i2cdev, i2caddr, MPC23017_GPIOA_MODE, &FF, 1);
-    udelay(1000);
-    // Put all inputs on MCP23017 in pullup mode
-    i2c_write(i2cdev, i2caddr, MPC23017_GPIOA_PULLUPS_MODE, &FF, 1);
-    udelay(1000);
-    // Put all GPIOB inputs on MCP23017 in INPUT mode
-    i2c_write(i2cdev, i2caddr, MPC23017_GPIOB_MODE, &FF, 1);
-    udelay(1000);
-    // Put all inputs on MCP23017 in pullup mode
-    i2c_write(i2cdev, i2caddr, MPC23017_GPIOB_PULLUPS_MODE, &FF, 1);
-    udelay(1000);
-    // Put all inputs on MCP23017 in pullup mode a second time
-    // Known bug : if you remove this line, you will not have pullups on GPIOB
-    i2c_write(i2cdev, i2caddr, MPC23017_GPIOB_PULLUPS_MODE, &FF, 1);
-    udelay(1000);
-    printk("I2C-%d,%02x configured for pad%d\n",i2cdev,i2caddr,idx);
-
-    if ((err = input_register_device(pad->dev))) {
-        input_free_device(pad->dev);
-        pad->dev = NULL;
+/*
+ * The chips latch their inputs while SH/LD is low, then each rising edge
+ * of CLK shifts the next input onto QH. The clock is brought low by the
+ * same GPCLR write that starts the load, and the GPLEV0 read of each bit
+ * also waits for the previous clock write to reach the pins.
+ */
+static void mk_hc165_shift(struct mk_hc165 *c, int n_pads) {
+    u16 w;
+    int p, j;
+
+    c->stamp = ktime_get();
+    GPIO_CLR(BIT(c->load) | BIT(c->clock));
+    ndelay(hc165_delay_ns);
+    GPIO_SET(BIT(c->load));
+
+    for (p = 0; p < n_pads; p++) {
+        w = 0;
+        for (j = 0; j < MK_HC165_BITS; j++) {
+            ndelay(hc165_delay_ns);
+            // inputs are pulled up, a pressed switch reads 0
+            if (!(GPIO_LEV & BIT(c->data)))
+                w |= BIT(j);
+            GPIO_SET(BIT(c->clock));
+            ndelay(hc165_delay_ns);
+            GPIO_CLR(BIT(c->clock));
+        }
+        c->state[p] = w;
     }
+}
 
-    return err;
-};
+// a pad read on its own shifts the chain as far as that pad
+static int mk_hc165_read(struct mk_pad *pad, u32 *state) {
+    mk_hc165_shift(&mk_hc165, pad->hc165_pos + 1);
+    *state = mk_hc165.state[pad->hc165_pos];
+    return 0;
+}
 
+// the lines are active low : a pressed switch reads 1
+static void mk_gpiod_unpack(struct mk_pad *pad, const unsigned long *values, u32 *state) {
+    int k;
 
-static int __init mk_setup_pad_gpio(struct mk *mk, int idx, int pad_type) {
+    *state = 0;
+    for_each_set_bit(k, values, pad->gpiods->ndescs)
+        *state |= BIT(pad->gpiod_btn[k]);
+}
+
+static int mk_gpiod_read_packet(struct mk_pad *pad, u32 *state) {
+    DECLARE_BITMAP(values, 12);
+    struct gpio_descs *d = pad->gpiods;
+    int err;
+
+    err = gpiod_get_array_value(d->ndescs, d->desc, d->info, values);
+    if (!err)
+        mk_gpiod_unpack(pad, values, state);
+    return err;
+}
+
+static int mk_gpiod_read_packet_cansleep(struct mk_pad *pad, u32 *state) {
+    DECLARE_BITMAP(values, 12);
+    struct gpio_descs *d = pad->gpiods;
+    int err;
+
+    err = gpiod_get_array_value_cansleep(d->ndescs, d->desc, d->info, values);
+    if (!err)
+        mk_gpiod_unpack(pad, values, state);
+    return err;
+}
+
+/*
+ * Only the inputs that changed since the last report are sent, and a poll
+ * where nothing changed does not reach the input core at all. The events
+ * carry the time the inputs were sampled, not the time of input_sync().
+ */
+static void mk_input_report(struct mk_pad * pad, u32 state, ktime_t stamp) {
+    struct input_dev * dev = pad->dev;
+    u32 changed = state ^ pad->last_state;
+    u32 keys;
+    int j;
+
+    if (!changed) {
+        pad->frames_skipped++;
+        return;
+    }
+
+    input_set_timestamp(dev, stamp);
+
+    if (changed & 0x3) {
+        input_report_abs(dev, ABS_Y, (int)((state >> 1) & 1) - (int)(state & 1));
+        pad->events++;
+    }
+    if (changed & 0xc) {
+        input_report_abs(dev, ABS_X, (int)((state >> 3) & 1) - (int)((state >> 2) & 1));
+        pad->events++;
+    }
+    for (keys = changed >> 4; keys; keys &= keys - 1) {
+        j = __ffs(keys);
+        input_report_key(dev, mk_arcade_gpio_btn[j], (state >> (j + 4)) & 1);
+        pad->events++;
+    }
+    input_sync(dev);
+
+    pad->last_state = state;
+    pad->frames_emitted++;
+}
+
+/*
+ * Debounce with vertical counters : bit i of db_cnt[0..2] is the 3 bit
+ * counter of input i, so every input of a pad is counted in a few word
+ * operations.
+ *
+ * Normal mode counts the consecutive polls where an input differs from its
+ * debounced state, and flips it when the count reaches db_press (for a
+ * press) or db_release (for a release).
+ *
+ * Eager mode flips an input on its first edge and then holds it for
+ * db_press or db_release polls, which masks the bounces without delaying
+ * the press.
+ */
+
+// all ones where bit k of the threshold t is set
+#define MK_DB_MASK(t, k)	(-(u32)(((t) >> (k)) & 1))
+
+static inline u32 mk_db_equals(const u32 *c, u8 t) {
+    return ~((c[0] ^ MK_DB_MASK(t, 0)) | (c[1] ^ MK_DB_MASK(t, 1)) | (c[2] ^ MK_DB_MASK(t, 2)));
+}
+
+static u32 mk_debounce(struct mk_pad *pad, u32 raw) {
+    u32 *c = pad->db_cnt;
+    u32 st = pad->db_state;
+    u32 delta, carry, active, toggle;
+    int k;
+
+    if (!pad->debounced)
+        return raw;
+
+    if (pad->db_eager) {
+        active = c[0] | c[1] | c[2];
+        delta = (raw ^ st) & ~active;
+        st ^= delta;
+
+        // count the held inputs down, then load the hold of the new edges
+        carry = active;
+        for (k = 0; k < 3; k++) {
+            c[k] ^= carry;
+            carry &= c[k];
+        }
+        for (k = 0; k < 3; k++)
+            c[k] = (c[k] & ~delta) | (delta & ((st & MK_DB_MASK(pad->db_press, k)) |
+                                               (~st & MK_DB_MASK(pad->db_release, k))));
+    } else {
+        delta = raw ^ st;
+
+        // count up where the input differs, restart from 0 where it does not
+        carry = delta;
+        for (k = 0; k < 3; k++) {
+            u32 next = c[k] & carry;
+            c[k] = (c[k] ^ carry) & delta;
+            carry = next;
+        }
+        toggle = delta & ((raw & mk_db_equals(c, pad->db_press)) | (~raw & mk_db_equals(c, pad->db_release)));
+        st ^= toggle;
+        for (k = 0; k < 3; k++)
+            c[k] &= ~toggle;
+    }
+
+    pad->db_state = st;
+    return st;
+}
+
+/*
+ * Writes the state of a pad to the shared page, seqlock style : the
+ * sequence is odd while the entry is being written, and a reader retries
+ * when it saw an odd or changed sequence.
+ */
+static void mk_state_publish(struct mk_pad *pad, u32 state, ktime_t stamp) {
+    struct mk_state_pad *p;
+
+    if (!mk_state || pad->idx >= ARRAY_SIZE(mk_state->pads))
+        return;
+
+    p = &mk_state->pads[pad->idx];
+    WRITE_ONCE(p->seq, p->seq + 1);
+    smp_wmb();
+    WRITE_ONCE(p->state, state);
+    WRITE_ONCE(p->timestamp_ns, ktime_to_ns(stamp));
+    smp_wmb();
+    WRITE_ONCE(p->seq, p->seq + 1);
+}
+
+/*
+ * Autofire and macros, on the debounced state. An autofire input that is
+ * held is pressed on the tick it went down, and then toggles every
+ * autofire_ticks, whatever the poll that reads the pad. A macro trigger is
+ * not reported; its press plays the steps of its macro, one after the
+ * other, on top of the other inputs. A new trigger press restarts it.
+ */
+static u32 mk_timed_apply(struct mk_pad *pad, u32 state) {
+    unsigned long now = READ_ONCE(mk_base->ticks);
+    u32 pressed = state & ~pad->timed_held;
+    const struct mk_macro_step *step;
+    struct mk_timed *t;
+    u32 keys, out = state;
+    int k, len;
+
+    pad->timed_held = state;
+    rcu_read_lock();
+    t = rcu_dereference(pad->timed);
+    if (!t) {
+        pad->macro_trig = 0;
+        goto out;
+    }
+
+    for (keys = state & t->autofire_mask; keys; keys &= keys - 1) {
+        k = __ffs(keys);
+        if (pressed & BIT(k))
+            pad->af_press[k] = now;
+        if (((now - pad->af_press[k]) / t->autofire_ticks[k]) & 1)
+            out &= ~BIT(k);
+    }
+
+    out &= ~(u32)t->macro_mask;
+    if (pressed & t->macro_mask) {
+        k = __ffs(pressed & t->macro_mask);
+        pad->macro_trig = BIT(k);
+        pad->macro_step = 0;
+        pad->macro_step_end = now + t->macro[k][0].ticks;
+    }
+    if (pad->macro_trig) {
+        k = __ffs(pad->macro_trig);
+        len = t->macro_len[k];
+        // the macro may have been changed under it
+        while (pad->macro_step < len && !time_before(now, pad->macro_step_end)) {
+            if (++pad->macro_step < len)
+                pad->macro_step_end += t->macro[k][pad->macro_step].ticks;
+        }
+        if (pad->macro_step < len) {
+            step = &t->macro[k][pad->macro_step];
+            out |= step->state;
+        } else {
+            pad->macro_trig = 0;
+        }
+    }
+out:
+    rcu_read_unlock();
+    return out;
+}
+
+static void mk_rec_add(struct mk_pad *pad, u32 raw, u32 state, ktime_t stamp) {
+    struct mk_rec *r = pad->rec;
+    struct mk_rec_entry *e;
+
+    if (!r)
+        return;
+    e = &r->entries[r->head & r->mask];
+    e->stamp_ns = ktime_to_ns(stamp);
+    e->raw = raw;
+    e->state = state;
+    // the entry is in before it is counted, and counted before the next one overwrites the oldest
+    smp_store_release(&r->head, r->head + 1);
+    smp_wmb();
+}
+
+/*
+ * The replayed entry due at *stamp, in place of the raw state read and its
+ * debounce, with the time it was recorded at moved to the replay. An entry
+ * stays until the next one is due, false once the last one was replayed.
+ */
+static bool mk_replay_step(struct mk_pad *pad, u32 *raw, u32 *state, ktime_t *stamp) {
+    const struct mk_rec_entry *e = NULL;
+    struct mk_replay *rp;
+    bool ended = false;
+
+    rcu_read_lock();
+    rp = rcu_dereference(pad->replay);
+    if (rp && rp->pos < rp->n) {
+        if (!rp->pos)
+            rp->offset = ktime_sub_ns(*stamp, rp->entries[0].stamp_ns);
+        while (rp->pos < rp->n && !ktime_after(ktime_add_ns(rp->offset, rp->entries[rp->pos].stamp_ns), *stamp))
+            rp->pos++;
+        e = &rp->entries[rp->pos - 1];
+        *raw = e->raw;
+        *state = e->state;
+        *stamp = ktime_add_ns(rp->offset, e->stamp_ns);
+        ended = rp->pos == rp->n;
+    }
+    rcu_read_unlock();
+    // the pad gets its reads back at once, and its interrupts once the replay is dropped
+    if (ended)
+        schedule_work(&mk_base->replay_end);
+    return e != NULL;
+}
+
+static void mk_pad_emit(struct mk_pad *pad, u32 raw, u32 state, ktime_t stamp) {
+    mk_rec_add(pad, raw, state, stamp);
+    state = mk_timed_apply(pad, state);
+
+    mk_state_publish(pad, state, stamp);
+    mk_input_report(pad, state, stamp);
+}
+
+/* stamp is the time the pad inputs were sampled */
+static void mk_pad_update(struct mk_pad *pad, u32 raw, ktime_t stamp) {
+    u32 state;
+
+    if (!rcu_access_pointer(pad->replay) || !mk_replay_step(pad, &raw, &state, &stamp))
+        state = mk_debounce(pad, raw);
+    mk_pad_emit(pad, raw, state, stamp);
+}
+
+/*
+ * A replay does not need the hardware : a poll whose read failed, or that
+ * skipped a quarantined chip, still steps it at the time of the poll.
+ */
+static void mk_pad_update_lost(struct mk_pad *pad, ktime_t stamp) {
+    u32 raw, state;
+
+    if (rcu_access_pointer(pad->replay) && mk_replay_step(pad, &raw, &state, &stamp))
+        mk_pad_emit(pad, raw, state, stamp);
+}
+
+/*
+ * Maps a sample to the input range : a stick axis to -MK_ABS_MAX..MK_ABS_MAX
+ * around its center, the throttle to 0..MK_ABS_MAX from its min, both with
+ * the deadzone cut out so that the range starts at its edge.
+ */
+static int mk_adc_scale(const struct mk_adc_axis *a, int raw, bool throttle) {
+    int d = raw - (throttle ? a->min : a->center);
+    s64 v;
+
+    if (d <= a->deadzone && d >= -(int)a->deadzone)
+        return 0;
+    if (d > 0)
+        v = ((s64)(d - a->deadzone) * a->scale_hi) >> 16;
+    else
+        v = -(((s64)(-d - a->deadzone) * a->scale_lo) >> 16);
+    return clamp_t(s64, v, throttle ? 0 : -MK_ABS_MAX, MK_ABS_MAX);
+}
+
+/*
+ * Reports the axes of an analog pad that moved since the last report, a
+ * poll where none did does not reach the input core at all.
+ */
+static void mk_adc_report(struct mk_pad *pad, ktime_t stamp) {
+    struct input_dev *dev = pad->dev;
+    struct mk_adc_cal *cal;
+    bool changed = false;
+    int a, v;
+
+    rcu_read_lock();
+    cal = rcu_dereference(pad->adc_cal);
+    for (a = 0; a < MK_ADC_AXES; a++) {
+        if (pad->adc_ch[a] < 0)
+            continue;
+        v = mk_adc_scale(&cal->axes[a], pad->adc_raw[a], a == MK_ADC_THROTTLE);
+        if (v == pad->abs_last[a])
+            continue;
+        if (!changed)
+            input_set_timestamp(dev, stamp);
+        input_report_abs(dev, mk_adc_abs[a], v);
+        pad->abs_last[a] = v;
+        pad->events++;
+        changed = true;
+    }
+    rcu_read_unlock();
+
+    if (!changed) {
+        pad->frames_skipped++;
+        return;
+    }
+    input_sync(dev);
+    pad->frames_emitted++;
+}
+
+/*
+ * A chip that keeps failing is left out of the polls with its buttons
+ * released, and probed again after a delay that doubles on every failed
+ * probe, so a dead chip costs one transfer every backoff_ms.
+ */
+static void mk_pad_read_failed(struct mk_pad *pad) {
+    ktime_t now;
+
+    pad->read_errors++;
+    if (++pad->fails < MK_PAD_FAIL_MAX || pad->quarantined)
+        return;
+
+    now = ktime_get();
+    pad->quarantined = true;
+    pad->quarantines++;
+    pad->backoff_ms = MK_QUARANTINE_MIN_MS;
+    pad->next_probe = ktime_add_ms(now, pad->backoff_ms);
+    pr_warn("%s on i2c-%d,%02x stopped answering, retrying in %u ms\n",
+            pad->phys, pad->i2cdev, pad->i2caddr, pad->backoff_ms);
+
+    pad->db_state = 0;
+    memset(pad->db_cnt, 0, sizeof(pad->db_cnt));
+    mk_state_publish(pad, 0, now);
+    mk_input_report(pad, 0, now);
+}
+
+// the chip may have been power cycled, so it is configured again
+static bool mk_pad_reprobe(struct mk_pad *pad, ktime_t now) {
+    if (ktime_before(now, pad->next_probe))
+        return false;
+
+    if (mk_mcp23017_config(pad)) {
+        pad->backoff_ms = min(pad->backoff_ms * 2, (unsigned int)MK_QUARANTINE_MAX_MS);
+        pad->next_probe = ktime_add_ms(now, pad->backoff_ms);
+        return false;
+    }
+
+    // a chip added at runtime is first configured here too
+    if (pad->quarantines)
+        pr_info("%s on i2c-%d,%02x is back\n", pad->phys, pad->i2cdev, pad->i2caddr);
+    pad->quarantined = false;
+    pad->fails = 0;
+    return true;
+}
+
+// the open pads of a bus, under srcu_read_lock(&mk_srcu)
+static struct mk_poll_set *mk_poll_set(enum mk_bus bus) {
+    return srcu_dereference(mk_base->poll[bus], &mk_srcu);
+}
+
+static struct mk_poll_set *mk_bsc_poll_set(struct mk_bsc *b) {
+    return mk_poll_set(MK_BUS_I2C0 + (b - mk_bsc));
+}
+
+/*
+ * Picks the pads of the bus to read now : chips without an INT line on every
+ * tick, chips with one when they signalled a change, their safety poll is
+ * due or their LEDs changed, quarantined chips when they answer their probe
+ * again; until then a tick steps their replay, if any. The LEDs of a chip
+ * are written with its read. A closed pad is only picked by a tick when its
+ * LEDs changed, for the write alone, so a bus nobody listens to sees no
+ * traffic but for the LEDs.
+ */
+static int mk_bsc_select(struct mk_bsc *b, bool tick) {
+    ktime_t now = ktime_get();
+    struct mk_poll_set *set;
+    struct mk_pad *pad;
+    int i, n = 0, srcu;
+
+    srcu = srcu_read_lock(&mk_srcu);
+    set = mk_bsc_poll_set(b);
+    for (i = 0; i < set->n; i++) {
+        pad = set->pads[i];
+        if (!pad->users) {
+            // a quarantined chip gets its LEDs back with its first read once opened
+            clear_bit(MK_PAD_INT_PENDING, &pad->int_flags);
+            if (!tick || pad->quarantined || mk_mcp23017_leds_due(pad) < 0)
+                continue;
+        } else if (pad->quarantined) {
+            clear_bit(MK_PAD_INT_PENDING, &pad->int_flags);
+            if (!tick)
+                continue;
+            if (!mk_pad_reprobe(pad, now)) {
+                mk_pad_update_lost(pad, now);
+                continue;
+            }
+        } else if (!pad->int_irq || rcu_access_pointer(pad->timed) || rcu_access_pointer(pad->replay)) {
+            // autofire, macros and replays run on the tick clock, so the chip is read every tick
+            clear_bit(MK_PAD_INT_PENDING, &pad->int_flags);
+            if (!tick)
+                continue;
+        } else if (!test_and_clear_bit(MK_PAD_INT_PENDING, &pad->int_flags) &&
+                   !(tick && (!ktime_before(now, pad->next_poll) || mk_mcp23017_leds_due(pad) >= 0))) {
+            continue;
+        }
+        if (pad->int_irq && pad->users)
+            pad->next_poll = ktime_add(now, mk_int_poll_period);
+        b->read[n] = pad->users;
+        b->leds[n] = mk_mcp23017_leds_due(pad);
+        b->batch[n++] = pad;
+    }
+    srcu_read_unlock(&mk_srcu, srcu);
+
+    b->batch_len = n;
+    return n;
+}
+
+static bool mk_bsc_int_pending(struct mk_bsc *b) {
+    struct mk_poll_set *set;
+    bool pending = false;
+    int i, srcu;
+
+    srcu = srcu_read_lock(&mk_srcu);
+    set = mk_bsc_poll_set(b);
+    for (i = 0; i < set->n && !pending; i++)
+        pending = test_bit(MK_PAD_INT_PENDING, &set->pads[i]->int_flags);
+    srcu_read_unlock(&mk_srcu, srcu);
+    return pending;
+}
+
+/*
+ * Interrupt driven BSC transfers. mk_bsc_start_batch() starts the read of
+ * the first pad on the bus and returns; each DONE interrupt collects that
+ * pad's two bytes and starts the next read. Once the whole batch is in, the
+ * pads are reported from the interrupt handler. A pad whose LEDs changed
+ * has them written first, the DONE interrupt of the write starting its read.
+ */
+
+static void mk_bsc_start_read(struct mk_bsc *b) {
+    struct mk_pad *pad = b->batch[b->pos];
+
+    if (b->leds[b->pos] >= 0) {
+        b->xfer_start = ktime_get();
+        b->xfer_deadline = mk_bsc_deadline(3);
+        bsc_write(b, BSC_A, pad->i2caddr);
+        bsc_write(b, BSC_DLEN, 3);
+        bsc_write(b, BSC_FIFO, MPC23017_GPIOA_READ);
+        bsc_write(b, BSC_FIFO, b->leds[b->pos] & 0xff);
+        bsc_write(b, BSC_FIFO, b->leds[b->pos] >> 8);
+        bsc_write(b, BSC_S, CLEAR_STATUS);
+        bsc_write(b, BSC_C, START_WRITE | BSC_C_INTD);
+        return;
+    }
+
+    b->rx = 0;
+    b->xfer_start = ktime_get();
+    b->xfer_deadline = mk_bsc_deadline(2);
+    bsc_write(b, BSC_A, pad->i2caddr);
+    bsc_write(b, BSC_DLEN, 2);
+    bsc_write(b, BSC_S, CLEAR_STATUS);
+    bsc_write(b, BSC_C, START_READ | BSC_C_INTD);
+}
+
+/* Reports the first n pads of the batch and releases the bus */
+static void mk_bsc_end_batch(struct mk_bsc *b, int n) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (b->valid[i]) {
+            b->batch[i]->fails = 0;
+            if (b->read[i])
+                mk_pad_update(b->batch[i], b->state[i], mk_mcp23017_sample_time(b->stamp[i]));
+        } else {
+            mk_pad_read_failed(b->batch[i]);
+            if (b->read[i])
+                mk_pad_update_lost(b->batch[i], ktime_get());
+        }
+    }
+    WRITE_ONCE(b->batches, b->batches + 1);
+    clear_bit_unlock(MK_BSC_BUSY, &b->flags);
+}
+
+/*
+ * The DONE interrupt of a transfer that went past its deadline is not
+ * waited for : the transfer is aborted, the pad counts a failed read and
+ * the rest of the batch is dropped.
+ */
+static void mk_bsc_abort_stuck(struct mk_bsc *b) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&b->xfer_lock, flags);
+    if (test_bit(MK_BSC_BUSY, &b->flags) && ktime_after(ktime_get(), b->xfer_deadline)) {
+        u32 status = bsc_read(b, BSC_S);
+
+        mk_bsc_abort(b);
+        mk_bsc_xfer_done(b, b->batch[b->pos]->i2caddr, b->leds[b->pos] < 0, status & ~BSC_S_DONE, b->xfer_start);
+        b->valid[b->pos] = false;
+        mk_bsc_end_batch(b, b->pos + 1);
+    }
+    spin_unlock_irqrestore(&b->xfer_lock, flags);
+}
+
+/*
+ * Waits, from a context that can sleep, for the batch in flight to end, a
+ * later one not being waited for. A stuck transfer is aborted here once
+ * past its deadline, as the timer may be stopped.
+ */
+static void mk_bsc_wait_batch(struct mk_bsc *b) {
+    unsigned long batches = READ_ONCE(b->batches);
+
+    while (test_bit(MK_BSC_BUSY, &b->flags) && READ_ONCE(b->batches) == batches) {
+        mk_bsc_abort_stuck(b);
+        msleep(1);
+    }
+}
+
+static void mk_bsc_start_batch(struct mk_bsc *b, bool tick) {
+    unsigned long flags;
+    bool busy;
+
+    // the deadline of the last batch must not abort this one before its first read starts
+    spin_lock_irqsave(&b->xfer_lock, flags);
+    busy = test_and_set_bit_lock(MK_BSC_BUSY, &b->flags);
+    if (!busy)
+        b->xfer_deadline = KTIME_MAX;
+    spin_unlock_irqrestore(&b->xfer_lock, flags);
+
+    if (busy) {
+        // pending INT lines are picked up when the running batch ends
+        if (tick) {
+            b->skipped++;
+            mk_bsc_abort_stuck(b);
+        }
+        return;
+    }
+    if (!mk_bsc_select(b, tick)) {
+        clear_bit_unlock(MK_BSC_BUSY, &b->flags);
+        return;
+    }
+    b->pos = 0;
+    spin_lock_irqsave(&b->xfer_lock, flags);
+    mk_bsc_start_read(b);
+    spin_unlock_irqrestore(&b->xfer_lock, flags);
+}
+
+static irqreturn_t mk_bsc_irq(int irq, void *dev_id) {
+    struct mk_bsc *b = dev_id;
+    u32 status;
+
+    spin_lock(&b->xfer_lock);
+    // the interrupt line is shared by all the BSC controllers
+    if (!test_bit(MK_BSC_BUSY, &b->flags) || !(bsc_read(b, BSC_C) & BSC_C_INTD)) {
+        spin_unlock(&b->xfer_lock);
+        return IRQ_NONE;
+    }
+    status = bsc_read(b, BSC_S);
+    if (!(status & (BSC_S_DONE | BSC_S_ERR | BSC_S_CLKT))) {
+        spin_unlock(&b->xfer_lock);
+        return IRQ_NONE;
+    }
+
+    // the LEDs of the pad are written, its read comes next
+    if (b->leds[b->pos] >= 0) {
+        bsc_write(b, BSC_S, CLEAR_STATUS);
+        mk_bsc_xfer_done(b, b->batch[b->pos]->i2caddr, false, status, b->xfer_start);
+        b->valid[b->pos] = !(status & (BSC_S_ERR | BSC_S_CLKT));
+        if (b->valid[b->pos]) {
+            b->batch[b->pos]->led_out = b->leds[b->pos];
+            b->leds[b->pos] = -1;
+            if (b->read[b->pos]) {
+                mk_bsc_start_read(b);
+                spin_unlock(&b->xfer_lock);
+                return IRQ_HANDLED;
+            }
+        }
+        // a closed pad is done; the pointer of a chip that failed the write may be off GPIOA, its read is dropped
+        goto next;
+    }
+
+    while ((bsc_read(b, BSC_S) & BSC_S_RXD) && b->rx < 2)
+        b->buf[b->rx++] = bsc_read(b, BSC_FIFO);
+    bsc_write(b, BSC_S, CLEAR_STATUS);
+
+    // a failed read keeps the last reported state of the pad
+    b->valid[b->pos] = !(status & (BSC_S_ERR | BSC_S_CLKT)) && b->rx == 2;
+    b->stamp[b->pos] = b->xfer_start;
+    b->state[b->pos] = ~(b->buf[0] | (b->buf[1] << 8)) & 0xffff & ~b->batch[b->pos]->led_mask;
+    mk_bsc_xfer_done(b, b->batch[b->pos]->i2caddr, true, status, b->xfer_start);
+    mk_pad_read_done(b->batch[b->pos], b->state[b->pos], b->xfer_start);
+
+next:
+    if (++b->pos < b->batch_len) {
+        mk_bsc_start_read(b);
+        spin_unlock(&b->xfer_lock);
+        return IRQ_HANDLED;
+    }
+
+    bsc_write(b, BSC_C, BSC_C_I2CEN);
+    mk_bsc_end_batch(b, b->batch_len);
+    spin_unlock(&b->xfer_lock);
+
+    // a chip signalled a change while the bus was busy
+    if (mk_bsc_int_pending(b))
+        mk_bsc_start_batch(b, false);
+
+    return IRQ_HANDLED;
+}
+
+// the DT node of the controller, to be put, NULL if there is none
+static struct device_node * __init mk_bsc_find_node(struct mk_bsc *b) {
+    struct device_node *np;
+    struct resource res;
+
+    for_each_compatible_node(np, NULL, "brcm,bcm2835-i2c")
+        if (!of_address_to_resource(np, 0, &res) && res.start == b->base)
+            return np;
+    return NULL;
+}
+
+static int __init mk_bsc_find_irq(struct mk_bsc *b) {
+    struct device_node *np = mk_bsc_find_node(b);
+    int irq = 0;
+
+    if (np) {
+        irq = irq_of_parse_and_map(np, 0);
+        of_node_put(np);
+    }
+    return irq;
+}
+
+/*
+ * CDIV divides the VPU core clock, 250 MHz on the first boards but 400 MHz
+ * on the Pi 3 and Zero 2, so its rate is taken from the clock of the
+ * controller in the DT, as it is at load.
+ */
+static void __init mk_bsc_find_clk(struct mk_bsc *b) {
+    struct device_node *np = mk_bsc_find_node(b);
+    struct clk *clk = np ? of_clk_get(np, 0) : ERR_PTR(-ENODEV);
+
+    of_node_put(np);
+    b->clk_hz = IS_ERR(clk) ? 0 : clk_get_rate(clk);
+    if (!IS_ERR(clk))
+        clk_put(clk);
+    if (!b->clk_hz) {
+        b->clk_hz = BSC_CORE_CLK;
+        pr_warn("No clock rate for i2c-%d in the device tree, assuming %lu MHz\n", (int)(b - mk_bsc), b->clk_hz / 1000000);
+    }
+}
+
+static void __init mk_setup_bsc_irq(int dev) {
+    struct mk_bsc *b = &mk_bsc[dev];
+    int irq, err;
+
+    if (!b->n_pads)
+        return;
+
+    irq = mk_bsc_find_irq(b);
+    if (irq <= 0) {
+        pr_err("No interrupt found for i2c-%d, using polled transfers\n", dev);
+        return;
+    }
+    err = request_irq(irq, mk_bsc_irq, IRQF_SHARED, "mk_arcade_joystick", b);
+    if (err) {
+        pr_err("Cannot get interrupt %d for i2c-%d (%d), using polled transfers\n", irq, dev, err);
+        return;
+    }
+    b->irq = irq;
+}
+
+static void mk_free_bsc_irq(struct mk_bsc *b) {
+    if (!b->irq)
+        return;
+
+    // let a batch in flight finish before taking the handler away
+    mk_bsc_wait_batch(b);
+    bsc_write(b, BSC_C, BSC_C_I2CEN);
+    free_irq(b->irq, b);
+    b->irq = 0;
+}
+
+// the message is done with, mk_free_spi() and mk_pad_remove() wait for this
+static void mk_spi_release(struct mk_spi *s) {
+    clear_and_wake_up_bit(MK_SPI_BUSY, &s->flags);
+}
+
+/*
+ * Runs in the context the SPI controller completes messages in, which
+ * cannot sleep. The chips are read within a few microseconds of each other
+ * at the end of the message, so its completion time is their sample time.
+ */
+static void mk_spi_complete(void *context) {
+    struct mk_spi *s = context;
+    ktime_t now = ktime_get();
+    struct mk_pad *pad;
+    u32 state;
+    int i;
+
+    mk_hist_add(&s->xfer_hist, ktime_to_ns(ktime_sub(now, s->xfer_start)));
+    if (s->msg.status)
+        s->errors++;
+    for (i = 0; i < s->batch_len; i++) {
+        pad = s->batch[i];
+        // a failed message keeps the last reported state of the pads
+        if (s->msg.status) {
+            pad->read_errors++;
+            mk_pad_update_lost(pad, now);
+            continue;
+        }
+        state = ~(s->rx[i][2] | (s->rx[i][3] << 8)) & 0xffff;
+        mk_pad_read_done(pad, state, s->xfer_start);
+        mk_pad_update(pad, state, now);
+    }
+    mk_spi_release(s);
+}
+
+/*
+ * Queues the reads of every open MCP23S17 pad as one message, chip select
+ * going up between the chips. spi_async() does not sleep, so this runs
+ * from the tick itself.
+ */
+static void mk_spi_start_batch(struct mk_spi *s) {
+    struct mk_poll_set *set;
+    struct spi_transfer *x;
+    int i, srcu;
+
+    if (test_and_set_bit_lock(MK_SPI_BUSY, &s->flags)) {
+        s->skipped++;
+        return;
+    }
+
+    srcu = srcu_read_lock(&mk_srcu);
+    set = mk_poll_set(MK_BUS_SPI);
+    spi_message_init(&s->msg);
+    for (i = 0; i < set->n; i++) {
+        x = &s->xfers[i];
+        s->batch[i] = set->pads[i];
+        s->tx[i][0] = MCP23S17_OPCODE | set->pads[i]->spi_addr << 1 | MCP23S17_READ;
+        s->tx[i][1] = MPC23017_GPIOA_READ;
+        memset(x, 0, sizeof(*x));
+        x->tx_buf = s->tx[i];
+        x->rx_buf = s->rx[i];
+        x->len = MK_SPI_XFER_LEN;
+        x->cs_change = i < set->n - 1;
+        spi_message_add_tail(x, &s->msg);
+    }
+    s->batch_len = set->n;
+    srcu_read_unlock(&mk_srcu, srcu);
+
+    if (!s->batch_len) {
+        mk_spi_release(s);
+        return;
+    }
+    s->msg.complete = mk_spi_complete;
+    s->msg.context = s;
+    s->xfer_start = ktime_get();
+    if (spi_async(s->spi, &s->msg)) {
+        s->errors++;
+        mk_spi_release(s);
+    }
+}
+
+/*
+ * The MCP3008 samples a channel in the first clocks of its transfer, so the
+ * channels of a pad are a few microseconds apart and are reported together
+ * once the message is done. The trace gets the samples packed 10 bits each.
+ */
+static void mk_adc_complete(void *context) {
+    struct mk_spi *s = context;
+    ktime_t now = ktime_get();
+    struct mk_pad *pad;
+    int i;
+
+    mk_hist_add(&s->xfer_hist, ktime_to_ns(ktime_sub(now, s->xfer_start)));
+    if (s->msg.status)
+        s->errors++;
+    for (i = 0; i < s->batch_len; i++) {
+        pad = s->batch[i];
+        if (!s->msg.status)
+            pad->adc_raw[s->batch_axis[i]] = ((s->rx[i][1] & 3) << 8) | s->rx[i][2];
+        // the transfers of a pad follow each other, it is done after its last one
+        if (i + 1 < s->batch_len && s->batch[i + 1] == pad)
+            continue;
+        // a failed message keeps the last reported values of the pads
+        if (s->msg.status) {
+            pad->read_errors++;
+            continue;
+        }
+        mk_pad_read_done(pad, pad->adc_raw[0] | pad->adc_raw[1] << 10 | pad->adc_raw[2] << 20, s->xfer_start);
+        mk_adc_report(pad, now);
+    }
+    mk_spi_release(s);
+}
+
+/*
+ * Queues a conversion of every wired channel of the open MCP3008 pads as
+ * one message, chip select going up between the channels as the chip
+ * needs. Like the MCP23S17 message it runs while the tick reads the other
+ * buses and its results are reported from the completion, so the analog
+ * pads only cost the tick the time to queue it.
+ */
+static void mk_adc_start_batch(struct mk_spi *s) {
+    struct mk_poll_set *set;
+    struct spi_transfer *x;
+    struct mk_pad *pad;
+    int i, a, n = 0, srcu;
+
+    if (test_and_set_bit_lock(MK_SPI_BUSY, &s->flags)) {
+        s->skipped++;
+        return;
+    }
+
+    srcu = srcu_read_lock(&mk_srcu);
+    set = mk_poll_set(MK_BUS_ADC);
+    spi_message_init(&s->msg);
+    // every channel is wired to one axis, so there are MCP3008_CHANNELS transfers at most
+    for (i = 0; i < set->n; i++) {
+        pad = set->pads[i];
+        for (a = 0; a < MK_ADC_AXES; a++) {
+            if (pad->adc_ch[a] < 0)
+                continue;
+            x = &s->xfers[n];
+            s->batch[n] = pad;
+            s->batch_axis[n] = a;
+            s->tx[n][0] = MCP3008_START;
+            s->tx[n][1] = MCP3008_SINGLE | pad->adc_ch[a] << 4;
+            s->tx[n][2] = 0;
+            memset(x, 0, sizeof(*x));
+            x->tx_buf = s->tx[n];
+            x->rx_buf = s->rx[n];
+            x->len = MK_ADC_XFER_LEN;
+            x->cs_change = 1;
+            spi_message_add_tail(x, &s->msg);
+            n++;
+        }
+    }
+    if (n)
+        s->xfers[n - 1].cs_change = 0;
+    s->batch_len = n;
+    srcu_read_unlock(&mk_srcu, srcu);
+
+    if (!s->batch_len) {
+        mk_spi_release(s);
+        return;
+    }
+    s->msg.complete = mk_adc_complete;
+    s->msg.context = s;
+    s->xfer_start = ktime_get();
+    if (spi_async(s->spi, &s->msg)) {
+        s->errors++;
+        mk_spi_release(s);
+    }
+}
+
+static void mk_poll_gpio(struct mk *mk, bool can_sleep) {
+    struct mk_poll_set *set;
+    struct mk_pad *pad;
+    ktime_t start, stamp;
+    u32 lev, state;
+    int i = 0, n, srcu;
+
+    srcu = srcu_read_lock(&mk_srcu);
+    set = mk_poll_set(MK_BUS_GPIO);
+    if (!set->n)
+        goto out;
+
+    start = ktime_get();
+
+    // one snapshot of the level register serves every register backed pad this tick
+    if (set->n_group[MK_GROUP_LEV]) {
+        stamp = ktime_get();
+        lev = GPIO_LEV;
+        for (n = set->n_group[MK_GROUP_LEV]; n--; i++) {
+            pad = set->pads[i];
+            state = mk_gpio_read_packet(pad, lev);
+            mk_pad_read_done(pad, state, stamp);
+            mk_pad_update(pad, state, stamp);
+        }
+    }
+
+    // one shift of the 74HC165 chain, as far as its last open pad
+    if (set->n_group[MK_GROUP_HC165]) {
+        n = set->n_group[MK_GROUP_HC165];
+        mk_hc165_shift(&mk_hc165, set->pads[i + n - 1]->hc165_pos + 1);
+        for (; n--; i++) {
+            pad = set->pads[i];
+            state = mk_hc165.state[pad->hc165_pos];
+            mk_pad_read_done(pad, state, mk_hc165.stamp);
+            mk_pad_update(pad, state, mk_hc165.stamp);
+        }
+    }
+
+    // then one bulk read per gpiod pad; interrupt driven pads are not on the list
+    for (; i < set->n; i++) {
+        pad = set->pads[i];
+        if (pad->gpiod_cansleep && !can_sleep)
+            continue;
+        stamp = ktime_get();
+        if (pad->read(pad, &state)) {
+            mk_pad_update_lost(pad, stamp);
+            continue;
+        }
+        mk_pad_read_done(pad, state, stamp);
+        mk_pad_update(pad, state, stamp);
+    }
+    mk_hist_add(&mk->gpio_hist, ktime_to_ns(ktime_sub(ktime_get(), start)));
+out:
+    srcu_read_unlock(&mk_srcu, srcu);
+}
+
+static void mk_poll_i2c(struct mk_bsc *b, bool tick) {
+    ktime_t poll_start, start;
+    u32 state;
+    int i, err;
+
+    if (b->irq) {
+        mk_bsc_start_batch(b, tick);
+        return;
+    }
+
+    mk_bsc_select(b, tick);
+    if (!b->batch_len)
+        return;
+
+    poll_start = ktime_get();
+    for (i = 0; i < b->batch_len; i++) {
+        // the pointer of a chip that failed the LED write may be off GPIOA, its read is dropped
+        if (b->leds[i] >= 0 && mk_mcp23017_write_leds(b->batch[i], b->leds[i])) {
+            mk_pad_read_failed(b->batch[i]);
+            if (b->read[i])
+                mk_pad_update_lost(b->batch[i], ktime_get());
+            continue;
+        }
+        if (!b->read[i]) {
+            b->batch[i]->fails = 0;
+            continue;
+        }
+        start = ktime_get();
+        err = b->batch[i]->read(b->batch[i], &state);
+        mk_pad_read_done(b->batch[i], state, start);
+        if (err) {
+            mk_pad_read_failed(b->batch[i]);
+            mk_pad_update_lost(b->batch[i], start);
+            continue;
+        }
+        b->batch[i]->fails = 0;
+        mk_pad_update(b->batch[i], state, mk_mcp23017_sample_time(start));
+    }
+    mk_hist_add(&b->poll_hist, ktime_to_ns(ktime_sub(ktime_get(), poll_start)));
+}
+
+static void mk_poll_bus(struct mk *mk, enum mk_bus bus) {
+    struct mk_bsc *b;
+
+    if (bus == MK_BUS_GPIO) {
+        mk_poll_gpio(mk, mk->workers[bus].worker != NULL);
+        return;
+    }
+
+    // a bus worker is the only one touching its bus, no locking needed
+    b = &mk_bsc[bus - MK_BUS_I2C0];
+    if (mk->workers[bus].worker) {
+        mk_poll_i2c(b, test_and_clear_bit(MK_BSC_TICK, &b->flags));
+    } else {
+        spin_lock(&b->lock);
+        mk_poll_i2c(b, true);
+        spin_unlock(&b->lock);
+    }
+}
+
+static void mk_bus_work(struct kthread_work *work) {
+    struct mk_bus_worker *w = container_of(work, struct mk_bus_worker, work);
+
+    mk_poll_bus(mk_base, w->bus);
+}
+
+static void mk_process_packet(struct mk *mk) {
+    int i;
+
+    for (i = 0; i < MK_BUS_MAX; i++) {
+        if (!mk->workers[i].worker)
+            continue;
+        if (i != MK_BUS_GPIO)
+            set_bit(MK_BSC_TICK, &mk_bsc[i - MK_BUS_I2C0].flags);
+        kthread_queue_work(mk->workers[i].worker, &mk->workers[i].work);
+    }
+
+    // start the interrupt driven buses first so they run while the rest is read
+    if (mk_spi)
+        mk_spi_start_batch(mk_spi);
+    if (mk_adc)
+        mk_adc_start_batch(mk_adc);
+    for (i = 0; i < ARRAY_SIZE(mk_bsc); i++)
+        if (mk_bsc[i].irq && !mk->workers[MK_BUS_I2C0 + i].worker)
+            mk_bsc_start_batch(&mk_bsc[i], true);
+
+    for (i = 0; i < MK_BUS_MAX; i++) {
+        if (mk->workers[i].worker || i == MK_BUS_SPI || i == MK_BUS_ADC)
+            continue;
+        if (i == MK_BUS_GPIO || !mk_bsc[i - MK_BUS_I2C0].irq)
+            mk_poll_bus(mk, i);
+    }
+}
+
+static void mk_flush_workers(struct mk *mk) {
+    int i;
+
+    for (i = 0; i < MK_BUS_MAX; i++)
+        if (mk->workers[i].worker)
+            kthread_cancel_work_sync(&mk->workers[i].work);
+}
+
+static void __init mk_setup_workers(struct mk *mk) {
+    static const char * const names[MK_BUS_MAX] = { "gpio", "i2c0", "i2c1", "spi", "adc" };
+    struct kthread_worker *worker;
+    int i;
+
+    for (i = 0; i < MK_BUS_MAX; i++) {
+        if (i == MK_BUS_SPI || i == MK_BUS_ADC)
+            continue;
+        if (i == MK_BUS_GPIO ? !mk->gpio_count : !mk_bsc[i - MK_BUS_I2C0].n_pads)
+            continue;
+        // without bus_threads, only a GPIO chip that sleeps gets a thread
+        if (!bus_threads && !(i == MK_BUS_GPIO && mk->gpio_cansleep))
+            continue;
+
+        if (bus_cpu[i] >= 0 && cpu_online(bus_cpu[i]))
+            worker = kthread_create_worker_on_cpu(bus_cpu[i], 0, "mk_%s", names[i]);
+        else
+            worker = kthread_create_worker(0, "mk_%s", names[i]);
+        if (IS_ERR(worker)) {
+            pr_err("Cannot start the %s polling thread (%ld), polling it from the timer\n", names[i], PTR_ERR(worker));
+            continue;
+        }
+        sched_set_fifo(worker->task);
+
+        kthread_init_work(&mk->workers[i].work, mk_bus_work);
+        mk->workers[i].bus = i;
+        mk->workers[i].worker = worker;
+    }
+}
+
+static void mk_destroy_workers(struct mk *mk) {
+    int i;
+
+    for (i = 0; i < MK_BUS_MAX; i++) {
+        if (mk->workers[i].worker)
+            kthread_destroy_worker(mk->workers[i].worker);
+        mk->workers[i].worker = NULL;
+    }
+}
+
+/*
+ * mk_timer() initiates reads of console pads data. The timer is forwarded
+ * by whole periods from its previous expiry, so the poll phase does not
+ * drift with the time spent reading the pads; periods that were missed
+ * altogether are counted in poll_overruns.
+ */
+
+static enum hrtimer_restart mk_timer(struct hrtimer *t) {
+    struct mk *mk = container_of(t, struct mk, timer);
+    ktime_t start, now;
+    u64 missed, events;
+    s64 elapsed;
+    int i;
+
+    start = ktime_get();
+    elapsed = ktime_to_ns(ktime_sub(start, hrtimer_get_expires(t)));
+    mk_hist_add(&mk->lateness_hist, elapsed);
+    trace_mk_poll_start(elapsed);
+
+    WRITE_ONCE(mk->ticks, mk->ticks + 1);
+
+    mk_process_packet(mk);
+
+    now = ktime_get();
+    elapsed = ktime_to_ns(ktime_sub(now, start));
+    mk_hist_add(&mk->poll_hist, elapsed);
+    trace_mk_poll_end(elapsed);
+
+    missed = hrtimer_forward(t, now, mk->period);
+    if (missed > 1)
+        poll_overruns += missed - 1;
+
+    mk->rate_ticks++;
+    elapsed = ktime_to_ns(ktime_sub(now, mk->rate_start));
+    if (elapsed >= NSEC_PER_SEC) {
+        poll_rate = div64_u64((u64)mk->rate_ticks * NSEC_PER_SEC, elapsed);
+        spin_lock(&mk->pads_lock);
+        for (events = mk->events_gone, i = 0; i < mk->count; i++)
+            events += mk->pads[i]->events;
+        spin_unlock(&mk->pads_lock);
+        mk->events_per_sec = div64_u64((events - mk->rate_events) * NSEC_PER_SEC, elapsed);
+        mk->rate_events = events;
+        mk->rate_ticks = 0;
+        mk->rate_start = now;
+    }
+
+    return HRTIMER_RESTART;
+}
+
+/*
+ * In gpio_irq mode every pin of a GPIO pad gets a both-edge interrupt. The
+ * hard handler only records the edge time; the threaded handler samples
+ * GPLEV0 and reports that pad alone.
+ */
+
+static irqreturn_t mk_gpio_irq(int irq, void *dev_id) {
+    struct mk_pad *pad = dev_id;
+
+    pad->irq_stamp = ktime_get();
+    return IRQ_WAKE_THREAD;
+}
+
+static irqreturn_t mk_gpio_irq_thread(int irq, void *dev_id) {
+    struct mk_pad *pad = dev_id;
+    unsigned long latency;
+    u32 state;
+
+    mutex_lock(&pad->irq_lock);
+    if (pad->read(pad, &state))
+        goto out;
+    mk_pad_read_done(pad, state, pad->irq_stamp);
+    // stamped with the edge that woke us : that is when the input changed
+    mk_pad_update(pad, state, pad->irq_stamp);
+    latency = ktime_to_ns(ktime_sub(ktime_get(), pad->irq_stamp));
+    if (latency > irq_latency_max_ns)
+        irq_latency_max_ns = latency;
+out:
+    mutex_unlock(&pad->irq_lock);
+
+    return IRQ_HANDLED;
+}
+
+static void mk_free_pad_irqs(struct mk_pad *pad) {
+    int i;
+
+    for (i = 0; i < mk_max_arcade_buttons; i++) {
+        if (pad->irqs[i] > 0)
+            free_irq(pad->irqs[i], pad);
+        pad->irqs[i] = 0;
+    }
+    if (pad->int_irq > 0)
+        free_irq(pad->int_irq, pad);
+    pad->int_irq = 0;
+    pad->irqs_masked = false;
+}
+
+// disable_irq() waits for a threaded handler still reading the pad
+static void mk_pad_mask_irqs(struct mk_pad *pad, bool mask) {
+    int i;
+
+    for (i = 0; i < mk_max_arcade_buttons; i++) {
+        if (pad->irqs[i] <= 0)
+            continue;
+        if (mask)
+            disable_irq(pad->irqs[i]);
+        else
+            enable_irq(pad->irqs[i]);
+    }
+    pad->irqs_masked = mask;
+}
+
+static int mk_setup_pad_irqs(struct mk *mk, struct mk_pad *pad) {
+    int i, k, irq, err;
+
+    mutex_init(&pad->irq_lock);
+
+    for (i = 0, k = 0; i < mk_max_arcade_buttons; i++) {
+        if (pad->gpio_maps[i] == -1)
+            continue;
+
+        if (pad->gpiods)
+            irq = gpiod_to_irq(pad->gpiods->desc[k++]);
+        else
+            irq = gpio_to_irq(gpio_irq_base + pad->gpio_maps[i]);
+        if (irq < 0) {
+            err = irq;
+            goto fail;
+        }
+        err = request_threaded_irq(irq, mk_gpio_irq, mk_gpio_irq_thread,
+                                   IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING | IRQF_ONESHOT,
+                                   "mk_arcade_joystick", pad);
+        if (err)
+            goto fail;
+        pad->irqs[i] = irq;
+    }
+
+    pad->irq_driven = true;
+    return 0;
+
+fail:
+    pr_err("No interrupt for GPIO %d (%d), polling %s\n", pad->gpio_maps[i], err, pad->phys);
+    mk_free_pad_irqs(pad);
+    return err;
+}
+
+/*
+ * An MCP23017 with its INT line wired is only read when that line falls, plus
+ * a slow safety poll. The handler flags the chip and has its bus read right
+ * away by whoever owns the bus.
+ */
+
+static irqreturn_t mk_mcp23017_int_thread(int irq, void *dev_id) {
+    struct mk_pad *pad = dev_id;
+    struct mk_bsc *b = &mk_bsc[pad->i2cdev];
+    struct mk_bus_worker *w = &mk_base->workers[MK_BUS_I2C0 + pad->i2cdev];
+
+    set_bit(MK_PAD_INT_PENDING, &pad->int_flags);
+
+    if (w->worker) {
+        kthread_queue_work(w->worker, &w->work);
+    } else if (b->irq) {
+        mk_bsc_start_batch(b, false);
+    } else {
+        spin_lock_bh(&b->lock);
+        mk_poll_i2c(b, false);
+        spin_unlock_bh(&b->lock);
+    }
+
+    return IRQ_HANDLED;
+}
+
+static int mk_setup_pad_int(struct mk_pad *pad, int int_gpio) {
+    int irq, err;
+
+    setGpioAsInput(int_gpio);
+    setGpioPullUps(BIT(int_gpio));
+
+    irq = gpio_to_irq(gpio_irq_base + int_gpio);
+    if (irq < 0) {
+        err = irq;
+        goto fail;
+    }
+    err = request_threaded_irq(irq, NULL, mk_mcp23017_int_thread,
+                               IRQF_TRIGGER_FALLING | IRQF_ONESHOT, "mk_arcade_joystick", pad);
+    if (err)
+        goto fail;
+
+    pad->int_irq = irq;
+    return 0;
+
+fail:
+    pr_err("No interrupt for INT GPIO %d (%d), polling %s\n", int_gpio, err, pad->phys);
+    return err;
+}
+
+/* SHARED STATE PAGE */
+static enum mk_bus mk_pad_bus(struct mk_pad *pad) {
+    if (pad->type == MK_ARCADE_MCP23S17)
+        return MK_BUS_SPI;
+    if (pad->type == MK_ARCADE_MCP3008)
+        return MK_BUS_ADC;
+    return pad->type == MK_ARCADE_MCP23017 ? MK_BUS_I2C0 + pad->i2cdev : MK_BUS_GPIO;
+}
+
+/*
+ * An interrupt driven pad is polled too while it has autofire, macros or a
+ * replay, with its pin interrupts masked, and a pad with LEDs even while
+ * closed, as its polls write them.
+ */
+static bool mk_pad_polled(struct mk_pad *pad) {
+    return (pad->users || pad->led_mask) &&
+           (!pad->irq_driven || rcu_access_pointer(pad->timed) || rcu_access_pointer(pad->replay));
+}
+
+static enum mk_poll_group mk_pad_group(struct mk_pad *pad) {
+    if (pad->read == mk_gpio_read_lev)
+        return MK_GROUP_LEV;
+    if (pad->type == MK_ARCADE_74HC165)
+        return MK_GROUP_HC165;
+    return MK_GROUP_READ;
+}
+
+static void mk_free_poll_set(struct mk_poll_set *set) {
+    if (set != &mk_poll_empty)
+        kfree(set);
+}
+
+/*
+ * Rebuilds the poll set of every bus from the pads that are open, with
+ * mk->mutex held, and runs the timer only while some pad needs polling :
+ * none is needed when every open pad is interrupt driven. An interrupt
+ * driven pad is reported either by its pin interrupts or by the ticks, never
+ * both : its interrupts are masked before the ticks see it and unmasked
+ * once they no longer do. On failure the previous sets stay in place.
+ */
+static int mk_poll_rebuild(struct mk *mk) {
+    struct mk_poll_set *next[MK_BUS_MAX] = { NULL }, *old[MK_BUS_MAX];
+    int n[MK_BUS_MAX] = { 0 };
+    struct mk_pad *pad;
+    int i, group, polled = 0;
+
+    for (i = 0; i < mk->count; i++)
+        if (mk_pad_polled(mk->pads[i]))
+            n[mk_pad_bus(mk->pads[i])]++;
+    for (i = 0; i < MK_BUS_MAX; i++) {
+        next[i] = n[i] ? kzalloc(struct_size(next[i], pads, n[i]), GFP_KERNEL) : &mk_poll_empty;
+        if (!next[i])
+            goto fail;
+    }
+
+    for (i = 0; i < mk->count; i++) {
+        pad = mk->pads[i];
+        if (pad->irq_driven && !pad->irqs_masked && mk_pad_polled(pad))
+            mk_pad_mask_irqs(pad, true);
+    }
+
+    // in mk->pads order within a group, which is the chain order of the 74HC165 pads
+    for (group = 0; group < MK_GROUP_MAX; group++) {
+        for (i = 0; i < mk->count; i++) {
+            struct mk_poll_set *set;
+
+            pad = mk->pads[i];
+            if (!mk_pad_polled(pad) || mk_pad_group(pad) != group)
+                continue;
+            set = next[mk_pad_bus(pad)];
+            set->pads[set->n++] = pad;
+            set->n_group[group]++;
+            polled++;
+        }
+    }
+
+    for (i = 0; i < MK_BUS_MAX; i++) {
+        old[i] = rcu_dereference_protected(mk->poll[i], lockdep_is_held(&mk->mutex));
+        rcu_assign_pointer(mk->poll[i], next[i]);
+    }
+    synchronize_srcu(&mk_srcu);
+    for (i = 0; i < MK_BUS_MAX; i++)
+        mk_free_poll_set(old[i]);
+    for (i = 0; i < mk->count; i++) {
+        pad = mk->pads[i];
+        if (pad->irqs_masked && !mk_pad_polled(pad))
+            mk_pad_mask_irqs(pad, false);
+    }
+
+    if (polled && !mk->polled) {
+        mk->rate_start = ktime_get();
+        mk->rate_ticks = 0;
+        hrtimer_start(&mk->timer, mk->period, HRTIMER_MODE_REL_SOFT);
+    } else if (!polled && mk->polled) {
+        hrtimer_cancel(&mk->timer);
+        mk_flush_workers(mk);
+    }
+    mk->polled = polled;
+    return 0;
+
+fail:
+    for (i = 0; i < MK_BUS_MAX; i++)
+        if (next[i])
+            mk_free_poll_set(next[i]);
+    return -ENOMEM;
+}
+
+/* A reader of the state page listens to every pad, they are all polled while it is open */
+static int mk_state_use(struct mk *mk, int delta) {
+    int i, err;
+
+    mutex_lock(&mk->mutex);
+    mk->state_users += delta;
+    for (i = 0; i < mk->count; i++)
+        mk->pads[i]->users += delta;
+    err = mk_poll_rebuild(mk);
+    // a closed pad left in the sets is only polled for nothing
+    if (err && delta > 0) {
+        mk->state_users -= delta;
+        for (i = 0; i < mk->count; i++)
+            mk->pads[i]->users -= delta;
+    }
+    mutex_unlock(&mk->mutex);
+    return delta > 0 ? err : 0;
+}
+
+static int mk_state_open(struct inode *inode, struct file *file) {
+    if (file->f_mode & FMODE_WRITE)
+        return -EPERM;
+    return mk_state_use(mk_base, 1);
+}
+
+static int mk_state_release(struct inode *inode, struct file *file) {
+    mk_state_use(mk_base, -1);
+    return 0;
+}
+
+static int mk_state_mmap(struct file *file, struct vm_area_struct *vma) {
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start > PAGE_SIZE)
+        return -EINVAL;
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    return remap_pfn_range(vma, vma->vm_start, virt_to_phys(mk_state) >> PAGE_SHIFT,
+                           vma->vm_end - vma->vm_start, vma->vm_page_prot);
+}
+
+static const struct file_operations mk_state_fops = {
+    .owner = THIS_MODULE,
+    .open = mk_state_open,
+    .release = mk_state_release,
+    .mmap = mk_state_mmap,
+    .llseek = noop_llseek,
+};
+
+static struct miscdevice mk_state_dev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "mk_arcade_joystick",
+    .fops = &mk_state_fops,
+    .mode = 0444,
+};
+
+static int __init mk_setup_state_page(void) {
+    BUILD_BUG_ON(sizeof(struct mk_state_page) > PAGE_SIZE);
+
+    mk_state = (struct mk_state_page *)get_zeroed_page(GFP_KERNEL);
+    if (!mk_state)
+        return -ENOMEM;
+    mk_state->hdr.magic = MK_STATE_MAGIC;
+    mk_state->hdr.version = MK_STATE_VERSION;
+    mk_state->hdr.pad_size = sizeof(struct mk_state_pad);
+    return 0;
+}
+
+// an analog pad has no packed state, its slot stays 0 and only counts when a pad with buttons comes after it
+static void mk_state_count(struct mk_pad *pad) {
+    if (mk_state && pad->type != MK_ARCADE_MCP3008)
+        mk_state->hdr.n_pads = max_t(int, mk_state->hdr.n_pads, min_t(int, pad->idx + 1, ARRAY_SIZE(mk_state->pads)));
+}
+
+static void __init mk_register_state_dev(struct mk *mk) {
+    int i, err;
+
+    if (!mk_state)
+        return;
+
+    for (i = 0; i < mk->count; i++)
+        mk_state_count(mk->pads[i]);
+    err = misc_register(&mk_state_dev);
+    if (err) {
+        pr_err("Cannot register /dev/%s (%d), no state page\n", mk_state_dev.name, err);
+        free_page((unsigned long)mk_state);
+        mk_state = NULL;
+    }
+}
+
+static void mk_free_state_page(void) {
+    if (!mk_state)
+        return;
+    misc_deregister(&mk_state_dev);
+    free_page((unsigned long)mk_state);
+    mk_state = NULL;
+}
+
+// the input core only calls these on the first open and the last close of a pad
+static int mk_open(struct input_dev *dev) {
+    struct mk_pad *pad = input_get_drvdata(dev);
+    struct mk *mk = mk_base;
+    int err;
+
+    err = mutex_lock_interruptible(&mk->mutex);
+    if (err)
+        return err;
+    if (!pad->users++ && (err = mk_poll_rebuild(mk)))
+        pad->users--;
+    mutex_unlock(&mk->mutex);
+    return err;
+}
+
+static void mk_close(struct input_dev *dev) {
+    struct mk_pad *pad = input_get_drvdata(dev);
+    struct mk *mk = mk_base;
+
+    mutex_lock(&mk->mutex);
+    if (!--pad->users)
+        mk_poll_rebuild(mk);
+    mutex_unlock(&mk->mutex);
+}
+
+/*
+ * AUTOFIRE AND MACROS
+ *
+ * Every pad has autofire and macro attributes on its input device, one
+ * line per input that has one :
+ *   autofire : "<input> <ticks>", 0 ticks turns it off
+ *   macro    : "<trigger> <state>:<ticks> ...", a state being inputs joined
+ *              by '+' or "none", and a trigger alone clears its macro
+ * A write changes one input and publishes a new mk_timed.
+ */
+
+// inputs in the packed state of a pad
+static int mk_pad_inputs(struct mk_pad *pad) {
+    if (pad->type == MK_ARCADE_MCP23017 || pad->type == MK_ARCADE_74HC165 || pad->type == MK_ARCADE_MCP23S17)
+        return mk_max_mcp_arcade_buttons;
+    return mk_max_arcade_buttons;
+}
+
+static int mk_input_parse(struct mk_pad *pad, const char *name) {
+    int k;
+
+    for (k = 0; k < mk_pad_inputs(pad); k++)
+        if (!strcmp(name, mk_input_names[k]))
+            return k;
+    return -EINVAL;
+}
+
+static int mk_state_parse(struct mk_pad *pad, char *str, u16 *state) {
+    char *name;
+    int k;
+
+    *state = 0;
+    if (!strcmp(str, "none"))
+        return 0;
+    while ((name = strsep(&str, "+"))) {
+        if ((k = mk_input_parse(pad, name)) < 0)
+            return k;
+        *state |= BIT(k);
+    }
+    return 0;
+}
+
+static int mk_state_print(char *buf, int at, u16 state) {
+    int k, len = 0;
+
+    if (!state)
+        return sysfs_emit_at(buf, at, "none");
+    for (; state; state &= state - 1) {
+        k = __ffs(state);
+        len += sysfs_emit_at(buf, at + len, "%s%s", len ? "+" : "", mk_input_names[k]);
+    }
+    return len;
+}
+
+static struct mk_timed *mk_timed_get(struct mk_pad *pad) {
+    return rcu_dereference_protected(pad->timed, lockdep_is_held(&mk_base->mutex));
+}
+
+// a copy of the current settings to edit, under mk->mutex
+static struct mk_timed *mk_timed_edit(struct mk_pad *pad) {
+    struct mk_timed *cur = mk_timed_get(pad), *t;
+
+    t = kzalloc(sizeof(*t), GFP_KERNEL);
+    if (t && cur)
+        memcpy(t, cur, sizeof(*t));
+    return t;
+}
+
+// the old settings are freed once no poll reads them, and the pad polled every tick while it has some
+static int mk_timed_publish(struct mk_pad *pad, struct mk_timed *t) {
+    struct mk_timed *old = mk_timed_get(pad);
+    int k;
+
+    t->autofire_mask = 0;
+    t->macro_mask = 0;
+    for (k = 0; k < ARRAY_SIZE(t->autofire_ticks); k++) {
+        if (t->autofire_ticks[k])
+            t->autofire_mask |= BIT(k);
+        if (t->macro_len[k])
+            t->macro_mask |= BIT(k);
+    }
+    if (!t->autofire_mask && !t->macro_mask) {
+        kfree(t);
+        t = NULL;
+    }
+    rcu_assign_pointer(pad->timed, t);
+    if (old)
+        kfree_rcu(old, rcu);
+    return mk_poll_rebuild(mk_base);
+}
+
+static ssize_t autofire_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct mk_pad *pad = input_get_drvdata(to_input_dev(dev));
+    struct mk_timed *t;
+    int k, len = 0;
+
+    mutex_lock(&mk_base->mutex);
+    t = mk_timed_get(pad);
+    for (k = 0; t && k < mk_pad_inputs(pad); k++)
+        if (t->autofire_ticks[k])
+            len += sysfs_emit_at(buf, len, "%s %u\n", mk_input_names[k], t->autofire_ticks[k]);
+    mutex_unlock(&mk_base->mutex);
+    return len;
+}
+
+static ssize_t autofire_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    struct mk_pad *pad = input_get_drvdata(to_input_dev(dev));
+    struct mk_timed *t;
+    unsigned int ticks;
+    char name[8];
+    int k, err;
+
+    if (sscanf(buf, "%7s %u", name, &ticks) != 2 || ticks > MK_TIMED_TICKS_MAX)
+        return -EINVAL;
+    if ((k = mk_input_parse(pad, name)) < 0)
+        return k;
+
+    mutex_lock(&mk_base->mutex);
+    if ((t = mk_timed_edit(pad))) {
+        t->autofire_ticks[k] = ticks;
+        err = mk_timed_publish(pad, t);
+    } else {
+        err = -ENOMEM;
+    }
+    mutex_unlock(&mk_base->mutex);
+    return err ? err : count;
+}
+
+static ssize_t macro_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct mk_pad *pad = input_get_drvdata(to_input_dev(dev));
+    struct mk_timed *t;
+    int k, i, len = 0;
+
+    mutex_lock(&mk_base->mutex);
+    t = mk_timed_get(pad);
+    for (k = 0; t && k < mk_pad_inputs(pad); k++) {
+        if (!t->macro_len[k])
+            continue;
+        len += sysfs_emit_at(buf, len, "%s", mk_input_names[k]);
+        for (i = 0; i < t->macro_len[k]; i++) {
+            len += sysfs_emit_at(buf, len, " ");
+            len += mk_state_print(buf, len, t->macro[k][i].state);
+            len += sysfs_emit_at(buf, len, ":%u", t->macro[k][i].ticks);
+        }
+        len += sysfs_emit_at(buf, len, "\n");
+    }
+    mutex_unlock(&mk_base->mutex);
+    return len;
+}
+
+static ssize_t macro_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    struct mk_pad *pad = input_get_drvdata(to_input_dev(dev));
+    struct mk_macro_step steps[MK_MACRO_STEPS];
+    char *str, *cur, *tok, *colon;
+    struct mk_timed *t;
+    unsigned int ticks;
+    int k, n = 0, err = 0;
+
+    if (!(str = kstrndup(buf, count, GFP_KERNEL)))
+        return -ENOMEM;
+    cur = strim(str);
+    k = mk_input_parse(pad, strsep(&cur, " "));
+    while (k >= 0 && !err && (tok = strsep(&cur, " "))) {
+        if (!*tok)
+            continue;
+        colon = strrchr(tok, ':');
+        if (!colon || n == MK_MACRO_STEPS) {
+            err = -EINVAL;
+            break;
+        }
+        *colon = '\0';
+        if (kstrtouint(colon + 1, 10, &ticks) || !ticks || ticks > MK_TIMED_TICKS_MAX) {
+            err = -EINVAL;
+            break;
+        }
+        steps[n].ticks = ticks;
+        err = mk_state_parse(pad, tok, &steps[n++].state);
+    }
+    kfree(str);
+    if (k < 0)
+        return k;
+    if (err)
+        return err;
+
+    mutex_lock(&mk_base->mutex);
+    if ((t = mk_timed_edit(pad))) {
+        t->macro_len[k] = n;
+        memcpy(t->macro[k], steps, n * sizeof(steps[0]));
+        err = mk_timed_publish(pad, t);
+    } else {
+        err = -ENOMEM;
+    }
+    mutex_unlock(&mk_base->mutex);
+    return err ? err : count;
+}
+
+static DEVICE_ATTR_RW(autofire);
+static DEVICE_ATTR_RW(macro);
+
+static struct attribute *mk_timed_attrs[] = {
+    &dev_attr_autofire.attr,
+    &dev_attr_macro.attr,
+    NULL
+};
+ATTRIBUTE_GROUPS(mk_timed);
+
+/*
+ * ANALOG CALIBRATION
+ *
+ * An MCP3008 pad has, instead of autofire and macro, a calibration
+ * attribute with one line per wired axis :
+ *   "<axis> <min> <center> <max> <deadzone>" in ADC steps, the axis being
+ *   x, y or throttle, whose center is its min
+ * and a read only raw attribute with the last sample of each axis, to
+ * find them. A write changes one axis and publishes a new mk_adc_cal.
+ */
+
+static int mk_adc_axis_parse(struct mk_pad *pad, const char *name) {
+    int a;
+
+    for (a = 0; a < MK_ADC_AXES; a++)
+        if (!strcmp(name, mk_adc_axis_names[a]) && pad->adc_ch[a] >= 0)
+            return a;
+    return -EINVAL;
+}
+
+// works out the scales, rounded up so that the ends reach MK_ABS_MAX, each side needs room past the deadzone
+static int mk_adc_axis_set(struct mk_adc_axis *a, bool throttle) {
+    if (a->max > MCP3008_MAX)
+        return -EINVAL;
+    if (throttle) {
+        a->center = a->min;
+        if (a->min + a->deadzone >= a->max)
+            return -EINVAL;
+        a->scale_lo = 0;
+    } else {
+        if (a->min + a->deadzone >= a->center || a->center + a->deadzone >= a->max)
+            return -EINVAL;
+        a->scale_lo = DIV_ROUND_UP_ULL((u64)MK_ABS_MAX << 16, a->center - a->deadzone - a->min);
+    }
+    a->scale_hi = DIV_ROUND_UP_ULL((u64)MK_ABS_MAX << 16, a->max - a->deadzone - a->center);
+    return 0;
+}
+
+static struct mk_adc_cal *mk_adc_cal_get(struct mk_pad *pad) {
+    return rcu_dereference_protected(pad->adc_cal, lockdep_is_held(&mk_base->mutex));
+}
+
+static ssize_t calibration_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct mk_pad *pad = input_get_drvdata(to_input_dev(dev));
+    struct mk_adc_axis *ax;
+    int a, len = 0;
+
+    mutex_lock(&mk_base->mutex);
+    for (a = 0; a < MK_ADC_AXES; a++) {
+        if (pad->adc_ch[a] < 0)
+            continue;
+        ax = &mk_adc_cal_get(pad)->axes[a];
+        len += sysfs_emit_at(buf, len, "%s %u %u %u %u\n", mk_adc_axis_names[a],
+                             ax->min, ax->center, ax->max, ax->deadzone);
+    }
+    mutex_unlock(&mk_base->mutex);
+    return len;
+}
+
+static ssize_t calibration_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    struct mk_pad *pad = input_get_drvdata(to_input_dev(dev));
+    unsigned int min, center, max, deadzone;
+    struct mk_adc_axis axis = { 0 };
+    struct mk_adc_cal *cur, *cal;
+    char name[10];
+    int a, err;
+
+    if (sscanf(buf, "%9s %u %u %u %u", name, &min, &center, &max, &deadzone) != 5 ||
+        min > max || max > MCP3008_MAX || center > MCP3008_MAX || deadzone > MCP3008_MAX)
+        return -EINVAL;
+    if ((a = mk_adc_axis_parse(pad, name)) < 0)
+        return a;
+    axis.min = min;
+    axis.center = center;
+    axis.max = max;
+    axis.deadzone = deadzone;
+    if ((err = mk_adc_axis_set(&axis, a == MK_ADC_THROTTLE)))
+        return err;
+
+    if (!(cal = kzalloc(sizeof(*cal), GFP_KERNEL)))
+        return -ENOMEM;
+    mutex_lock(&mk_base->mutex);
+    cur = mk_adc_cal_get(pad);
+    memcpy(cal, cur, sizeof(*cal));
+    cal->axes[a] = axis;
+    rcu_assign_pointer(pad->adc_cal, cal);
+    mutex_unlock(&mk_base->mutex);
+    kfree_rcu(cur, rcu);
+    return count;
+}
+
+static ssize_t raw_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct mk_pad *pad = input_get_drvdata(to_input_dev(dev));
+    int a, len = 0;
+
+    for (a = 0; a < MK_ADC_AXES; a++)
+        if (pad->adc_ch[a] >= 0)
+            len += sysfs_emit_at(buf, len, "%s %u\n", mk_adc_axis_names[a], READ_ONCE(pad->adc_raw[a]));
+    return len;
+}
+
+static DEVICE_ATTR_RW(calibration);
+static DEVICE_ATTR_RO(raw);
+
+static struct attribute *mk_adc_attrs[] = {
+    &dev_attr_calibration.attr,
+    &dev_attr_raw.attr,
+    NULL
+};
+ATTRIBUTE_GROUPS(mk_adc);
+
+/*
+ * RECORDING AND REPLAY
+ *
+ * debugfs padN/record lists what the pad read, oldest first, one
+ * "<time ns> <raw> <debounced>" line per read with the states in hex.
+ * padN/replay takes lines in the same format and, once closed, plays
+ * them in place of the reads of the pad until the last one came due;
+ * reading it shows how many entries came due out of how many, and
+ * writing nothing stops it.
+ */
+
+static void mk_setup_pad_record(struct mk_pad *pad) {
+    unsigned int n;
+
+    if (!record || pad->type == MK_ARCADE_MCP3008)
+        return;
+    n = roundup_pow_of_two(record);
+    pad->rec = kvzalloc(struct_size(pad->rec, entries, n), GFP_KERNEL);
+    if (!pad->rec) {
+        pr_err("Not enough memory to record %s\n", pad->phys);
+        return;
+    }
+    pad->rec->mask = n - 1;
+}
+
+// what was overwritten is skipped
+static void *mk_record_seek(struct mk_rec *r, loff_t *pos) {
+    unsigned long head = smp_load_acquire(&r->head);
+
+    if (head > r->mask && *pos < head - r->mask)
+        *pos = head - r->mask;
+    return *pos < head ? pos : NULL;
+}
+
+static void *mk_record_start(struct seq_file *m, loff_t *pos) {
+    return mk_record_seek(m->private, pos);
+}
+
+static void *mk_record_next(struct seq_file *m, void *v, loff_t *pos) {
+    ++*pos;
+    return mk_record_seek(m->private, pos);
+}
+
+static void mk_record_stop(struct seq_file *m, void *v) {
+}
+
+static int mk_record_show(struct seq_file *m, void *v) {
+    struct mk_rec *r = m->private;
+    unsigned long i = *(loff_t *)v;
+    struct mk_rec_entry e = r->entries[i & r->mask];
+
+    // the read may have come round to it meanwhile
+    smp_rmb();
+    if (READ_ONCE(r->head) - i > r->mask)
+        return 0;
+    seq_printf(m, "%llu %04x %04x\n", e.stamp_ns, e.raw, e.state);
+    return 0;
+}
+DEFINE_SEQ_ATTRIBUTE(mk_record);
+
+struct mk_replay_load {
+    struct mk_pad *pad;
+    struct mk_replay *rp;   // entries parsed so far
+    int size;
+    char line[48];
+    int len;
+    int err;
+};
+
+static int mk_replay_line(struct mk_replay_load *l) {
+    unsigned long long ns;
+    unsigned int raw, state;
+    struct mk_replay *rp;
+    int size;
+
+    l->line[l->len] = '\0';
+    l->len = 0;
+    if (sscanf(l->line, "%llu %x %x", &ns, &raw, &state) != 3)
+        return -EINVAL;
+    if (l->rp && ns < l->rp->entries[l->rp->n - 1].stamp_ns)
+        return -EINVAL;
+    if (!l->rp || l->rp->n == l->size) {
+        if (l->size == MK_RECORD_MAX)
+            return -EFBIG;
+        size = l->size ? l->size * 2 : 64;
+        if (!(rp = kvzalloc(struct_size(rp, entries, size), GFP_KERNEL)))
+            return -ENOMEM;
+        if (l->rp) {
+            memcpy(rp, l->rp, struct_size(rp, entries, l->rp->n));
+            kvfree(l->rp);
+        }
+        l->rp = rp;
+        l->size = size;
+    }
+    l->rp->entries[l->rp->n].stamp_ns = ns;
+    l->rp->entries[l->rp->n].raw = raw;
+    l->rp->entries[l->rp->n].state = state;
+    l->rp->n++;
+    return 0;
+}
+
+static int mk_replay_open(struct inode *inode, struct file *file) {
+    struct mk_replay_load *l = kzalloc(sizeof(*l), GFP_KERNEL);
+
+    if (!l)
+        return -ENOMEM;
+    l->pad = inode->i_private;
+    file->private_data = l;
+    return 0;
+}
+
+static ssize_t mk_replay_read(struct file *file, char __user *buf, size_t count, loff_t *ppos) {
+    struct mk_replay_load *l = file->private_data;
+    struct mk_replay *rp;
+    char tmp[32];
+    int len;
+
+    mutex_lock(&mk_base->mutex);
+    rp = rcu_dereference_protected(l->pad->replay, lockdep_is_held(&mk_base->mutex));
+    len = snprintf(tmp, sizeof(tmp), "%d %d\n", rp ? READ_ONCE(rp->pos) : 0, rp ? rp->n : 0);
+    mutex_unlock(&mk_base->mutex);
+    return simple_read_from_buffer(buf, count, ppos, tmp, len);
+}
+
+static ssize_t mk_replay_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+    struct mk_replay_load *l = file->private_data;
+    char chunk[64];
+    size_t done, i, n;
+
+    for (done = 0; !l->err && done < count; done += n) {
+        n = min(count - done, sizeof(chunk));
+        if (copy_from_user(chunk, buf + done, n))
+            return -EFAULT;
+        for (i = 0; !l->err && i < n; i++) {
+            if (chunk[i] == '\n')
+                l->err = l->len ? mk_replay_line(l) : 0;
+            else if (l->len == sizeof(l->line) - 1)
+                l->err = -EINVAL;
+            else
+                l->line[l->len++] = chunk[i];
+        }
+    }
+    return l->err ? l->err : count;
+}
+
+/*
+ * The replay is swapped in once it was all written, the old one freed once
+ * no read uses it. debugfs calls release even once the file was removed
+ * with its pad, which may be freed : the replay is then dropped, and the
+ * file held meanwhile so that the pad cannot go away under the swap.
+ */
+static int mk_replay_release(struct inode *inode, struct file *file) {
+    struct mk_replay_load *l = file->private_data;
+    struct dentry *dentry = file->f_path.dentry;
+    struct mk *mk = mk_base;
+    struct mk_replay *old;
+
+    if (!l->err && l->len)
+        l->err = mk_replay_line(l);
+    if ((file->f_mode & FMODE_WRITE) && !l->err && !debugfs_file_get(dentry)) {
+        mutex_lock(&mk->mutex);
+        old = rcu_dereference_protected(l->pad->replay, lockdep_is_held(&mk->mutex));
+        rcu_assign_pointer(l->pad->replay, l->rp);
+        mk_poll_rebuild(mk);
+        mutex_unlock(&mk->mutex);
+        debugfs_file_put(dentry);
+        synchronize_rcu();
+        kvfree(old);
+        l->rp = NULL;
+    }
+    kvfree(l->rp);
+    kfree(l);
+    return 0;
+}
+
+/*
+ * A replay whose last entry came due is dropped, so that an interrupt
+ * driven pad leaves the ticks. Queued by the poll that reached the end.
+ */
+static void mk_replay_end_work(struct work_struct *work) {
+    struct mk *mk = container_of(work, struct mk, replay_end);
+    struct mk_replay *rp;
+    int i;
+
+    mutex_lock(&mk->mutex);
+    for (i = 0; i < mk->count; i++) {
+        rp = rcu_dereference_protected(mk->pads[i]->replay, lockdep_is_held(&mk->mutex));
+        if (!rp || READ_ONCE(rp->pos) < rp->n)
+            continue;
+        RCU_INIT_POINTER(mk->pads[i]->replay, NULL);
+        mk_poll_rebuild(mk);
+        synchronize_rcu();
+        kvfree(rp);
+    }
+    mutex_unlock(&mk->mutex);
+}
+
+static const struct file_operations mk_replay_fops = {
+    .owner = THIS_MODULE,
+    .open = mk_replay_open,
+    .read = mk_replay_read,
+    .write = mk_replay_write,
+    .release = mk_replay_release,
+    .llseek = noop_llseek,
+};
+
+static int mk_hist_show(struct seq_file *m, void *v) {
+    struct mk_hist *h = m->private;
+    int i;
+
+    seq_printf(m, "count %llu\n", h->count);
+    seq_printf(m, "avg_ns %llu\n", h->count ? div64_u64(h->total_ns, h->count) : 0);
+    seq_printf(m, "max_ns %llu\n", h->max_ns);
+    seq_printf(m, "<1us %llu\n", h->buckets[0]);
+    for (i = 1; i < MK_HIST_BUCKETS - 1; i++)
+        seq_printf(m, "<%luus %llu\n", BIT(i), h->buckets[i]);
+    seq_printf(m, ">=%luus %llu\n", BIT(MK_HIST_BUCKETS - 2), h->buckets[MK_HIST_BUCKETS - 1]);
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mk_hist);
+
+/*
+ * debugfs layout :
+ *   poll_time, timer_lateness, events_per_sec
+ *   gpio/poll_time
+ *   i2cN/{poll_time,xfer_time,errors,timeouts,skipped}
+ *   spi/{xfer_time,errors,skipped}
+ *   adc/{xfer_time,errors,skipped}
+ *   padN/{read_time,frames_emitted,frames_skipped,events,record,replay}
+ */
+static void mk_debugfs_pad(struct mk *mk, struct mk_pad *pad) {
+    struct dentry *dir;
+    char name[16];
+
+    if (!mk->debugfs)
+        return;
+    snprintf(name, sizeof(name), "pad%d", pad->idx);
+    pad->debugfs = dir = debugfs_create_dir(name, mk->debugfs);
+    debugfs_create_file("read_time", 0444, dir, &pad->read_hist, &mk_hist_fops);
+    debugfs_create_u64("frames_emitted", 0444, dir, &pad->frames_emitted);
+    debugfs_create_u64("frames_skipped", 0444, dir, &pad->frames_skipped);
+    debugfs_create_u64("events", 0444, dir, &pad->events);
+    if (pad->type == MK_ARCADE_MCP23017) {
+        debugfs_create_u64("read_errors", 0444, dir, &pad->read_errors);
+        debugfs_create_u64("quarantines", 0444, dir, &pad->quarantines);
+    } else if (pad->type == MK_ARCADE_MCP23S17 || pad->type == MK_ARCADE_MCP3008) {
+        debugfs_create_u64("read_errors", 0444, dir, &pad->read_errors);
+    }
+    if (pad->rec)
+        debugfs_create_file("record", 0444, dir, pad->rec, &mk_record_fops);
+    if (pad->type != MK_ARCADE_MCP3008)
+        debugfs_create_file("replay", 0600, dir, pad, &mk_replay_fops);
+}
+
+static void __init mk_debugfs_init(struct mk *mk) {
+    struct dentry *dir;
+    char name[16];
+    int i;
+
+    mk->debugfs = debugfs_create_dir(KBUILD_MODNAME, NULL);
+    debugfs_create_file("poll_time", 0444, mk->debugfs, &mk->poll_hist, &mk_hist_fops);
+    debugfs_create_file("timer_lateness", 0444, mk->debugfs, &mk->lateness_hist, &mk_hist_fops);
+    debugfs_create_u32("events_per_sec", 0444, mk->debugfs, &mk->events_per_sec);
+
+    dir = debugfs_create_dir("gpio", mk->debugfs);
+    debugfs_create_file("poll_time", 0444, dir, &mk->gpio_hist, &mk_hist_fops);
+
+    for (i = 0; i < ARRAY_SIZE(mk_bsc); i++) {
+        snprintf(name, sizeof(name), "i2c%d", i);
+        dir = debugfs_create_dir(name, mk->debugfs);
+        debugfs_create_file("poll_time", 0444, dir, &mk_bsc[i].poll_hist, &mk_hist_fops);
+        debugfs_create_file("xfer_time", 0444, dir, &mk_bsc[i].xfer_hist, &mk_hist_fops);
+        debugfs_create_ulong("errors", 0444, dir, &mk_bsc[i].errors);
+        debugfs_create_ulong("timeouts", 0444, dir, &mk_bsc[i].timeouts);
+        debugfs_create_ulong("skipped", 0444, dir, &mk_bsc[i].skipped);
+    }
+
+    if (mk_spi) {
+        dir = debugfs_create_dir("spi", mk->debugfs);
+        debugfs_create_file("xfer_time", 0444, dir, &mk_spi->xfer_hist, &mk_hist_fops);
+        debugfs_create_ulong("errors", 0444, dir, &mk_spi->errors);
+        debugfs_create_ulong("skipped", 0444, dir, &mk_spi->skipped);
+    }
+
+    if (mk_adc) {
+        dir = debugfs_create_dir("adc", mk->debugfs);
+        debugfs_create_file("xfer_time", 0444, dir, &mk_adc->xfer_hist, &mk_hist_fops);
+        debugfs_create_ulong("errors", 0444, dir, &mk_adc->errors);
+        debugfs_create_ulong("skipped", 0444, dir, &mk_adc->skipped);
+    }
+
+    for (i = 0; i < mk->count; i++)
+        mk_debugfs_pad(mk, mk->pads[i]);
+}
+
+static int __init mk_debounce_param(struct mk_config *cfg, int idx) {
+    if (idx >= cfg->nargs || cfg->args[idx] < 1)
+        return 1;
+    return min(cfg->args[idx], 7);
+}
+
+static void __init mk_setup_pad_debounce(struct mk_pad *pad, int idx) {
+    pad->db_press = mk_debounce_param(&debounce_press_cfg, idx);
+    pad->db_release = mk_debounce_param(&debounce_release_cfg, idx);
+    pad->db_eager = idx < debounce_eager_cfg.nargs && debounce_eager_cfg.args[idx];
+    pad->debounced = pad->db_eager || pad->db_press > 1 || pad->db_release > 1;
+}
+
+static void mk_unmap_registers(void) {
+    if (gpio)
+        iounmap(gpio);
+    if (mk_bsc[1].regs)
+        iounmap(mk_bsc[1].regs);
+    if (mk_bsc[0].regs)
+        iounmap(mk_bsc[0].regs);
+    gpio = NULL;
+    mk_bsc[1].regs = NULL;
+    mk_bsc[0].regs = NULL;
+}
+
+/*
+ * The BCM2835 registers are mapped by the first pad that needs them, so a
+ * driver with gpiod pads only never touches them.
+ */
+static int mk_map_registers(void) {
+    if (gpio)
+        return 0;
+
+    /* Set up gpio pointer for direct register access */
+    if ((gpio = ioremap(GPIO_BASE, 0xB0)) == NULL) {
+        pr_err("GPIO ioremap failed\n");
+        return -EBUSY;
+    }
+    /* Set up i2c pointer for direct register access */
+    if ((mk_bsc[0].regs = ioremap(BSC0_BASE, 0xB0)) == NULL) {
+        pr_err("BSC0 ioremap failed\n");
+        mk_unmap_registers();
+        return -EBUSY;
+    }
+    /* Set up i2c pointer for direct register access */
+    if ((mk_bsc[1].regs = ioremap(BSC1_BASE, 0xB0)) == NULL) {
+        pr_err("BSC1 ioremap failed\n");
+        mk_unmap_registers();
+        return -EBUSY;
+    }
+    return 0;
+}
+
+/*
+ * BUTTON LEDS
+ *
+ * Every LED pin of an MCP23017 pad is an LED class device named
+ * mk_arcade_padN::gpXn after the pin, on the input device of the pad, and
+ * every GPIO LED one named mk_arcade::gpioN. See struct mk_led.
+ */
+
+static void mk_led_set(struct led_classdev *cdev, enum led_brightness value) {
+    struct mk_led *led = container_of(cdev, struct mk_led, cdev);
+
+    if (value)
+        set_bit(led->bit, led->on);
+    else
+        clear_bit(led->bit, led->on);
+}
+
+// GPSET0/GPCLR0 only touch the pins written, so any context can light a GPIO LED
+static void mk_gpio_led_set(struct led_classdev *cdev, enum led_brightness value) {
+    struct mk_led *led = container_of(cdev, struct mk_led, cdev);
+
+    if (value)
+        GPIO_SET(BIT(led->bit));
+    else
+        GPIO_CLR(BIT(led->bit));
+}
+
+// on is the word of levels of an MCP23017 pad, NULL for a GPIO LED
+static int mk_led_register(struct mk_led *led, struct device *parent, unsigned long *on, int bit) {
+    int err;
+
+    led->bit = bit;
+    led->cdev.name = led->name;
+    led->cdev.max_brightness = 1;
+    led->cdev.brightness_set = on ? mk_led_set : mk_gpio_led_set;
+    // set before the device shows up, its brightness may be written at once
+    led->on = on;
+    if ((err = led_classdev_register(parent, &led->cdev))) {
+        pr_err("Cannot register LED %s (%d)\n", led->name, err);
+        led->on = NULL;
+    }
+    return err;
+}
+
+// a pin whose LED cannot be registered stays an output, off
+static void mk_setup_pad_leds(struct mk_pad *pad) {
+    int i, n = 0;
+
+    if (!pad->led_mask)
+        return;
+    pad->leds = kcalloc(hweight16(pad->led_mask), sizeof(*pad->leds), GFP_KERNEL);
+    if (!pad->leds) {
+        pr_err("Not enough memory for the LEDs of %s\n", pad->phys);
+        return;
+    }
+    for (i = 0; i < 16; i++) {
+        if (!(pad->led_mask & BIT(i)))
+            continue;
+        snprintf(pad->leds[n].name, sizeof(pad->leds[n].name), "mk_arcade_pad%d::gp%c%d", pad->idx, i < 8 ? 'a' : 'b', i % 8);
+        mk_led_register(&pad->leds[n++], &pad->dev->dev, &pad->led_on, i);
+    }
+}
+
+static void mk_free_pad_leds(struct mk_pad *pad) {
+    int i;
+
+    for (i = 0; pad->leds && i < hweight16(pad->led_mask); i++)
+        if (pad->leds[i].on)
+            led_classdev_unregister(&pad->leds[i].cdev);
+    kfree(pad->leds);
+    pad->leds = NULL;
+}
+
+// a GPIO read by a pad, wired to an MCP23017 INT line, driving an LED or the 74HC165 chain
+static bool mk_gpio_in_use(struct mk *mk, int gpio_num) {
+    int i, j;
+
+    if (mk_hc165.n_pads && (gpio_num == mk_hc165.load || gpio_num == mk_hc165.clock || gpio_num == mk_hc165.data))
+        return true;
+    if (gpio_num >= 0 && gpio_num < 32 && (mk_gpio_leds.mask & BIT(gpio_num)))
+        return true;
+    for (i = 0; i < mk->count; i++) {
+        if (mk->pads[i]->type == MK_ARCADE_MCP23017 && mk->pads[i]->int_gpio == gpio_num)
+            return true;
+        if (mk_pad_bus(mk->pads[i]) != MK_BUS_GPIO || mk->pads[i]->type == MK_ARCADE_74HC165)
+            continue;
+        for (j = 0; j < mk_max_arcade_buttons; j++)
+            if (mk->pads[i]->gpio_maps[j] == gpio_num)
+                return true;
+    }
+    return false;
+}
+
+static void __init mk_setup_gpio_leds(struct mk *mk) {
+    struct mk_gpio_leds *l = &mk_gpio_leds;
+    int i, g;
+
+    if (!gpio_leds_cfg.nargs || mk_map_registers())
+        return;
+    for (i = 0; i < gpio_leds_cfg.nargs; i++) {
+        g = gpio_leds_cfg.args[i];
+        // only GPIO 0..31 are driven from GPSET0/GPCLR0
+        if (g < 0 || g > 31 || (l->mask & BIT(g)) || mk_gpio_in_use(mk, g)) {
+            pr_err("Invalid LED gpio %d\n", g);
+            continue;
+        }
+        GPIO_CLR(BIT(g));
+        INP_GPIO(g);
+        OUT_GPIO(g);
+        snprintf(l->leds[l->n].name, sizeof(l->leds[l->n].name), "mk_arcade::gpio%d", g);
+        if (mk_led_register(&l->leds[l->n], NULL, NULL, g)) {
+            INP_GPIO(g);
+            continue;
+        }
+        l->mask |= BIT(g);
+        l->n++;
+    }
+}
+
+// the GPIO LEDs go dark and back to inputs, with the timer stopped
+static void mk_free_gpio_leds(void) {
+    struct mk_gpio_leds *l = &mk_gpio_leds;
+    int i;
+
+    if (l->mask)
+        GPIO_CLR(l->mask);
+    for (i = 0; i < l->n; i++) {
+        led_classdev_unregister(&l->leds[i].cdev);
+        INP_GPIO(l->leds[i].bit);
+    }
+    memset(l, 0, sizeof(*l));
+}
+
+static struct mk_pad * mk_alloc_pad(struct mk *mk, int idx) {
+    struct mk_pad *pad = kzalloc(sizeof(*pad), GFP_KERNEL);
+
+    if (pad && !(pad->dev = input_allocate_device())) {
+        kfree(pad);
+        pad = NULL;
+    }
+    if (!pad) {
+        pr_err("Not enough memory for input device\n");
+        return NULL;
+    }
+    // created and removed with the input device
+    pad->dev->dev.groups = mk_timed_groups;
+    mk->pads[idx] = pad;
+    return pad;
+}
+
+static int mk_setup_pad_i2c(struct mk *mk, int idx, char i2cdev, int i2caddr, int int_gpio, int led_mask) {
+    int i, err;
+    struct mk_pad *pad;
+
+    if (idx>=mk->size) {
+        pr_err("Device count exceeds max\n");
+        return -EINVAL;
+    }
+
+    if (i2cdev<0 || i2cdev>1) {
+        pr_err("Only i2c-0 and i2c-1 are supported (%d)\n",i2cdev);
+	return -EINVAL;
+    }
+
+    if (i2caddr<0x20 || i2caddr>=0x28) {
+        pr_err("Invalid i2c address for MCP23017 (%2x)\n",i2caddr);
+	return -EINVAL;
+    }
+
+    // the INT pin is pulled up through GPPUDCLK0, which has GPIO 0..31
+    if (int_gpio < -1 || int_gpio > 31) {
+        pr_err("Invalid INT gpio for MCP23017 (%d)\n", int_gpio);
+        return -EINVAL;
+    }
+
+    if (led_mask & ~0xffff) {
+        pr_err("Invalid LED pins for MCP23017 (%x)\n", led_mask);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < idx; i++) {
+        if (mk->pads[i]->type == MK_ARCADE_MCP23017 && mk->pads[i]->i2cdev == i2cdev && mk->pads[i]->i2caddr == i2caddr) {
+            pr_err("i2c-%d address %2x is already in use\n", i2cdev, i2caddr);
+            return -EBUSY;
+        }
+    }
+
+    if ((err = mk_map_registers()))
+        return err;
+
+    pr_err("Input %d, Pad type : %d\n",idx,MK_ARCADE_MCP23017);
+
+    if (!(pad = mk_alloc_pad(mk, idx)))
+        return -ENOMEM;
+
+    pad->idx = idx;
+    pad->type = MK_ARCADE_MCP23017;
+    pad->i2cdev  = i2cdev;
+    pad->i2caddr = i2caddr;
+    pad->int_gpio = int_gpio;
+    pad->led_mask = led_mask;
+    pad->read = mk_mcp23017_read_packet;
+    snprintf(pad->phys, sizeof (pad->phys), "input%d", idx);
+    pad->dev->name = mk_names[MK_ARCADE_MCP23017];
+    pad->dev->phys = pad->phys;
+    pad->dev->id.bustype = BUS_PARPORT;
+    pad->dev->id.vendor = 0x0001;
+    pad->dev->id.product = MK_ARCADE_MCP23017;
+    pad->dev->id.version = 0x0100;
+
+
+    pad->dev->open = mk_open;
+    pad->dev->close = mk_close;
+    input_set_drvdata(pad->dev, pad);
+
+    pad->dev->evbit[0] = BIT_MASK(EV_KEY) | BIT_MASK(EV_ABS);
+
+    for (i = 0; i < 2; i++)
+        input_set_abs_params(pad->dev, ABS_X + i, -1, 1, 0, 0);
+    // a pin driving an LED is no button
+    for (i = 0; i < mk_max_mcp_arcade_buttons - 4; i++)
+        if (!(led_mask & BIT(i + 4)))
+            __set_bit(mk_arcade_gpio_btn[i], pad->dev->keybit);
+
+    // the chip itself is set up by mk_init_chips(), with the other chips of its bus
+    return 0;
+};
+
+/*
+ * The configuration is read back instead of waiting a fixed time, and
+ * written again a few times before giving up on the chip.
+ */
+static int __init mk_mcp23017_init(struct mk_pad *pad) {
+    u8 FF2[2] = { 0xFF, 0xFF };
+    u8 in2[2] = { ~pad->led_mask & 0xff, (~pad->led_mask >> 8) & 0xff };
+    u8 dir[2], pullups[2];
+    int try;
+
+    for (try = 0; try < MK_MCP23017_INIT_TRIES; try++) {
+        if (mk_mcp23017_config(pad) ||
+            i2c_read(pad->i2cdev, pad->i2caddr, MPC23017_GPIOA_MODE, dir, 2) ||
+            i2c_read(pad->i2cdev, pad->i2caddr, MPC23017_GPIOA_PULLUPS_MODE, pullups, 2))
+            continue;
+        if (!memcmp(dir, in2, 2) && !memcmp(pullups, FF2, 2))
+            break;
+    }
+    if (try == MK_MCP23017_INIT_TRIES) {
+        pr_err("MCP23017 on i2c-%d,%02x does not answer\n", pad->i2cdev, pad->i2caddr);
+        return -ENODEV;
+    }
+
+    // the readback moved the address pointer, put it back on GPIOA
+    i2c_write(pad->i2cdev, pad->i2caddr, MPC23017_GPIOA_READ, NULL, 0);
+    printk("I2C-%d,%02x configured for pad%d\n",pad->i2cdev,pad->i2caddr,pad->idx);
+    return 0;
+}
+
+static void mk_free_pad_gpiod(struct mk_pad *pad) {
+    if (pad->gpiods)
+        gpiod_put_array(pad->gpiods);
+    if (pad->gpiod_lookup) {
+        gpiod_remove_lookup_table(pad->gpiod_lookup);
+        kfree(pad->gpiod_lookup);
+    }
+    if (pad->gpiod_pdev)
+        platform_device_unregister(pad->gpiod_pdev);
+    pad->gpiods = NULL;
+    pad->gpiod_lookup = NULL;
+    pad->gpiod_pdev = NULL;
+}
+
+/*
+ * gpiod backend : the pins are claimed through gpiolib, pulled up and
+ * active low, for a platform device of the pad's own. The pad then works
+ * with any GPIO chip that has a driver, and the pin setup is left to
+ * pinctrl instead of poking the BCM2835 registers.
+ */
+static int mk_setup_pad_gpiod(struct mk_pad *pad) {
+    struct gpiod_lookup_table *lookup;
+    int i, n = 0, err;
+
+    pad->gpiod_pdev = platform_device_register_simple(KBUILD_MODNAME, pad->idx, NULL, 0);
+    if (IS_ERR(pad->gpiod_pdev)) {
+        err = PTR_ERR(pad->gpiod_pdev);
+        pad->gpiod_pdev = NULL;
+        goto fail;
+    }
+
+    lookup = kzalloc(struct_size(lookup, table, mk_max_arcade_buttons + 1), GFP_KERNEL);
+    if (!lookup) {
+        err = -ENOMEM;
+        goto fail;
+    }
+    lookup->dev_id = dev_name(&pad->gpiod_pdev->dev);
+    for (i = 0; i < mk_max_arcade_buttons; i++) {
+        if (pad->gpio_maps[i] == -1)
+            continue;
+        lookup->table[n] = (struct gpiod_lookup)GPIO_LOOKUP_IDX(gpiod_chip, pad->gpio_maps[i], NULL, n,
+                                                                GPIO_ACTIVE_LOW | GPIO_PULL_UP);
+        pad->gpiod_btn[n++] = i;
+    }
+    gpiod_add_lookup_table(lookup);
+    pad->gpiod_lookup = lookup;
+
+    pad->gpiods = gpiod_get_array(&pad->gpiod_pdev->dev, NULL, GPIOD_IN);
+    if (IS_ERR(pad->gpiods)) {
+        err = PTR_ERR(pad->gpiods);
+        pad->gpiods = NULL;
+        goto fail;
+    }
+    pad->gpiod_cansleep = gpiod_cansleep(pad->gpiods->desc[0]);
+    pad->read = pad->gpiod_cansleep ? mk_gpiod_read_packet_cansleep : mk_gpiod_read_packet;
+    return 0;
+
+fail:
+    pr_err("Cannot get the pins of pad%d from %s (%d)\n", pad->idx, gpiod_chip, err);
+    mk_free_pad_gpiod(pad);
+    return err;
+}
+
+static int mk_setup_pad_gpio(struct mk *mk, int idx, int pad_type, bool use_gpiod, const struct gpio_config *custom) {
     int i, err;
-    struct mk_pad *pad = &mk->pads[idx];
+    struct mk_pad *pad;
+
+    if (idx>=mk->size) {
+        pr_err("Device count exceeds max\n");
+        return -EINVAL;
+    }
+
+    pr_err("Pad type : %d\n",pad_type);
+
+    if (pad_type < 1 || pad_type >= MK_MAX || pad_type == MK_ARCADE_74HC165 || pad_type == MK_ARCADE_MCP23S17 ||
+        pad_type == MK_ARCADE_MCP3008) {
+        pr_err("Pad type %d unknown\n", pad_type);
+        return -EINVAL;
+    }
+
+    if (pad_type == MK_ARCADE_GPIO_CUSTOM) {
+        // if the device is custom, be sure to get correct pins
+        if (custom->nargs < 1) {
+            pr_err("Custom device needs gpio argument\n");
+            return -EINVAL;
+        } else if (custom->nargs != 12) {
+             pr_err("Invalid gpio argument (%d)\n", pad_type);
+             return -EINVAL;
+        }
+        // only GPIO 0..31 are sampled from GPLEV0
+        for (i = 0; i < mk_max_arcade_buttons; i++) {
+            if (custom->mk_arcade_gpio_maps_custom[i] < -1 || (!use_gpiod && custom->mk_arcade_gpio_maps_custom[i] > 31)) {
+                pr_err("Invalid custom gpio %d\n", custom->mk_arcade_gpio_maps_custom[i]);
+                return -EINVAL;
+            }
+        }
+    }
+
+    pr_err("Input %d, Pad type : %d\n",idx,pad_type);
+
+    if (!(pad = mk_alloc_pad(mk, idx)))
+        return -ENOMEM;
+
+    pad->idx = idx;
+    pad->type = pad_type;
+    pad->i2cdev  = 0;
+    pad->i2caddr = 0;
+    snprintf(pad->phys, sizeof (pad->phys), "input%d", idx);
+    pad->dev->name = mk_names[pad_type];
+    pad->dev->phys = pad->phys;
+    pad->dev->id.bustype = BUS_PARPORT;
+    pad->dev->id.vendor = 0x0001;
+    pad->dev->id.product = pad_type;
+    pad->dev->id.version = 0x0100;
+
+
+    pad->dev->open = mk_open;
+    pad->dev->close = mk_close;
+    input_set_drvdata(pad->dev, pad);
+
+    pad->dev->evbit[0] = BIT_MASK(EV_KEY) | BIT_MASK(EV_ABS);
+
+    for (i = 0; i < 2; i++)
+        input_set_abs_params(pad->dev, ABS_X + i, -1, 1, 0, 0);
+    for (i = 0; i < mk_max_arcade_buttons; i++)
+        __set_bit(mk_arcade_gpio_btn[i], pad->dev->keybit);
+
+    // asign gpio pins
+    switch (pad_type) {
+        case MK_ARCADE_GPIO:
+            memcpy(pad->gpio_maps, mk_arcade_gpio_maps, 12 *sizeof(int));
+            break;
+        case MK_ARCADE_GPIO_BPLUS:
+            memcpy(pad->gpio_maps, mk_arcade_gpio_maps_bplus, 12 *sizeof(int));
+            break;
+        case MK_ARCADE_GPIO_TFT:
+            memcpy(pad->gpio_maps, mk_arcade_gpio_maps_tft, 12 *sizeof(int));
+            break;
+        case MK_ARCADE_GPIO_CUSTOM:
+            memcpy(pad->gpio_maps, custom->mk_arcade_gpio_maps_custom, 12 *sizeof(int));
+            break;
+    }
+
+    if (use_gpiod) {
+        if ((err = mk_setup_pad_gpiod(pad))) {
+            input_free_device(pad->dev);
+            pad->dev = NULL;
+            return err;
+        }
+        mk->gpio_cansleep |= pad->gpiod_cansleep;
+        mk->pad_count[pad_type]++;
+        mk->gpio_count++;
+        printk("GPIO configured for pad%d on %s\n", idx, gpiod_chip);
+        return 0;
+    }
+
+    if ((err = mk_map_registers())) {
+        input_free_device(pad->dev);
+        pad->dev = NULL;
+        return err;
+    }
+    pad->read = mk_gpio_read_lev;
+    mk->pad_count[pad_type]++;
+    mk->gpio_count++;
+
+    // Initialize GPIO and the GPLEV0 masks used by mk_gpio_read_packet()
+    for (i = 0; i < mk_max_arcade_buttons; i++) {
+        printk("GPIO = %d\n", pad->gpio_maps[i]);
+	if (pad->gpio_maps[i] != -1) {                   // to avoid unused buttons
+	    setGpioAsInput(pad->gpio_maps[i]);
+	    pad->gpio_bits[i] = BIT(pad->gpio_maps[i]);
+	    pad->gpio_mask |= pad->gpio_bits[i];
+	}
+    }
+    setGpioPullUps(getPullUpMask(pad->gpio_maps));
+    printk("GPIO configured for pad%d\n", idx);
+
+    return 0;
+}
+
+static int __init mk_setup_pad_hc165(struct mk *mk, int idx, int pos) {
+    int i;
+    struct mk_pad *pad;
+
+    if (idx>=mk->size) {
+        pr_err("Device count exceeds max\n");
+        return -EINVAL;
+    }
+
+    pr_err("Input %d, Pad type : %d\n",idx,MK_ARCADE_74HC165);
+
+    if (!(pad = mk_alloc_pad(mk, idx)))
+        return -ENOMEM;
+
+    pad->idx = idx;
+    pad->type = MK_ARCADE_74HC165;
+    pad->hc165_pos = pos;
+    pad->read = mk_hc165_read;
+    snprintf(pad->phys, sizeof (pad->phys), "input%d", idx);
+    pad->dev->name = mk_names[MK_ARCADE_74HC165];
+    pad->dev->phys = pad->phys;
+    pad->dev->id.bustype = BUS_PARPORT;
+    pad->dev->id.vendor = 0x0001;
+    pad->dev->id.product = MK_ARCADE_74HC165;
+    pad->dev->id.version = 0x0100;
+
+    pad->dev->open = mk_open;
+    pad->dev->close = mk_close;
+    input_set_drvdata(pad->dev, pad);
+
+    pad->dev->evbit[0] = BIT_MASK(EV_KEY) | BIT_MASK(EV_ABS);
+
+    for (i = 0; i < 2; i++)
+        input_set_abs_params(pad->dev, ABS_X + i, -1, 1, 0, 0);
+    for (i = 0; i < MK_HC165_BITS - 4; i++)
+        __set_bit(mk_arcade_gpio_btn[i], pad->dev->keybit);
+
+    mk->pad_count[MK_ARCADE_74HC165]++;
+    mk->gpio_count++;
+    return 0;
+}
+
+static int mk_setup_pad_spi(struct mk *mk, int idx, int addr) {
+    int i;
+    struct mk_pad *pad;
+
+    if (idx>=mk->size) {
+        pr_err("Device count exceeds max\n");
+        return -EINVAL;
+    }
+
+    if (addr<0 || addr>=MK_SPI_MAX_CHIPS) {
+        pr_err("Invalid hardware address for MCP23S17 (%d)\n",addr);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < idx; i++) {
+        if (mk->pads[i]->type == MK_ARCADE_MCP23S17 && mk->pads[i]->spi_addr == addr) {
+            pr_err("MCP23S17 address %d is already in use\n", addr);
+            return -EBUSY;
+        }
+    }
+
+    pr_err("Input %d, Pad type : %d\n",idx,MK_ARCADE_MCP23S17);
+
+    if (!(pad = mk_alloc_pad(mk, idx)))
+        return -ENOMEM;
+
+    pad->idx = idx;
+    pad->type = MK_ARCADE_MCP23S17;
+    pad->spi_addr = addr;
+    pad->read = mk_mcp23s17_read_packet;
+    snprintf(pad->phys, sizeof (pad->phys), "input%d", idx);
+    pad->dev->name = mk_names[MK_ARCADE_MCP23S17];
+    pad->dev->phys = pad->phys;
+    pad->dev->id.bustype = BUS_PARPORT;
+    pad->dev->id.vendor = 0x0001;
+    pad->dev->id.product = MK_ARCADE_MCP23S17;
+    pad->dev->id.version = 0x0100;
+
+    pad->dev->open = mk_open;
+    pad->dev->close = mk_close;
+    input_set_drvdata(pad->dev, pad);
+
+    pad->dev->evbit[0] = BIT_MASK(EV_KEY) | BIT_MASK(EV_ABS);
+
+    for (i = 0; i < 2; i++)
+        input_set_abs_params(pad->dev, ABS_X + i, -1, 1, 0, 0);
+    for (i = 0; i < mk_max_mcp_arcade_buttons - 4; i++)
+        __set_bit(mk_arcade_gpio_btn[i], pad->dev->keybit);
+
+    mk->pad_count[MK_ARCADE_MCP23S17]++;
+    // the chip itself is set up by mk_init_chips()
+    return 0;
+}
+
+// the full range of the ADC on every axis, with the adc_deadzone
+static struct mk_adc_cal * __init mk_adc_cal_default(void) {
+    struct mk_adc_cal *cal = kzalloc(sizeof(*cal), GFP_KERNEL);
+    int a;
+
+    for (a = 0; cal && a < MK_ADC_AXES; a++) {
+        cal->axes[a].min = 0;
+        cal->axes[a].center = (MCP3008_MAX + 1) / 2;
+        cal->axes[a].max = MCP3008_MAX;
+        cal->axes[a].deadzone = adc_deadzone;
+        mk_adc_axis_set(&cal->axes[a], a == MK_ADC_THROTTLE);
+    }
+    return cal;
+}
+
+static int __init mk_setup_pad_adc(struct mk *mk, int idx, const int *ch) {
+    int i, a, wired = 0;
+    struct mk_adc_cal *cal;
+    struct mk_pad *pad;
+
+    if (idx>=mk->size) {
+        pr_err("Device count exceeds max\n");
+        return -EINVAL;
+    }
+
+    for (a = 0; a < MK_ADC_AXES; a++) {
+        if (ch[a] < -1 || ch[a] >= MCP3008_CHANNELS) {
+            pr_err("Invalid MCP3008 channel (%d)\n", ch[a]);
+            return -EINVAL;
+        }
+        if (ch[a] < 0)
+            continue;
+        wired++;
+        for (i = 0; i < a; i++) {
+            if (ch[i] == ch[a]) {
+                pr_err("MCP3008 channel %d is already in use\n", ch[a]);
+                return -EBUSY;
+            }
+        }
+        for (i = 0; i < idx; i++) {
+            if (mk->pads[i]->type == MK_ARCADE_MCP3008 &&
+                (mk->pads[i]->adc_ch[0] == ch[a] || mk->pads[i]->adc_ch[1] == ch[a] || mk->pads[i]->adc_ch[2] == ch[a])) {
+                pr_err("MCP3008 channel %d is already in use\n", ch[a]);
+                return -EBUSY;
+            }
+        }
+    }
+    if (!wired) {
+        pr_err("MCP3008 pad without any channel\n");
+        return -EINVAL;
+    }
+
+    pr_err("Input %d, Pad type : %d\n",idx,MK_ARCADE_MCP3008);
+
+    if (!(cal = mk_adc_cal_default())) {
+        pr_err("Not enough memory for the calibration\n");
+        return -ENOMEM;
+    }
+    if (!(pad = mk_alloc_pad(mk, idx))) {
+        kfree(cal);
+        return -ENOMEM;
+    }
+    pad->dev->dev.groups = mk_adc_groups;
+
+    pad->idx = idx;
+    pad->type = MK_ARCADE_MCP3008;
+    for (a = 0; a < MK_ADC_AXES; a++)
+        pad->adc_ch[a] = ch[a];
+    RCU_INIT_POINTER(pad->adc_cal, cal);
+    snprintf(pad->phys, sizeof (pad->phys), "input%d", idx);
+    pad->dev->name = mk_names[MK_ARCADE_MCP3008];
+    pad->dev->phys = pad->phys;
+    pad->dev->id.bustype = BUS_PARPORT;
+    pad->dev->id.vendor = 0x0001;
+    pad->dev->id.product = MK_ARCADE_MCP3008;
+    pad->dev->id.version = 0x0100;
+
+    pad->dev->open = mk_open;
+    pad->dev->close = mk_close;
+    input_set_drvdata(pad->dev, pad);
+
+    pad->dev->evbit[0] = BIT_MASK(EV_ABS);
+
+    // the fuzz filter of the input core takes out the noise of the last bits
+    for (a = 0; a < MK_ADC_AXES; a++)
+        if (ch[a] >= 0)
+            input_set_abs_params(pad->dev, mk_adc_abs[a], a == MK_ADC_THROTTLE ? 0 : -MK_ABS_MAX, MK_ABS_MAX,
+                                 MK_ABS_MAX / 256, 0);
+
+    mk->pad_count[MK_ARCADE_MCP3008]++;
+    return 0;
+}
+
+/*
+ * Configures the chip on its own address and reads IOCON back, a chip
+ * that is missing reads all ones or all zeros.
+ */
+static int mk_mcp23s17_init(struct mk_pad *pad) {
+    u8 iocon[2], pullups[2];
+    int try;
+
+    for (try = 0; try < MK_MCP23017_INIT_TRIES; try++) {
+        if (mk_mcp23s17_config(pad) ||
+            mk_mcp23s17_read(pad->spi_addr, MPC23017_IOCON, iocon, 2) ||
+            mk_mcp23s17_read(pad->spi_addr, MPC23017_GPIOA_PULLUPS_MODE, pullups, 2))
+            continue;
+        if (iocon[0] == MPC23017_IOCON_HAEN && iocon[1] == MPC23017_IOCON_HAEN &&
+            pullups[0] == 0xFF && pullups[1] == 0xFF)
+            break;
+    }
+    if (try == MK_MCP23017_INIT_TRIES) {
+        pr_err("MCP23S17 %d on %s does not answer\n", pad->spi_addr, dev_name(&mk_spi->spi->dev));
+        return -ENODEV;
+    }
+
+    printk("%s,%d configured for pad%d\n", dev_name(&mk_spi->spi->dev), pad->spi_addr, pad->idx);
+    return 0;
+}
+
+/*
+ * Out of reset HAEN is clear and the chips ignore the address in the
+ * opcode, except A2 which a chip still compares (MCP23S17 errata), so
+ * HAEN is turned on for all of them with one write to address 0 and one
+ * to address 4 before each is configured on its own address.
+ */
+static void __init mk_init_spi_async(void *data, async_cookie_t cookie) {
+    u8 iocon = MPC23017_IOCON_HAEN;
+    int i;
+
+    mk_mcp23s17_write(0, MPC23017_IOCON, &iocon, 1);
+    mk_mcp23s17_write(4, MPC23017_IOCON, &iocon, 1);
+    for (i = 0; i < mk_base->count; i++) {
+        struct mk_pad *pad = mk_base->pads[i];
+
+        if (pad->type == MK_ARCADE_MCP23S17)
+            pad->init_err = mk_mcp23s17_init(pad);
+    }
+}
+
+/* Sets up the chips of one bus, while the other bus does the same */
+static void __init mk_init_bus_async(void *data, async_cookie_t cookie) {
+    struct mk_bsc *b = data;
+    int i;
+
+    for (i = 0; i < mk_base->count; i++) {
+        struct mk_pad *pad = mk_base->pads[i];
+
+        if (pad->type == MK_ARCADE_MCP23017 && &mk_bsc[(int)pad->i2cdev] == b)
+            pad->init_err = mk_mcp23017_init(pad);
+    }
+}
+
+static void __init mk_init_chips(struct mk *mk) {
+    bool used[ARRAY_SIZE(mk_bsc)] = { false };
+    int i;
+
+    for (i = 0; i < mk->count; i++)
+        if (mk->pads[i]->type == MK_ARCADE_MCP23017)
+            used[(int)mk->pads[i]->i2cdev] = true;
+
+    // the pin functions of both buses share GPFSEL0, set them up before going parallel
+    for (i = 0; i < ARRAY_SIZE(mk_bsc); i++)
+        if (used[i])
+            i2c_init(i, i2c_speed);
+
+    for (i = 0; i < ARRAY_SIZE(mk_bsc); i++)
+        if (used[i])
+            async_schedule_domain(mk_init_bus_async, &mk_bsc[i], &mk_async_domain);
+    if (mk_spi)
+        async_schedule_domain(mk_init_spi_async, mk_spi, &mk_async_domain);
+    async_synchronize_full_domain(&mk_async_domain);
+}
+
+/*
+ * Registers the pads in the order they were given, dropping the ones whose
+ * chip could not be set up, then hooks up their interrupts.
+ */
+static void __init mk_register_pads(struct mk *mk) {
+    int i, n, err;
+
+    for (i = 0, n = 0; i < mk->count; i++) {
+        struct mk_pad *pad = mk->pads[i];
+
+        mk->pads[i] = NULL;
+        if (!pad->init_err && n != i) {
+            pad->idx = n;
+            snprintf(pad->phys, sizeof (pad->phys), "input%d", n);
+            pad->dev->phys = pad->phys;
+        }
+
+        err = pad->init_err;
+        if (!err)
+            err = input_register_device(pad->dev);
+        if (err) {
+            if (pad->type != MK_ARCADE_MCP23017)
+                mk->pad_count[pad->type]--;
+            mk_free_pad_gpiod(pad);
+            input_free_device(pad->dev);
+            kfree(rcu_dereference_protected(pad->adc_cal, 1));
+            kfree(pad);
+            continue;
+        }
+        mk->pads[n] = pad;
+        mk_setup_pad_record(pad);
+        mk_setup_pad_leds(pad);
+
+        // Debouncing counts polls, so a debounced pad is read every tick.
+        mk_setup_pad_debounce(pad, n);
+        if (pad->type == MK_ARCADE_MCP23017) {
+            // falls back to reading the chip every tick when the interrupt cannot be had.
+            if (pad->int_gpio >= 0 && pad->debounced)
+                pr_info("Pad %d is debounced, ignoring its INT line\n", n);
+            else if (pad->int_gpio >= 0)
+                mk_setup_pad_int(pad, pad->int_gpio);
+
+            mk_bsc[(int)pad->i2cdev].n_pads++;
+        } else if (mk_pad_bus(pad) == MK_BUS_GPIO && pad->type != MK_ARCADE_74HC165) {
+            // falls back to polling when the interrupts cannot be had.
+            if (gpio_irq && pad->debounced)
+                pr_info("Pad %d is debounced, polling it\n", n);
+            else if (gpio_irq)
+                mk_setup_pad_irqs(mk, pad);
+        }
+        n++;
+    }
+    mk->count = n;
+}
+
+// a pad whose setup failed has already given its input device back
+static void __init mk_probe_done(struct mk *mk, int err) {
+    if (!err) {
+        mk->count++;
+    } else {
+        kfree(mk->pads[mk->count]);
+        mk->pads[mk->count] = NULL;
+    }
+}
+
+static struct mk __init *mk_probe_i2c(struct mk *mk, int *pads, int n_pads, char dev, struct mk_config *ints, struct mk_config *leds) {
+    int i;
+    int err;
+
+    //    pr_err("i2c: %d %d\n",dev,n_pads);
+    for (i = 0; i<n_pads; i++) {
+        err=mk_setup_pad_i2c(mk, mk->count, dev, pads[i], i < ints->nargs ? ints->args[i] : -1, i < leds->nargs ? leds->args[i] : 0);
+	mk_probe_done(mk, err);
+    }
+
+    return 0;
+}
+
+static struct mk __init *mk_probe(struct mk *mk, int *pads, int n_pads) {
+    int i;
+    int err;
 
-    if (idx>=MK_MAX_DEVICES) {
-        pr_err("Device count exceeds max\n");
-        return -EINVAL;
+    //    pr_err("map: %d\n",n_pads);
+    for (i = 0; i <n_pads; i++) {
+      if (pads[i]>MK_MAX_DEVICES) {
+	pr_err("Warning: Setting up i2c via map is deprecated\n");
+	err=mk_setup_pad_i2c(mk, mk->count, 1, pads[i], -1, 0);
+      } else
+        err=mk_setup_pad_gpio(mk, mk->count, pads[i], i < gpiod_cfg.nargs && gpiod_cfg.args[i], &gpio_cfg);
+
+      mk_probe_done(mk, err);
     }
 
-    pr_err("Pad type : %d\n",pad_type);
+    return 0;
+}
 
-    if (pad_type < 1 || pad_type >= MK_MAX) {
-        pr_err("Pad type %d unknown\n", pad_type);
+/*
+ * The chain is driven from the GPIO registers : SH/LD and CLK are outputs,
+ * idle high and low, QH is read from GPLEV0.
+ */
+static int __init mk_probe_hc165(struct mk *mk) {
+    struct mk_hc165 *c = &mk_hc165;
+    int i, err;
+
+    if (!hc165_pads)
+        return 0;
+    if (hc165_cfg.nargs != 3) {
+        pr_err("hc165 needs the load, clock and data GPIOs\n");
         return -EINVAL;
     }
-
-    if (pad_type == MK_ARCADE_GPIO_CUSTOM) {
-        // if the device is custom, be sure to get correct pins
-        if (gpio_cfg.nargs < 1) {
-            pr_err("Custom device needs gpio argument\n");
+    for (i = 0; i < 3; i++) {
+        if (hc165_cfg.args[i] < 0 || hc165_cfg.args[i] > 31) {
+            pr_err("Invalid 74HC165 gpio %d\n", hc165_cfg.args[i]);
             return -EINVAL;
-        } else if (gpio_cfg.nargs != 12) {
-             pr_err("Invalid gpio argument (%d)\n", pad_type);
-             return -EINVAL;
         }
     }
+    if (hc165_cfg.args[0] == hc165_cfg.args[1] || hc165_cfg.args[0] == hc165_cfg.args[2] ||
+        hc165_cfg.args[1] == hc165_cfg.args[2]) {
+        pr_err("The 74HC165 load, clock and data GPIOs must differ\n");
+        return -EINVAL;
+    }
+    if (hc165_pads > MK_MAX_DEVICES) {
+        pr_err("At most %d pads on the 74HC165 chain (%u)\n", MK_MAX_DEVICES, hc165_pads);
+        return -EINVAL;
+    }
+    if ((err = mk_map_registers()))
+        return err;
 
-    pr_err("Input %d, Pad type : %d\n",idx,pad_type);
+    c->load = hc165_cfg.args[0];
+    c->clock = hc165_cfg.args[1];
+    c->data = hc165_cfg.args[2];
+    GPIO_SET(BIT(c->load));
+    GPIO_CLR(BIT(c->clock));
+    INP_GPIO(c->load);
+    OUT_GPIO(c->load);
+    INP_GPIO(c->clock);
+    OUT_GPIO(c->clock);
+    setGpioAsInput(c->data);
+    setGpioPullUps(BIT(c->data));
+
+    for (i = 0; i < hc165_pads; i++) {
+        err = mk_setup_pad_hc165(mk, mk->count, i);
+        mk_probe_done(mk, err);
+        if (err)
+            break;
+        c->n_pads++;
+    }
+    printk("74HC165 chain of %d pads on GPIO %d,%d,%d\n", c->n_pads, c->load, c->clock, c->data);
+    return 0;
+}
 
-    if (!(pad->dev = input_allocate_device())) {
-        pr_err("Not enough memory for input device\n");
+static void mk_free_spi(struct mk_spi **sp) {
+    struct mk_spi *s = *sp;
+
+    if (!s)
+        return;
+    // a message in flight belongs to the SPI core until it completes, however long that takes
+    wait_on_bit(&s->flags, MK_SPI_BUSY, TASK_UNINTERRUPTIBLE);
+    put_device(&s->spi->dev);
+    kfree(s);
+    *sp = NULL;
+}
+
+/*
+ * The chips share an SPI device the SPI core already knows, such as spi0.0
+ * once the SPI interface is enabled, as long as no other driver (spidev)
+ * is bound to it.
+ */
+static int __init mk_spi_get(struct mk_spi **sp, const char *name, unsigned int speed_hz) {
+    struct device *dev;
+    struct mk_spi *s;
+    int err;
+
+    dev = bus_find_device_by_name(&spi_bus_type, NULL, name);
+    if (!dev) {
+        pr_err("No SPI device %s, is SPI enabled ?\n", name);
+        return -ENODEV;
+    }
+    if (dev->driver) {
+        pr_err("%s is used by %s, unbind it first\n", name, dev->driver->name);
+        put_device(dev);
+        return -EBUSY;
+    }
+    if (!(s = kzalloc(sizeof(*s), GFP_KERNEL))) {
+        pr_err("Not enough memory for the SPI bus\n");
+        put_device(dev);
         return -ENOMEM;
     }
+    *sp = s;
+    s->spi = to_spi_device(dev);
+    s->spi->mode = SPI_MODE_0;
+    s->spi->bits_per_word = 8;
+    s->spi->max_speed_hz = speed_hz;
+    if ((err = spi_setup(s->spi))) {
+        pr_err("Cannot set up %s (%d)\n", name, err);
+        mk_free_spi(sp);
+        return err;
+    }
+    return 0;
+}
 
-    pad->type = pad_type;
-    pad->i2cdev  = 0;
-    pad->i2caddr = 0;
-    snprintf(pad->phys, sizeof (pad->phys), "input%d", idx);
-    pad->dev->name = mk_names[pad_type];
-    pad->dev->phys = pad->phys;
-    pad->dev->id.bustype = BUS_PARPORT;
-    pad->dev->id.vendor = 0x0001;
-    pad->dev->id.product = pad_type;
-    pad->dev->id.version = 0x0100;
+static int __init mk_probe_spi(struct mk *mk) {
+    int i, err;
 
-    input_set_drvdata(pad->dev, mk);
+    if (!mcp23s17_cfg.nargs)
+        return 0;
+    if (!spi_speed_hz || spi_speed_hz > MCP23S17_MAX_HZ) {
+        pr_err("spi_speed_hz must be between 1 and %d (%u)\n", MCP23S17_MAX_HZ, spi_speed_hz);
+        return -EINVAL;
+    }
+    if ((err = mk_spi_get(&mk_spi, spi_dev, spi_speed_hz)))
+        return err;
 
-    pad->dev->open = mk_open;
-    pad->dev->close = mk_close;
+    for (i = 0; i < mcp23s17_cfg.nargs; i++) {
+        err = mk_setup_pad_spi(mk, mk->count, mcp23s17_cfg.args[i]);
+        mk_probe_done(mk, err);
+    }
+    return 0;
+}
 
-    pad->dev->evbit[0] = BIT_MASK(EV_KEY) | BIT_MASK(EV_ABS);
+/*
+ * The MCP3008 needs a chip select of its own : it has no address, and
+ * would answer the MCP23S17 frames. It needs no setup, every transfer
+ * starts a conversion.
+ */
+static int __init mk_probe_adc(struct mk *mk) {
+    int i, err;
 
-    for (i = 0; i < 2; i++)
-        input_set_abs_params(pad->dev, ABS_X + i, -1, 1, 0, 0);
-    for (i = 0; i < mk_max_arcade_buttons; i++)
-        __set_bit(mk_arcade_gpio_btn[i], pad->dev->keybit);
+    if (!mcp3008_cfg.nargs)
+        return 0;
+    if (mcp3008_cfg.nargs % MK_ADC_AXES) {
+        pr_err("mcp3008 takes 3 channels per pad : X, Y and throttle\n");
+        return -EINVAL;
+    }
+    if (!adc_speed_hz || adc_speed_hz > MCP3008_MAX_HZ) {
+        pr_err("adc_speed_hz must be between 1 and %d (%u)\n", MCP3008_MAX_HZ, adc_speed_hz);
+        return -EINVAL;
+    }
+    if (adc_deadzone >= MCP3008_MAX / 4) {
+        pr_err("adc_deadzone must be below %d (%u)\n", MCP3008_MAX / 4, adc_deadzone);
+        return -EINVAL;
+    }
+    if (mcp23s17_cfg.nargs && !strcmp(adc_spi_dev, spi_dev)) {
+        pr_err("The MCP3008 cannot share %s with the MCP23S17 chips\n", spi_dev);
+        return -EBUSY;
+    }
+    if ((err = mk_spi_get(&mk_adc, adc_spi_dev, adc_speed_hz)))
+        return err;
 
-    mk->pad_count[pad_type]++;
+    for (i = 0; i < mcp3008_cfg.nargs; i += MK_ADC_AXES) {
+        err = mk_setup_pad_adc(mk, mk->count, &mcp3008_cfg.args[i]);
+        mk_probe_done(mk, err);
+    }
+    return 0;
+}
 
-    // asign gpio pins
-    switch (pad_type) {
+/*
+ * RUNTIME PADS
+ *
+ * GPIO, MCP23017 and MCP23S17 pads can also be added and removed while the
+ * driver runs, through configfs :
+ *   mkdir /sys/kernel/config/mk_arcade_joystick_rpi/<name>
+ * makes a pad whose type, gpio, bus, address, int_gpio and leds attributes
+ * are set first, then written 1 to enable, which registers its input device.
+ * A pad is only edited while it is disabled, and rmdir removes it. The
+ * other pads keep being polled all along. The pads of these types given
+ * at load are there too, as inputN, enabled : they cannot be removed
+ * with rmdir, but can be disabled, edited and enabled again.
+ */
+
+struct mk_cfs_pad {
+    struct config_group group;      // with no children, a group so that the pads given at load are default groups
+    int type;               // a map= type, or 3 for MCP23017 and 7 for MCP23S17
+    struct gpio_config gpio;        // pins of a custom GPIO pad
+    int bus;                // i2c bus of an MCP23017
+    int addr;               // i2c address of an MCP23017, hardware address of an MCP23S17
+    int int_gpio;           // GPIO wired to the MCP23017 INT line, -1 if none
+    int leds;               // MCP23017 pins driven as LED outputs
+    struct mk_pad *pad;     // NULL while disabled
+};
+
+// serializes enabling and disabling the pads, which sleep outside mk->mutex
+static DEFINE_MUTEX(mk_cfs_lock);
+static bool mk_cfs_registered;
+
+static inline struct mk_cfs_pad *to_mk_cfs_pad(struct config_item *item) {
+    return container_of(to_config_group(item), struct mk_cfs_pad, group);
+}
+
+// takes back what the setup of a pad counted
+static void mk_pad_uncount(struct mk *mk, struct mk_pad *pad) {
+    if (pad->type == MK_ARCADE_MCP23017)
+        mk_bsc[pad->i2cdev].n_pads--;
+    else
+        mk->pad_count[pad->type]--;
+    if (mk_pad_bus(pad) == MK_BUS_GPIO)
+        mk->gpio_count--;
+}
+
+// the lowest input number no pad has, pads removed at runtime leave holes
+static int mk_free_idx(struct mk *mk) {
+    int i, idx;
+
+    for (idx = 0; ; idx++) {
+        for (i = 0; i < mk->count && mk->pads[i]->idx != idx; i++)
+            ;
+        if (i == mk->count)
+            return idx;
+    }
+}
+
+/*
+ * Sets up a pad the way mk_probe() does, with mk->mutex held so that the
+ * pads do not change under the poll sets. An MCP23017 is configured by
+ * the poll of its bus, like a chip coming back from quarantine, as the
+ * bus may be in use by the other pads.
+ */
+/*
+ * The pins a runtime pad would set up, its buttons or its INT line, must
+ * be free : a pin of another pad, an LED or the 74HC165 chain would be
+ * turned into a pulled up input. A custom pad with a bad gpio attribute is
+ * left for mk_setup_pad_gpio() to reject.
+ */
+static int mk_cfs_pad_pins_free(struct mk *mk, struct mk_cfs_pad *cp) {
+    const int *maps;
+    int i;
+
+    switch (cp->type) {
+        case MK_ARCADE_MCP23017:
+            if (cp->int_gpio >= 0 && mk_gpio_in_use(mk, cp->int_gpio)) {
+                pr_err("INT gpio %d already in use\n", cp->int_gpio);
+                return -EBUSY;
+            }
+            return 0;
         case MK_ARCADE_GPIO:
-            memcpy(pad->gpio_maps, mk_arcade_gpio_maps, 12 *sizeof(int));
+            maps = mk_arcade_gpio_maps;
             break;
         case MK_ARCADE_GPIO_BPLUS:
-            memcpy(pad->gpio_maps, mk_arcade_gpio_maps_bplus, 12 *sizeof(int));
+            maps = mk_arcade_gpio_maps_bplus;
             break;
         case MK_ARCADE_GPIO_TFT:
-            memcpy(pad->gpio_maps, mk_arcade_gpio_maps_tft, 12 *sizeof(int));
+            maps = mk_arcade_gpio_maps_tft;
             break;
         case MK_ARCADE_GPIO_CUSTOM:
-            memcpy(pad->gpio_maps, gpio_cfg.mk_arcade_gpio_maps_custom, 12 *sizeof(int));
+            if (cp->gpio.nargs != 12)
+                return 0;
+            maps = cp->gpio.mk_arcade_gpio_maps_custom;
             break;
+        default:
+            return 0;
     }
-
-    // Initialize GPIO
     for (i = 0; i < mk_max_arcade_buttons; i++) {
-        printk("GPIO = %d\n", pad->gpio_maps[i]);
-	if (pad->gpio_maps[i] != -1)                     // to avoid unused buttons
-	    setGpioAsInput(pad->gpio_maps[i]);
+        if (maps[i] >= 0 && mk_gpio_in_use(mk, maps[i])) {
+            pr_err("GPIO %d already in use\n", maps[i]);
+            return -EBUSY;
+        }
     }
-    setGpioPullUps(getPullUpMask(pad->gpio_maps));
-    printk("GPIO configured for pad%d\n", idx);
+    return 0;
+}
 
-    if ((err = input_register_device(pad->dev))) {
-        input_free_device(pad->dev);
-        pad->dev = NULL;
+static int mk_pad_add(struct mk *mk, struct mk_cfs_pad *cp) {
+    struct mk_pad **pads, *pad;
+    int err;
+
+    mutex_lock(&mk->mutex);
+    if ((err = mk_cfs_pad_pins_free(mk, cp)))
+        goto out;
+    if (mk->count == mk->size) {
+        if (!(pads = kcalloc(mk->size + 1, sizeof(*pads), GFP_KERNEL))) {
+            pr_err("Not enough memory allocating the pads\n");
+            err = -ENOMEM;
+            goto out;
+        }
+        memcpy(pads, mk->pads, mk->count * sizeof(*pads));
+        spin_lock_bh(&mk->pads_lock);
+        swap(mk->pads, pads);
+        mk->size++;
+        spin_unlock_bh(&mk->pads_lock);
+        kfree(pads);
     }
 
+    switch (cp->type) {
+        case MK_ARCADE_MCP23017:
+            err = mk_setup_pad_i2c(mk, mk->count, cp->bus, cp->addr, cp->int_gpio, cp->leds);
+            break;
+        case MK_ARCADE_MCP23S17:
+            if (!mk_spi) {
+                pr_err("MCP23S17 pads need the mcp23s17 parameter at load\n");
+                err = -ENODEV;
+                break;
+            }
+            err = mk_setup_pad_spi(mk, mk->count, cp->addr);
+            break;
+        default:
+            // gpiod and the 74HC165 chain are set up at load only
+            err = mk_setup_pad_gpio(mk, mk->count, cp->type, false, &cp->gpio);
+            break;
+    }
+    if (err) {
+        // a pad whose setup failed has already given its input device back
+        kfree(mk->pads[mk->count]);
+        mk->pads[mk->count] = NULL;
+        goto out;
+    }
+
+    pad = mk->pads[mk->count];
+    pad->idx = mk_free_idx(mk);
+    snprintf(pad->phys, sizeof (pad->phys), "input%d", pad->idx);
+    pad->db_press = 1;
+    pad->db_release = 1;
+    pad->int_gpio = pad->type == MK_ARCADE_MCP23017 ? cp->int_gpio : -1;
+
+    if (pad->type == MK_ARCADE_MCP23017) {
+        if (!mk_bsc[pad->i2cdev].n_pads)
+            i2c_init(pad->i2cdev, i2c_speed);
+        mk_bsc[pad->i2cdev].n_pads++;
+        pad->quarantined = true;
+        pad->backoff_ms = MK_QUARANTINE_MIN_MS;
+        pad->next_probe = ktime_get();
+    } else if (pad->type == MK_ARCADE_MCP23S17 && (err = mk_mcp23s17_init(pad))) {
+        goto fail;
+    }
+
+    if ((err = input_register_device(pad->dev)))
+        goto fail;
+    if (pad->int_gpio >= 0)
+        mk_setup_pad_int(pad, pad->int_gpio);
+    else if (mk_pad_bus(pad) == MK_BUS_GPIO && gpio_irq)
+        mk_setup_pad_irqs(mk, pad);
+
+    // the state page readers listen to it too
+    pad->users = mk->state_users;
+    mk_setup_pad_record(pad);
+    mk_setup_pad_leds(pad);
+    mk_debugfs_pad(mk, pad);
+    mk_state_count(pad);
+    spin_lock_bh(&mk->pads_lock);
+    mk->count++;
+    spin_unlock_bh(&mk->pads_lock);
+    // an open pad left out of the sets is polled with the next change
+    mk_poll_rebuild(mk);
+    cp->pad = pad;
+    printk("%s added as %s\n", config_item_name(&cp->group.cg_item), pad->phys);
+    goto out;
+
+fail:
+    mk_pad_uncount(mk, pad);
+    input_free_device(pad->dev);
+    kfree(pad);
+    mk->pads[mk->count] = NULL;
+out:
+    mutex_unlock(&mk->mutex);
     return err;
 }
 
-static struct mk __init *mk_probe_i2c(struct mk *mk, int *pads, int n_pads, char dev) {
-    int i;
-    int err;
+/*
+ * Takes the pad out of the poll sets, then waits for the reads that picked
+ * it before : the batches of the interrupt driven buses, the bus workers
+ * and the synchronous reads under the bus lock. The input device is
+ * unregistered without mk->mutex held, as closing it takes it.
+ */
+static int mk_pad_remove(struct mk *mk, struct mk_cfs_pad *cp) {
+    struct mk_pad *pad = cp->pad;
+    enum mk_bus bus = mk_pad_bus(pad);
+    struct mk_spi *s = NULL;
+    struct mk_bsc *b = NULL;
+    int i, err;
 
-    //    pr_err("i2c: %d %d\n",dev,n_pads);
-    for (i = 0; i<n_pads; i++) {
-        err=mk_setup_pad_i2c(mk, mk->count, dev, pads[i]);
-	if (!err) mk->count++;
+    mutex_lock(&mk->mutex);
+    for (i = 0; mk->pads[i] != pad; i++)
+        ;
+    spin_lock_bh(&mk->pads_lock);
+    memmove(&mk->pads[i], &mk->pads[i + 1], (mk->count - i - 1) * sizeof(*mk->pads));
+    mk->pads[--mk->count] = NULL;
+    mk->events_gone += pad->events;
+    spin_unlock_bh(&mk->pads_lock);
+    if ((err = mk_poll_rebuild(mk))) {
+        spin_lock_bh(&mk->pads_lock);
+        memmove(&mk->pads[i + 1], &mk->pads[i], (mk->count - i) * sizeof(*mk->pads));
+        mk->pads[i] = pad;
+        mk->count++;
+        mk->events_gone -= pad->events;
+        spin_unlock_bh(&mk->pads_lock);
+        mutex_unlock(&mk->mutex);
+        return err;
+    }
+    mk_pad_uncount(mk, pad);
+    mutex_unlock(&mk->mutex);
+
+    if (bus == MK_BUS_SPI || bus == MK_BUS_ADC)
+        s = bus == MK_BUS_SPI ? mk_spi : mk_adc;
+    else if (bus != MK_BUS_GPIO)
+        b = &mk_bsc[bus - MK_BUS_I2C0];
+    // the message or batch in flight may still hold the pad
+    if (s)
+        wait_on_bit(&s->flags, MK_SPI_BUSY, TASK_UNINTERRUPTIBLE);
+    if (b)
+        mk_bsc_wait_batch(b);
+    if (mk->workers[bus].worker)
+        kthread_flush_work(&mk->workers[bus].work);
+    if (b) {
+        spin_lock_bh(&b->lock);
+        spin_unlock_bh(&b->lock);
     }
 
+    mk_free_pad_irqs(pad);
+    mk_free_pad_leds(pad);
+    input_unregister_device(pad->dev);
+    mk_free_pad_gpiod(pad);
+    debugfs_remove_recursive(pad->debugfs);
+    mk_state_publish(pad, 0, ktime_get());
+    printk("%s removed from %s\n", config_item_name(&cp->group.cg_item), pad->phys);
+    kfree(rcu_dereference_protected(pad->timed, 1));
+    kfree(rcu_dereference_protected(pad->adc_cal, 1));
+    kvfree(rcu_dereference_protected(pad->replay, 1));
+    kvfree(pad->rec);
+    kfree(pad);
+    cp->pad = NULL;
     return 0;
 }
 
-static struct mk __init *mk_probe(struct mk *mk, int *pads, int n_pads) {
-    int i;
-    int err;
+static ssize_t mk_cfs_store_int(struct config_item *item, const char *page, size_t count, int *val, int min, int max) {
+    struct mk_cfs_pad *cp = to_mk_cfs_pad(item);
+    int v, err;
 
-    //    pr_err("map: %d\n",n_pads);
-    for (i = 0; i <n_pads; i++) {
-      if (pads[i]>MK_MAX_DEVICES) {
-	pr_err("Warning: Setting up i2c via map is deprecated\n");
-	err=mk_setup_pad_i2c(mk, mk->count, 1, pads[i]);
-      } else
-        err=mk_setup_pad_gpio(mk, mk->count, pads[i]);
+    if ((err = kstrtoint(page, 0, &v)))
+        return err;
+    if (v < min || v > max)
+        return -EINVAL;
+    mutex_lock(&mk_cfs_lock);
+    if (cp->pad)
+        err = -EBUSY;
+    else
+        *val = v;
+    mutex_unlock(&mk_cfs_lock);
+    return err ? err : count;
+}
 
-      if (!err) mk->count++;
+static ssize_t mk_cfs_pad_type_show(struct config_item *item, char *page) {
+    return sprintf(page, "%d\n", to_mk_cfs_pad(item)->type);
+}
+
+static ssize_t mk_cfs_pad_type_store(struct config_item *item, const char *page, size_t count) {
+    int type;
+
+    if (kstrtoint(page, 0, &type) || type == MK_ARCADE_74HC165 || type == MK_ARCADE_MCP3008)
+        return -EINVAL;
+    return mk_cfs_store_int(item, page, count, &to_mk_cfs_pad(item)->type, 1, MK_MAX - 1);
+}
+
+static ssize_t mk_cfs_pad_gpio_show(struct config_item *item, char *page) {
+    struct mk_cfs_pad *cp = to_mk_cfs_pad(item);
+    int i, len = 0;
+
+    for (i = 0; i < cp->gpio.nargs; i++)
+        len += sprintf(page + len, "%s%d", i ? "," : "", cp->gpio.mk_arcade_gpio_maps_custom[i]);
+    return len + sprintf(page + len, "\n");
+}
+
+// the pins of a custom pad, as the gpio parameter takes them
+static ssize_t mk_cfs_pad_gpio_store(struct config_item *item, const char *page, size_t count) {
+    struct mk_cfs_pad *cp = to_mk_cfs_pad(item);
+    struct gpio_config gpio = { };
+    int len, err = 0;
+
+    while (gpio.nargs < ARRAY_SIZE(gpio.mk_arcade_gpio_maps_custom) &&
+           sscanf(page, "%d%n", &gpio.mk_arcade_gpio_maps_custom[gpio.nargs], &len) == 1) {
+        gpio.nargs++;
+        page += len;
+        if (*page != ',')
+            break;
+        page++;
     }
+    if (!gpio.nargs || (*page && *page != '\n'))
+        return -EINVAL;
 
-    return 0;
+    mutex_lock(&mk_cfs_lock);
+    if (cp->pad)
+        err = -EBUSY;
+    else
+        cp->gpio = gpio;
+    mutex_unlock(&mk_cfs_lock);
+    return err ? err : count;
 }
 
-static int __init mk_init(void) {
-    /* Set up gpio pointer for direct register access */
-    if ((gpio = ioremap(GPIO_BASE, 0xB0)) == NULL) {
-        pr_err("GPIO ioremap failed\n");
-        return -EBUSY;
+static ssize_t mk_cfs_pad_bus_show(struct config_item *item, char *page) {
+    return sprintf(page, "%d\n", to_mk_cfs_pad(item)->bus);
+}
+
+static ssize_t mk_cfs_pad_bus_store(struct config_item *item, const char *page, size_t count) {
+    return mk_cfs_store_int(item, page, count, &to_mk_cfs_pad(item)->bus, 0, 1);
+}
+
+static ssize_t mk_cfs_pad_address_show(struct config_item *item, char *page) {
+    return sprintf(page, "0x%02x\n", to_mk_cfs_pad(item)->addr);
+}
+
+static ssize_t mk_cfs_pad_address_store(struct config_item *item, const char *page, size_t count) {
+    return mk_cfs_store_int(item, page, count, &to_mk_cfs_pad(item)->addr, 0, 0x27);
+}
+
+static ssize_t mk_cfs_pad_int_gpio_show(struct config_item *item, char *page) {
+    return sprintf(page, "%d\n", to_mk_cfs_pad(item)->int_gpio);
+}
+
+static ssize_t mk_cfs_pad_int_gpio_store(struct config_item *item, const char *page, size_t count) {
+    return mk_cfs_store_int(item, page, count, &to_mk_cfs_pad(item)->int_gpio, -1, 31);
+}
+
+static ssize_t mk_cfs_pad_leds_show(struct config_item *item, char *page) {
+    return sprintf(page, "0x%04x\n", to_mk_cfs_pad(item)->leds);
+}
+
+static ssize_t mk_cfs_pad_leds_store(struct config_item *item, const char *page, size_t count) {
+    return mk_cfs_store_int(item, page, count, &to_mk_cfs_pad(item)->leds, 0, 0xffff);
+}
+
+static ssize_t mk_cfs_pad_enable_show(struct config_item *item, char *page) {
+    return sprintf(page, "%d\n", to_mk_cfs_pad(item)->pad != NULL);
+}
+
+static ssize_t mk_cfs_pad_enable_store(struct config_item *item, const char *page, size_t count) {
+    struct mk_cfs_pad *cp = to_mk_cfs_pad(item);
+    bool enable;
+    int err;
+
+    if ((err = kstrtobool(page, &enable)))
+        return err;
+    mutex_lock(&mk_cfs_lock);
+    if (enable && !cp->pad)
+        err = mk_pad_add(mk_base, cp);
+    else if (!enable && cp->pad)
+        err = mk_pad_remove(mk_base, cp);
+    mutex_unlock(&mk_cfs_lock);
+    return err ? err : count;
+}
+
+CONFIGFS_ATTR(mk_cfs_pad_, type);
+CONFIGFS_ATTR(mk_cfs_pad_, gpio);
+CONFIGFS_ATTR(mk_cfs_pad_, bus);
+CONFIGFS_ATTR(mk_cfs_pad_, address);
+CONFIGFS_ATTR(mk_cfs_pad_, int_gpio);
+CONFIGFS_ATTR(mk_cfs_pad_, leds);
+CONFIGFS_ATTR(mk_cfs_pad_, enable);
+
+static struct configfs_attribute *mk_cfs_pad_attrs[] = {
+    &mk_cfs_pad_attr_type,
+    &mk_cfs_pad_attr_gpio,
+    &mk_cfs_pad_attr_bus,
+    &mk_cfs_pad_attr_address,
+    &mk_cfs_pad_attr_int_gpio,
+    &mk_cfs_pad_attr_leds,
+    &mk_cfs_pad_attr_enable,
+    NULL,
+};
+
+static void mk_cfs_pad_release(struct config_item *item) {
+    kfree(to_mk_cfs_pad(item));
+}
+
+static struct configfs_item_operations mk_cfs_pad_item_ops = {
+    .release = mk_cfs_pad_release,
+};
+
+static const struct config_item_type mk_cfs_pad_type = {
+    .ct_item_ops = &mk_cfs_pad_item_ops,
+    .ct_attrs = mk_cfs_pad_attrs,
+    .ct_owner = THIS_MODULE,
+};
+
+static struct mk_cfs_pad *mk_cfs_pad_alloc(const char *name) {
+    struct mk_cfs_pad *cp = kzalloc(sizeof(*cp), GFP_KERNEL);
+
+    if (!cp)
+        return NULL;
+    // an MCP23017 at the first address of i2c-1 once the type is set
+    cp->bus = 1;
+    cp->addr = 0x20;
+    cp->int_gpio = -1;
+    config_group_init_type_name(&cp->group, name, &mk_cfs_pad_type);
+    return cp;
+}
+
+static struct config_group *mk_cfs_make_group(struct config_group *group, const char *name) {
+    struct mk_cfs_pad *cp = mk_cfs_pad_alloc(name);
+
+    return cp ? &cp->group : ERR_PTR(-ENOMEM);
+}
+
+static void mk_cfs_drop_item(struct config_group *group, struct config_item *item) {
+    struct mk_cfs_pad *cp = to_mk_cfs_pad(item);
+
+    mutex_lock(&mk_cfs_lock);
+    // a pad that cannot leave the poll sets now is freed with the driver
+    if (cp->pad && mk_pad_remove(mk_base, cp))
+        pr_err("Cannot remove %s now, it stays until the driver is unloaded\n", cp->pad->phys);
+    mutex_unlock(&mk_cfs_lock);
+    config_item_put(item);
+}
+
+static struct configfs_group_operations mk_cfs_group_ops = {
+    .make_group = mk_cfs_make_group,
+    .drop_item = mk_cfs_drop_item,
+};
+
+static const struct config_item_type mk_cfs_type = {
+    .ct_group_ops = &mk_cfs_group_ops,
+    .ct_owner = THIS_MODULE,
+};
+
+static struct configfs_subsystem mk_cfs;
+
+/*
+ * A pad given at load, with the attributes it would be made with at
+ * runtime. Those read through gpiolib, on the 74HC165 chain or analog have
+ * none, as they could not be enabled again.
+ */
+static void __init mk_cfs_add_pad(struct mk_pad *pad) {
+    struct mk_cfs_pad *cp;
+
+    if (pad->type == MK_ARCADE_74HC165 || pad->type == MK_ARCADE_MCP3008 || pad->gpiods)
+        return;
+    if (!(cp = mk_cfs_pad_alloc(pad->phys))) {
+        pr_err("Not enough memory for the configfs directory of %s\n", pad->phys);
+        return;
     }
-    /* Set up i2c pointer for direct register access */
-    if ((bsc0 = ioremap(BSC0_BASE, 0xB0)) == NULL) {
-        pr_err("BSC0 ioremap failed\n");
-        return -EBUSY;
+    cp->type = pad->type;
+    if (pad->type == MK_ARCADE_GPIO_CUSTOM) {
+        memcpy(cp->gpio.mk_arcade_gpio_maps_custom, pad->gpio_maps, sizeof(pad->gpio_maps));
+        cp->gpio.nargs = ARRAY_SIZE(pad->gpio_maps);
+    } else if (pad->type == MK_ARCADE_MCP23017) {
+        cp->bus = pad->i2cdev;
+        cp->addr = pad->i2caddr;
+        cp->int_gpio = pad->int_gpio;
+        cp->leds = pad->led_mask;
+    } else if (pad->type == MK_ARCADE_MCP23S17) {
+        cp->addr = pad->spi_addr;
     }
-    /* Set up i2c pointer for direct register access */
-    if ((bsc1 = ioremap(BSC1_BASE, 0xB0)) == NULL) {
-        pr_err("BSC1 ioremap failed\n");
-        return -EBUSY;
+    cp->pad = pad;
+    configfs_add_default_group(&cp->group, &mk_cfs.su_group);
+}
+
+static void __init mk_register_cfs(struct mk *mk) {
+    int i, err;
+
+    // the module name is longer than an item name buffer
+    config_group_init_type_name(&mk_cfs.su_group, KBUILD_MODNAME, &mk_cfs_type);
+    mutex_init(&mk_cfs.su_mutex);
+    for (i = 0; i < mk->count; i++)
+        mk_cfs_add_pad(mk->pads[i]);
+    err = configfs_register_subsystem(&mk_cfs);
+    if (err) {
+        pr_err("Cannot register the configfs pads (%d), no runtime pads\n", err);
+        configfs_remove_default_groups(&mk_cfs.su_group);
+        return;
     }
+    mk_cfs_registered = true;
+}
+
+static int __init mk_init(void) {
+    int i;
 
     // Allocate and set up mk structure (which is global, so why do we pass it?!)
     mk_base = kzalloc(sizeof (struct mk), GFP_KERNEL);
@@ -679,34 +4814,136 @@ static int __init mk_init(void) {
     }
 
     mutex_init(&mk_base->mutex);
-    timer_setup(&mk_base->timer, mk_timer, 0);
+    INIT_WORK(&mk_base->replay_end, mk_replay_end_work);
+    spin_lock_init(&mk_base->pads_lock);
+    for (i = 0; i < MK_BUS_MAX; i++)
+        RCU_INIT_POINTER(mk_base->poll[i], &mk_poll_empty);
+    if (i2c_speed && (i2c_speed < 10 || i2c_speed > 1000)) {
+        pr_err("i2c_speed must be between 10 and 1000 kHz (%u)\n", i2c_speed);
+        kfree(mk_base);
+        return -EINVAL;
+    }
+    if (poll_hz < MK_POLL_HZ_MIN || poll_hz > MK_POLL_HZ_MAX) {
+        pr_err("poll_hz must be between %d and %d (%u)\n", MK_POLL_HZ_MIN, MK_POLL_HZ_MAX, poll_hz);
+        kfree(mk_base);
+        return -EINVAL;
+    }
+    if (record > MK_RECORD_MAX) {
+        pr_err("record must be at most %d (%u)\n", MK_RECORD_MAX, record);
+        kfree(mk_base);
+        return -EINVAL;
+    }
+    // room for every pad given, up to 8 MCP23017 chips on each bus
+    mk_base->size = mk_cfg.nargs + i2c0_cfg.nargs + i2c1_cfg.nargs + min(hc165_pads, (unsigned int)MK_MAX_DEVICES) +
+                    mcp23s17_cfg.nargs + mcp3008_cfg.nargs / MK_ADC_AXES;
+    mk_base->pads = kcalloc(max(mk_base->size, 1), sizeof(*mk_base->pads), GFP_KERNEL);
+    if (!mk_base->pads) {
+        pr_err("Not enough memory allocating the pads\n");
+        kfree(mk_base);
+        return -ENOMEM;
+    }
+    // polling runs in softirq context, like the timer_list it replaces
+    hrtimer_init(&mk_base->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    mk_base->timer.function = mk_timer;
+    mk_base->period = ns_to_ktime(NSEC_PER_SEC / poll_hz);
+    mk_int_poll_period = ms_to_ktime(i2c_int_poll_ms);
+    // the bus clock when i2c_speed leaves the firmware setting is assumed to be 100 kHz
+    mk_i2c_clk_ns = NSEC_PER_SEC / ((i2c_speed ? i2c_speed : 100) * 1000);
+    if (i2c_speed)
+        for (i = 0; i < ARRAY_SIZE(mk_bsc); i++)
+            mk_bsc_find_clk(&mk_bsc[i]);
+    spin_lock_init(&mk_bsc[0].lock);
+    spin_lock_init(&mk_bsc[1].lock);
+    spin_lock_init(&mk_bsc[0].xfer_lock);
+    spin_lock_init(&mk_bsc[1].xfer_lock);
     mk_base->count=0;
 
     mk_probe(mk_base, mk_cfg.args, mk_cfg.nargs);
-    mk_probe_i2c(mk_base, i2c0_cfg.args, i2c0_cfg.nargs, 0);
-    mk_probe_i2c(mk_base, i2c1_cfg.args, i2c1_cfg.nargs, 1);
-
-    if (mk_base->count < 1) {
+    mk_probe_i2c(mk_base, i2c0_cfg.args, i2c0_cfg.nargs, 0, &i2c0_int_cfg, &i2c0_leds_cfg);
+    mk_probe_i2c(mk_base, i2c1_cfg.args, i2c1_cfg.nargs, 1, &i2c1_int_cfg, &i2c1_leds_cfg);
+    mk_probe_hc165(mk_base);
+    mk_probe_spi(mk_base);
+    mk_probe_adc(mk_base);
+    mk_init_chips(mk_base);
+    // the page is there before the pads can be opened, and polled
+    if (state_page && mk_setup_state_page())
+        pr_err("Not enough memory for the state page\n");
+    // a pad opened while the rest is set up is polled once everything is in place
+    mutex_lock(&mk_base->mutex);
+    mk_register_pads(mk_base);
+
+    // a driver loaded without pads gets them through configfs
+    if (mk_base->count < 1 && mk_base->size) {
         pr_err("At least one valid device must be specified\n");
+        mutex_unlock(&mk_base->mutex);
+        free_page((unsigned long)mk_state);
+        mk_state = NULL;
+        kfree(mk_base->pads);
 	kfree(mk_base);
+        mk_free_spi(&mk_spi);
+        mk_free_spi(&mk_adc);
+        mk_unmap_registers();
         return -EINVAL;
     }
 
+    if (i2c_irq) {
+        mk_setup_bsc_irq(0);
+        mk_setup_bsc_irq(1);
+    }
+
+    if (bus_threads || mk_base->gpio_cansleep)
+        mk_setup_workers(mk_base);
+    mk_setup_gpio_leds(mk_base);
+    mk_poll_rebuild(mk_base);
+    mutex_unlock(&mk_base->mutex);
+
+    mk_register_state_dev(mk_base);
+    mk_debugfs_init(mk_base);
+    mk_register_cfs(mk_base);
+
     return 0;
 }
 
 static void __exit mk_exit(void) {
     int i;
+    // configfs holds the module while it has pads made by mkdir, the pads of the others are freed below
+    if (mk_cfs_registered) {
+        configfs_unregister_subsystem(&mk_cfs);
+        configfs_remove_default_groups(&mk_cfs.su_group);
+    }
     if (mk_base) {
+        debugfs_remove_recursive(mk_base->debugfs);
+        // stop polling before the interrupt handlers and devices go away
+        hrtimer_cancel(&mk_base->timer);
         for (i=0;i<mk_base->count;i++)
-  	    if (mk_base->pads[i].dev)
-	        input_unregister_device(mk_base->pads[i].dev);
+            mk_free_pad_irqs(mk_base->pads[i]);
+        mk_destroy_workers(mk_base);
+        mk_free_gpio_leds();
+        for (i = 0; i < ARRAY_SIZE(mk_bsc); i++)
+            mk_free_bsc_irq(&mk_bsc[i]);
+        mk_free_spi(&mk_spi);
+        mk_free_spi(&mk_adc);
+        // nothing polls any more to queue it again
+        cancel_work_sync(&mk_base->replay_end);
+        for (i=0;i<mk_base->count;i++) {
+            mk_free_pad_leds(mk_base->pads[i]);
+  	    if (mk_base->pads[i]->dev)
+	        input_unregister_device(mk_base->pads[i]->dev);
+            mk_free_pad_gpiod(mk_base->pads[i]);
+            kfree(rcu_dereference_protected(mk_base->pads[i]->timed, 1));
+            kfree(rcu_dereference_protected(mk_base->pads[i]->adc_cal, 1));
+            kvfree(rcu_dereference_protected(mk_base->pads[i]->replay, 1));
+            kvfree(mk_base->pads[i]->rec);
+            kfree(mk_base->pads[i]);
+        }
+        for (i = 0; i < MK_BUS_MAX; i++)
+            mk_free_poll_set(rcu_dereference_protected(mk_base->poll[i], 1));
+        mk_free_state_page();
+        kfree(mk_base->pads);
         kfree(mk_base);
     }
 
-    iounmap(gpio);
-    iounmap(bsc1);
-    iounmap(bsc0);
+    mk_unmap_registers();
 }
 
 module_init(mk_init);
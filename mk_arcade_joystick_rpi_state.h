@@ -0,0 +1,61 @@
+/*
+ *  Arcade Joystick Driver for RaspberryPi - shared state page
+ *
+ *  With state_page=1 the driver creates /dev/mk_arcade_joystick, a read-only
+ *  device whose single page can be mmap'd. The poller publishes the state of
+ *  every pad there each time it reads it, so a reader gets the current state
+ *  with a few loads and no syscall. Reading a pad :
+ *
+ *	do {
+ *		seq = __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE);
+ *		state = p->state;
+ *		ts = p->timestamp_ns;
+ *		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *	} while ((seq & 1) || seq != __atomic_load_n(&p->seq, __ATOMIC_RELAXED));
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#ifndef _MK_ARCADE_JOYSTICK_RPI_STATE_H
+#define _MK_ARCADE_JOYSTICK_RPI_STATE_H
+
+#include <linux/types.h>
+
+#define MK_STATE_MAGIC		0x54534b4d	/* "MKST" */
+#define MK_STATE_VERSION	1
+#define MK_STATE_PAGE_SIZE	4096
+
+/*
+ * Packed state of a pad, a set bit is a pressed input :
+ *   bits 0..3    up, down, left, right
+ *   bits 4..11   start, select, a, b, tr, y, x, tl
+ *   bits 12..15  c, tr2, z, tl2 (MCP23017 pads only)
+ */
+#define MK_STATE_UP		(1 << 0)
+#define MK_STATE_DOWN		(1 << 1)
+#define MK_STATE_LEFT		(1 << 2)
+#define MK_STATE_RIGHT		(1 << 3)
+#define MK_STATE_BTN(n)		(1 << (4 + (n)))
+
+struct mk_state_pad {
+	__u32 seq;		/* odd while the entry is being written */
+	__u32 state;		/* packed state as reported, after debouncing, autofire and macros */
+	__u64 timestamp_ns;	/* CLOCK_MONOTONIC time of the sample */
+};
+
+struct mk_state_header {
+	__u32 magic;
+	__u32 version;
+	__u32 n_pads;		/* pads[n] is the pad of inputN, padN in debugfs, 0 while there is none and for an analog pad */
+	__u32 pad_size;		/* sizeof(struct mk_state_pad) */
+};
+
+struct mk_state_page {
+	struct mk_state_header hdr;
+	struct mk_state_pad pads[(MK_STATE_PAGE_SIZE - sizeof(struct mk_state_header)) / sizeof(struct mk_state_pad)];
+};
+
+#endif /* _MK_ARCADE_JOYSTICK_RPI_STATE_H */
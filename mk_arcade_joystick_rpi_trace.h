@@ -0,0 +1,95 @@
+/*
+ *  Arcade Joystick Driver for RaspberryPi - tracepoints
+ *
+ *  Copyright (c) 2023 Daniel Moreno
+ *  Copyright (c) 2018 Mark Spaeth
+ *  Copyright (c) 2014 Matthieu Proucelle
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mk_arcade_joystick
+
+#if !defined(_MK_ARCADE_JOYSTICK_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MK_ARCADE_JOYSTICK_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Timer tick : how late it fired compared with its expiry */
+TRACE_EVENT(mk_poll_start,
+    TP_PROTO(s64 lateness_ns),
+    TP_ARGS(lateness_ns),
+    TP_STRUCT__entry(
+        __field(s64, lateness_ns)
+    ),
+    TP_fast_assign(
+        __entry->lateness_ns = lateness_ns;
+    ),
+    TP_printk("lateness=%lldns", __entry->lateness_ns)
+);
+
+/* End of the poll cycle started by the timer tick */
+TRACE_EVENT(mk_poll_end,
+    TP_PROTO(s64 duration_ns),
+    TP_ARGS(duration_ns),
+    TP_STRUCT__entry(
+        __field(s64, duration_ns)
+    ),
+    TP_fast_assign(
+        __entry->duration_ns = duration_ns;
+    ),
+    TP_printk("duration=%lldns", __entry->duration_ns)
+);
+
+/* One pad read, with the raw packed state it returned */
+TRACE_EVENT(mk_pad_read,
+    TP_PROTO(int pad, u32 state, s64 duration_ns),
+    TP_ARGS(pad, state, duration_ns),
+    TP_STRUCT__entry(
+        __field(int, pad)
+        __field(u32, state)
+        __field(s64, duration_ns)
+    ),
+    TP_fast_assign(
+        __entry->pad = pad;
+        __entry->state = state;
+        __entry->duration_ns = duration_ns;
+    ),
+    TP_printk("pad=%d state=0x%04x duration=%lldns", __entry->pad, __entry->state, __entry->duration_ns)
+);
+
+/* One BSC transaction, with the status register at its end */
+TRACE_EVENT(mk_bsc_xfer,
+    TP_PROTO(int bus, int addr, bool read, u32 status, s64 duration_ns),
+    TP_ARGS(bus, addr, read, status, duration_ns),
+    TP_STRUCT__entry(
+        __field(int, bus)
+        __field(int, addr)
+        __field(bool, read)
+        __field(u32, status)
+        __field(s64, duration_ns)
+    ),
+    TP_fast_assign(
+        __entry->bus = bus;
+        __entry->addr = addr;
+        __entry->read = read;
+        __entry->status = status;
+        __entry->duration_ns = duration_ns;
+    ),
+    TP_printk("i2c-%d addr=0x%02x %s status=0x%03x duration=%lldns", __entry->bus, __entry->addr,
+              __entry->read ? "read" : "write", __entry->status, __entry->duration_ns)
+);
+
+#endif /* _MK_ARCADE_JOYSTICK_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mk_arcade_joystick_rpi_trace
+#include <trace/define_trace.h>
@@ -0,0 +1 @@
+#include "../mk_sim_kernel.h"
@@ -0,0 +1,736 @@
+/*
+ *  Arcade Joystick Driver for RaspberryPi - userspace simulator
+ *
+ *  Just enough of the kernel API for mk_arcade_joystick_rpi.c to build and
+ *  run as a normal program. Everything the driver does not exercise in the
+ *  simulator (interrupts, threads, debugfs...) is a stub that reports
+ *  failure or does nothing; the driver then takes its fallback paths.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#ifndef _MK_SIM_KERNEL_H
+#define _MK_SIM_KERNEL_H
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef long long s64;
+typedef s64 ktime_t;
+#define KTIME_MAX ((s64)~((u64)1 << 63))
+typedef unsigned int gfp_t;
+typedef unsigned short umode_t;
+
+#define __init
+#define __exit
+#define __initdata
+#define __user
+#define __rcu
+#define __iomem
+#define __always_unused		__attribute__((unused))
+
+#define GFP_KERNEL		0
+#define HZ			100
+
+/* MISC */
+#define BIT(n)			(1UL << (n))
+#define BIT_MASK(n)		(1UL << ((n) % (8 * sizeof(long))))
+#define BIT_WORD(n)		((n) / (8 * sizeof(long)))
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+#define min(a, b)		((a) < (b) ? (a) : (b))
+#define max(a, b)		((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)		min((t)(a), (t)(b))
+#define max_t(t, a, b)		max((t)(a), (t)(b))
+#define clamp(v, lo, hi)	min(max(v, lo), hi)
+#define clamp_val		clamp
+#define clamp_t(t, v, lo, hi)	min_t(t, max_t(t, v, lo), hi)
+#define swap(a, b)		do { typeof(a) __tmp = (a); (a) = (b); (b) = __tmp; } while (0)
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+#define DIV_ROUND_UP_ULL(ll, d)	(((unsigned long long)(ll) + (d) - 1) / (d))
+#define round_up(x, y)		((((x) - 1) | ((y) - 1)) + 1)
+#define READ_ONCE(x)		(*(volatile typeof(x) *)&(x))
+#define WRITE_ONCE(x, v)	(*(volatile typeof(x) *)&(x) = (v))
+#define likely(x)		__builtin_expect(!!(x), 1)
+#define unlikely(x)		__builtin_expect(!!(x), 0)
+#define IS_ERR(p)		((unsigned long)(p) >= (unsigned long)-4095)
+#define IS_ERR_OR_NULL(p)	(!(p) || IS_ERR(p))
+#define PTR_ERR(p)		((long)(p))
+#define ERR_PTR(e)		((void *)(long)(e))
+#define BUILD_BUG_ON(c)		_Static_assert(!(c), #c)
+#define smp_wmb()		__atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_rmb()		__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define smp_load_acquire(p)	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define __user
+#define KERNEL_VERSION(a, b, c)	(((a) << 16) + ((b) << 8) + (c))
+#define LINUX_VERSION_CODE	KERNEL_VERSION(6, 6, 0)
+
+/* MODULE */
+#define THIS_MODULE		NULL
+#define module_param(name, type, perm)
+#define module_param_named(name, var, type, perm)
+#define module_param_array(name, type, nump, perm)
+#define module_param_array_named(name, array, type, nump, perm)
+#define MODULE_PARM_DESC(name, desc)
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_LICENSE(x)
+#define module_init(fn)
+#define module_exit(fn)
+
+/* PRINTK */
+extern bool mk_sim_verbose;
+
+static inline __attribute__((format(printf, 1, 2))) int printk(const char *fmt, ...) {
+    va_list ap;
+    int ret = 0;
+
+    if (mk_sim_verbose) {
+        va_start(ap, fmt);
+        ret = vfprintf(stderr, fmt, ap);
+        va_end(ap);
+    }
+    return ret;
+}
+
+#define pr_err(fmt, ...)	printk(pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_warn(fmt, ...)	printk(pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_info(fmt, ...)	printk(pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_debug(fmt, ...)	do { } while (0)
+
+/* DELAY : the models answer at once */
+static inline void udelay(unsigned long us) { }
+static inline void ndelay(unsigned long ns) { }
+static inline void mdelay(unsigned long ms) { }
+static inline void msleep(unsigned int ms) { }
+static inline void usleep_range(unsigned long min_us, unsigned long max_us) { }
+
+/* MEMORY */
+static inline void *kzalloc(size_t size, gfp_t flags) { return calloc(1, size); }
+static inline void *kcalloc(size_t n, size_t size, gfp_t flags) { return calloc(n, size); }
+static inline void kfree(const void *p) { free((void *)p); }
+static inline void *kvzalloc(size_t size, gfp_t flags) { return calloc(1, size); }
+static inline void kvfree(const void *p) { free((void *)p); }
+
+/* REGISTERS : implemented by the simulator models */
+void *ioremap(unsigned long phys, unsigned long size);
+void iounmap(volatile void *addr);
+u32 mk_readl(volatile unsigned *base, int reg);
+void mk_writel(volatile unsigned *base, int reg, u32 val);
+
+/* LOCKING : the simulator is single threaded */
+struct mutex { int unused; };
+typedef struct { int unused; } spinlock_t;
+#define DEFINE_MUTEX(m)			struct mutex m
+#define mutex_init(m)			do { } while (0)
+#define mutex_lock(m)			do { (void)(m); } while (0)
+#define mutex_unlock(m)			do { (void)(m); } while (0)
+#define mutex_lock_interruptible(m)	0
+#define spin_lock_init(l)		do { } while (0)
+#define spin_lock(l)			do { } while (0)
+#define spin_unlock(l)			do { } while (0)
+#define spin_lock_bh(l)			do { } while (0)
+#define spin_unlock_bh(l)		do { } while (0)
+#define spin_lock_irqsave(l, f)		do { (void)(f); } while (0)
+#define spin_unlock_irqrestore(l, f)	do { (void)(f); } while (0)
+
+/* SRCU : readers never overlap the updater in a single thread */
+struct srcu_struct { int unused; };
+#define DEFINE_STATIC_SRCU(name)		static struct srcu_struct name
+static inline int srcu_read_lock(struct srcu_struct *s) { return 0; }
+static inline void srcu_read_unlock(struct srcu_struct *s, int idx) { }
+static inline void synchronize_srcu(struct srcu_struct *s) { }
+static inline void synchronize_rcu(void) { }
+#define srcu_dereference(p, s)			(p)
+#define rcu_dereference_protected(p, c)		(p)
+#define rcu_assign_pointer(p, v)		((p) = (v))
+#define RCU_INIT_POINTER(p, v)			((p) = (v))
+#define lockdep_is_held(l)			1
+
+/* RCU : the same, and nothing is in flight when an old copy is freed */
+struct rcu_head { int unused; };
+static inline void rcu_read_lock(void) { }
+static inline void rcu_read_unlock(void) { }
+#define rcu_dereference(p)			(p)
+#define rcu_access_pointer(p)			(p)
+#define kfree_rcu(p, f)				free(p)
+
+/* BITOPS */
+static inline void set_bit(int nr, unsigned long *addr) { addr[BIT_WORD(nr)] |= BIT_MASK(nr); }
+static inline void __set_bit(int nr, unsigned long *addr) { set_bit(nr, addr); }
+static inline void clear_bit(int nr, unsigned long *addr) { addr[BIT_WORD(nr)] &= ~BIT_MASK(nr); }
+static inline void clear_bit_unlock(int nr, unsigned long *addr) { clear_bit(nr, addr); }
+static inline int test_bit(int nr, const unsigned long *addr) { return !!(addr[BIT_WORD(nr)] & BIT_MASK(nr)); }
+static inline int test_and_set_bit(int nr, unsigned long *addr) { int old = test_bit(nr, addr); set_bit(nr, addr); return old; }
+static inline int test_and_set_bit_lock(int nr, unsigned long *addr) { return test_and_set_bit(nr, addr); }
+static inline int test_and_clear_bit(int nr, unsigned long *addr) { int old = test_bit(nr, addr); clear_bit(nr, addr); return old; }
+
+/* WAIT_BIT : the SPI messages run at the end of a tick, so no bit is left to wait for */
+#define TASK_UNINTERRUPTIBLE	2
+static inline int wait_on_bit(unsigned long *word, int bit, unsigned mode) { return 0; }
+static inline void clear_and_wake_up_bit(int bit, unsigned long *word) { clear_bit_unlock(bit, word); }
+static inline unsigned long __ffs(unsigned long w) { return __builtin_ctzl(w); }
+static inline int hweight16(unsigned int w) { return __builtin_popcount(w & 0xffff); }
+static inline int ilog2(u64 v) { return 63 - __builtin_clzll(v); }
+static inline unsigned long roundup_pow_of_two(unsigned long n) { return n < 2 ? 1 : 1UL << (ilog2(n - 1) + 1); }
+static inline u64 div_u64(u64 a, u32 b) { return a / b; }
+static inline u64 div64_u64(u64 a, u64 b) { return a / b; }
+static inline s64 div_s64(s64 a, s32 b) { return a / b; }
+
+/* STRINGS */
+static inline char *kstrndup(const char *s, size_t max, gfp_t gfp) { return strndup(s, max); }
+static inline char *strim(char *s) {
+    char *end;
+
+    while (isspace((unsigned char)*s))
+        s++;
+    end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+    return s;
+}
+static inline int kstrtoint(const char *s, unsigned int base, int *res) {
+    char *end;
+    long v;
+
+    errno = 0;
+    v = strtol(s, &end, base);
+    if (*end == '\n')
+        end++;
+    if (!*s || *end || errno || v < INT_MIN || v > INT_MAX)
+        return -EINVAL;
+    *res = v;
+    return 0;
+}
+static inline int kstrtobool(const char *s, bool *res) {
+    if (*s == '1' || *s == 'y' || *s == 'Y')
+        *res = true;
+    else if (*s == '0' || *s == 'n' || *s == 'N')
+        *res = false;
+    else
+        return -EINVAL;
+    return 0;
+}
+static inline int kstrtouint(const char *s, unsigned int base, unsigned int *res) {
+    char *end;
+    unsigned long v;
+
+    errno = 0;
+    v = strtoul(s, &end, base);
+    if (!*s || *end || errno || v > 0xffffffffUL)
+        return -EINVAL;
+    *res = v;
+    return 0;
+}
+
+/* TIME */
+#define NSEC_PER_USEC		1000L
+#define NSEC_PER_MSEC		1000000L
+#define NSEC_PER_SEC		1000000000L
+#define USEC_PER_SEC		1000000L
+
+extern s64 mk_sim_clock_skew;	// time mk_sim_advance() skipped
+
+static inline ktime_t ktime_get(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (s64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec + mk_sim_clock_skew;
+}
+static inline u64 ktime_get_ns(void) { return ktime_get(); }
+static inline s64 ktime_to_ns(ktime_t t) { return t; }
+static inline ktime_t ns_to_ktime(u64 ns) { return ns; }
+static inline ktime_t ms_to_ktime(u64 ms) { return ms * NSEC_PER_MSEC; }
+static inline ktime_t ktime_add(ktime_t a, ktime_t b) { return a + b; }
+static inline ktime_t ktime_add_ns(ktime_t a, u64 ns) { return a + ns; }
+static inline ktime_t ktime_sub_ns(ktime_t a, u64 ns) { return a - ns; }
+static inline ktime_t ktime_add_ms(ktime_t a, u64 ms) { return a + ms * NSEC_PER_MSEC; }
+static inline void cpu_relax(void) { }
+static inline ktime_t ktime_sub(ktime_t a, ktime_t b) { return a - b; }
+static inline bool ktime_before(ktime_t a, ktime_t b) { return a < b; }
+static inline bool ktime_after(ktime_t a, ktime_t b) { return a > b; }
+#define time_before(a, b)	((long)((a) - (b)) < 0)
+
+/* HRTIMER : never fires, the simulator calls the callback itself */
+enum hrtimer_restart { HRTIMER_NORESTART, HRTIMER_RESTART };
+enum hrtimer_mode { HRTIMER_MODE_REL, HRTIMER_MODE_ABS, HRTIMER_MODE_REL_SOFT, HRTIMER_MODE_ABS_SOFT };
+#define CLOCK_MONOTONIC_HR	CLOCK_MONOTONIC
+
+struct hrtimer {
+    enum hrtimer_restart (*function)(struct hrtimer *);
+    ktime_t expires;
+    bool active;
+};
+
+static inline void hrtimer_init(struct hrtimer *t, int clock, enum hrtimer_mode mode) { memset(t, 0, sizeof(*t)); }
+static inline void hrtimer_start(struct hrtimer *t, ktime_t tim, enum hrtimer_mode mode) {
+    t->expires = (mode == HRTIMER_MODE_ABS || mode == HRTIMER_MODE_ABS_SOFT) ? tim : ktime_get() + tim;
+    t->active = true;
+}
+static inline int hrtimer_cancel(struct hrtimer *t) { int was = t->active; t->active = false; return was; }
+static inline ktime_t hrtimer_get_expires(const struct hrtimer *t) { return t->expires; }
+static inline u64 hrtimer_forward(struct hrtimer *t, ktime_t now, ktime_t interval) {
+    u64 n;
+
+    if (now < t->expires)
+        return 0;
+    n = (now - t->expires) / interval + 1;
+    t->expires += n * interval;
+    return n;
+}
+static inline u64 hrtimer_forward_now(struct hrtimer *t, ktime_t interval) { return hrtimer_forward(t, ktime_get(), interval); }
+
+/* INTERRUPTS : none in the simulator */
+typedef int irqreturn_t;
+typedef irqreturn_t (*irq_handler_t)(int, void *);
+#define IRQ_NONE		0
+#define IRQ_HANDLED		1
+#define IRQ_WAKE_THREAD		2
+#define IRQF_TRIGGER_RISING	0x01
+#define IRQF_TRIGGER_FALLING	0x02
+#define IRQF_SHARED		0x80
+#define IRQF_ONESHOT		0x2000
+
+static inline int gpio_to_irq(unsigned int gpio) { return -ENODEV; }
+static inline int request_irq(unsigned int irq, irq_handler_t handler, unsigned long flags, const char *name, void *dev) { return -ENODEV; }
+static inline int request_threaded_irq(unsigned int irq, irq_handler_t handler, irq_handler_t thread_fn,
+                                       unsigned long flags, const char *name, void *dev) { return -ENODEV; }
+static inline void free_irq(unsigned int irq, void *dev) { }
+static inline void disable_irq(unsigned int irq) { }
+static inline void enable_irq(unsigned int irq) { }
+
+/* DEVICE TREE : empty */
+struct device_node { int unused; };
+struct resource { unsigned long start, end; };
+static inline struct device_node *of_find_compatible_node(struct device_node *from, const char *type, const char *compat) { return NULL; }
+#define for_each_compatible_node(dn, type, compat) \
+    for (dn = of_find_compatible_node(NULL, type, compat); dn; dn = of_find_compatible_node(dn, type, compat))
+static inline int of_address_to_resource(struct device_node *np, int index, struct resource *r) { return -EINVAL; }
+static inline unsigned int irq_of_parse_and_map(struct device_node *np, int index) { return 0; }
+static inline void of_node_put(struct device_node *np) { }
+
+/* CLOCKS : none in the device tree either */
+struct clk { int unused; };
+static inline struct clk *of_clk_get(struct device_node *np, int index) { return ERR_PTR(-ENOENT); }
+static inline unsigned long clk_get_rate(struct clk *clk) { return 0; }
+static inline void clk_put(struct clk *clk) { }
+
+/* GPIOD : lines of the simulated GPIO bank, implemented by the simulator */
+struct device_driver { const char *name; };
+struct attribute_group;
+struct device {
+    const char *name;
+    struct device_driver *driver;
+    const struct attribute_group **groups;
+};
+
+/* SYSFS : attributes are reached through mk_sim_attr_store() and mk_sim_attr_show() */
+struct attribute { const char *name; umode_t mode; };
+struct attribute_group { struct attribute **attrs; };
+struct device_attribute {
+    struct attribute attr;
+    ssize_t (*show)(struct device *dev, struct device_attribute *attr, char *buf);
+    ssize_t (*store)(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+};
+#define DEVICE_ATTR_RW(_name) \
+    struct device_attribute dev_attr_ ## _name = { { #_name, 0644 }, _name ## _show, _name ## _store }
+#define DEVICE_ATTR_RO(_name) \
+    struct device_attribute dev_attr_ ## _name = { { #_name, 0444 }, _name ## _show, NULL }
+#define ATTRIBUTE_GROUPS(_name) \
+    static const struct attribute_group _name ## _group = { .attrs = _name ## _attrs }; \
+    static const struct attribute_group *_name ## _groups[] = { &_name ## _group, NULL }
+static inline __attribute__((format(printf, 3, 4))) int sysfs_emit_at(char *buf, int at, const char *fmt, ...) {
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf + at, 4096 - at, fmt, ap);
+    va_end(ap);
+    return len;
+}
+
+/* CONFIGFS : items are reached through mk_sim_cfs_mkdir() and friends */
+struct config_item_type;
+struct config_item { char ci_namebuf[20]; const char *ci_name; const struct config_item_type *ci_type; };
+struct config_group {
+    struct config_item cg_item;
+    struct config_group *cg_default;	// first default group
+    struct config_group *cg_next;	// next default group of the parent
+};
+#define to_config_group(item)	container_of(item, struct config_group, cg_item)
+struct configfs_attribute {
+    const char *ca_name;
+    umode_t ca_mode;
+    ssize_t (*show)(struct config_item *item, char *page);
+    ssize_t (*store)(struct config_item *item, const char *page, size_t count);
+};
+#define CONFIGFS_ATTR(_pfx, _name) \
+    static struct configfs_attribute _pfx ## attr_ ## _name = { #_name, 0644, _pfx ## _name ## _show, _pfx ## _name ## _store }
+struct configfs_item_operations { void (*release)(struct config_item *item); };
+struct configfs_group_operations {
+    struct config_item *(*make_item)(struct config_group *group, const char *name);
+    struct config_group *(*make_group)(struct config_group *group, const char *name);
+    void (*drop_item)(struct config_group *group, struct config_item *item);
+};
+struct config_item_type {
+    void *ct_owner;
+    struct configfs_item_operations *ct_item_ops;
+    struct configfs_group_operations *ct_group_ops;
+    struct configfs_attribute **ct_attrs;
+};
+struct configfs_subsystem { struct config_group su_group; struct mutex su_mutex; };
+// the name is copied when it fits, as configfs does
+static inline void config_item_init_type_name(struct config_item *item, const char *name, const struct config_item_type *type) {
+    item->ci_name = name;
+    if (strlen(name) < sizeof(item->ci_namebuf))
+        item->ci_name = strcpy(item->ci_namebuf, name);
+    item->ci_type = type;
+}
+static inline void config_group_init_type_name(struct config_group *group, const char *name, const struct config_item_type *type) {
+    config_item_init_type_name(&group->cg_item, name, type);
+    group->cg_default = NULL;
+}
+static inline int configfs_register_subsystem(struct configfs_subsystem *subsys) { return 0; }
+static inline void configfs_unregister_subsystem(struct configfs_subsystem *subsys) { }
+static inline void config_item_put(struct config_item *item) { item->ci_type->ct_item_ops->release(item); }
+static inline void configfs_add_default_group(struct config_group *group, struct config_group *parent) {
+    group->cg_next = parent->cg_default;
+    parent->cg_default = group;
+}
+static inline void configfs_remove_default_groups(struct config_group *group) {
+    struct config_group *g;
+
+    while ((g = group->cg_default)) {
+        group->cg_default = g->cg_next;
+        config_item_put(&g->cg_item);
+    }
+}
+static inline const char *config_item_name(struct config_item *item) { return item->ci_name; }
+
+struct platform_device { struct device dev; char name[32]; };
+static inline const char *dev_name(const struct device *dev) { return dev->name; }
+struct platform_device *platform_device_register_simple(const char *name, int id, const void *res, unsigned int num);
+void platform_device_unregister(struct platform_device *pdev);
+
+struct gpio_desc;
+struct gpio_array;
+struct gpio_descs { struct gpio_array *info; unsigned int ndescs; struct gpio_desc *desc[]; };
+enum gpiod_flags { GPIOD_IN = 1 };
+#define GPIO_ACTIVE_LOW		(1 << 0)
+#define GPIO_PULL_UP		(1 << 4)
+struct gpiod_lookup { const char *key; u16 chip_hwnum; const char *con_id; unsigned int idx; unsigned long flags; };
+struct gpiod_lookup_table { const char *dev_id; struct gpiod_lookup table[]; };
+#define GPIO_LOOKUP_IDX(_key, _chip_hwnum, _con_id, _idx, _flags) \
+	{ .key = _key, .chip_hwnum = _chip_hwnum, .con_id = _con_id, .idx = _idx, .flags = _flags }
+#define struct_size(p, member, n)	(sizeof(*(p)) + (n) * sizeof((p)->member[0]))
+#define DECLARE_BITMAP(name, bits)	unsigned long name[BIT_WORD((bits) - 1) + 1]
+#define for_each_set_bit(bit, addr, size) \
+	for ((bit) = 0; (bit) < (size); (bit)++) if (test_bit(bit, addr))
+
+void gpiod_add_lookup_table(struct gpiod_lookup_table *table);
+void gpiod_remove_lookup_table(struct gpiod_lookup_table *table);
+struct gpio_descs *gpiod_get_array(struct device *dev, const char *con_id, enum gpiod_flags flags);
+void gpiod_put_array(struct gpio_descs *descs);
+int gpiod_get_array_value(unsigned int n, struct gpio_desc **desc, struct gpio_array *info, unsigned long *values);
+int gpiod_get_array_value_cansleep(unsigned int n, struct gpio_desc **desc, struct gpio_array *info, unsigned long *values);
+int gpiod_cansleep(const struct gpio_desc *desc);
+static inline int gpiod_to_irq(const struct gpio_desc *desc) { return -ENODEV; }
+
+/* LEDS : class devices are reached by name through mk_sim_led_set(), implemented by the simulator */
+enum led_brightness { LED_OFF = 0, LED_ON = 1, LED_FULL = 255 };
+struct led_classdev {
+    const char *name;
+    unsigned int max_brightness;
+    enum led_brightness brightness;
+    void (*brightness_set)(struct led_classdev *led_cdev, enum led_brightness brightness);
+};
+int led_classdev_register(struct device *parent, struct led_classdev *led_cdev);
+void led_classdev_unregister(struct led_classdev *led_cdev);
+
+/* SPI : one device, its messages run when the simulator says so */
+#define SPI_MODE_0		0
+#define ____cacheline_aligned	__attribute__((aligned(64)))
+
+struct bus_type { const char *name; };
+struct spi_device {
+    struct device dev;
+    u32 max_speed_hz;
+    u8 bits_per_word;
+    u32 mode;
+};
+struct spi_transfer {
+    const void *tx_buf;
+    void *rx_buf;
+    unsigned len;
+    unsigned cs_change:1;
+    u32 speed_hz;
+    struct spi_transfer *next;	/* simulator list */
+};
+struct spi_message {
+    struct spi_transfer *transfers;
+    struct spi_transfer **tail;
+    void (*complete)(void *context);
+    void *context;
+    int status;
+};
+#define to_spi_device(d)	container_of(d, struct spi_device, dev)
+
+extern struct bus_type spi_bus_type;
+struct device *bus_find_device_by_name(struct bus_type *bus, struct device *start, const char *name);
+static inline void put_device(struct device *dev) { }
+static inline void spi_message_init(struct spi_message *m) {
+    memset(m, 0, sizeof(*m));
+    m->tail = &m->transfers;
+}
+static inline void spi_message_add_tail(struct spi_transfer *t, struct spi_message *m) {
+    t->next = NULL;
+    *m->tail = t;
+    m->tail = &t->next;
+}
+static inline int spi_setup(struct spi_device *spi) { return 0; }
+int spi_async(struct spi_device *spi, struct spi_message *message);
+int spi_write_then_read(struct spi_device *spi, const void *txbuf, unsigned n_tx, void *rxbuf, unsigned n_rx);
+
+/* THREADS : none in the simulator */
+struct task_struct { int unused; };
+struct kthread_worker { struct task_struct *task; };
+struct kthread_work { void (*func)(struct kthread_work *); };
+#define kthread_create_worker(flags, fmt, ...)			ERR_PTR(-ENOSYS)
+#define kthread_create_worker_on_cpu(cpu, flags, fmt, ...)	ERR_PTR(-ENOSYS)
+static inline void kthread_init_work(struct kthread_work *w, void (*fn)(struct kthread_work *)) { w->func = fn; }
+static inline bool kthread_queue_work(struct kthread_worker *wk, struct kthread_work *w) { w->func(w); return true; }
+static inline bool kthread_cancel_work_sync(struct kthread_work *w) { return false; }
+static inline void kthread_flush_work(struct kthread_work *w) { }
+static inline void kthread_destroy_worker(struct kthread_worker *wk) { }
+static inline void sched_set_fifo(struct task_struct *p) { }
+static inline bool cpu_online(int cpu) { return cpu == 0; }
+
+/* WORKQUEUE : the works queued during a tick run at its end */
+struct work_struct {
+    void (*func)(struct work_struct *);
+    struct work_struct *next;
+    bool pending;
+};
+#define INIT_WORK(w, fn)	do { (w)->func = (fn); (w)->next = NULL; (w)->pending = false; } while (0)
+bool schedule_work(struct work_struct *w);
+bool cancel_work_sync(struct work_struct *w);
+
+/* async */
+typedef unsigned long long async_cookie_t;
+typedef void (*async_func_t)(void *data, async_cookie_t cookie);
+struct async_domain { int registered; };
+#define ASYNC_DOMAIN_EXCLUSIVE(_name)	struct async_domain _name = { 0 }
+static inline async_cookie_t async_schedule_domain(async_func_t fn, void *data, struct async_domain *d) { fn(data, 0); return 0; }
+static inline void async_synchronize_full_domain(struct async_domain *d) { }
+
+/* FILES, MAPPINGS AND THE MISC DEVICE : the state page is plain memory, nothing is exported */
+#define PAGE_SHIFT		12
+#define PAGE_SIZE		(1UL << PAGE_SHIFT)
+#define FMODE_WRITE		0x2
+#define VM_WRITE		0x2
+#define VM_MAYWRITE		0x20
+#define MISC_DYNAMIC_MINOR	255
+
+struct dentry;
+struct path { struct dentry *dentry; };
+struct inode { void *i_private; };
+struct file { void *private_data; unsigned int f_mode; struct path f_path; };
+typedef struct { unsigned long pgprot; } pgprot_t;
+struct vm_area_struct {
+    unsigned long vm_start;
+    unsigned long vm_end;
+    unsigned long vm_pgoff;
+    unsigned long vm_flags;
+    pgprot_t vm_page_prot;
+};
+struct file_operations {
+    void *owner;
+    int (*open)(struct inode *, struct file *);
+    ssize_t (*read)(struct file *, char *, size_t, loff_t *);
+    ssize_t (*write)(struct file *, const char *, size_t, loff_t *);
+    int (*release)(struct inode *, struct file *);
+    int (*mmap)(struct file *, struct vm_area_struct *);
+    long long (*llseek)(struct file *, long long, int);
+};
+struct miscdevice {
+    int minor;
+    const char *name;
+    const struct file_operations *fops;
+    umode_t mode;
+};
+
+static inline unsigned long get_zeroed_page(gfp_t gfp) {
+    void *p = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+
+    if (p)
+        memset(p, 0, PAGE_SIZE);
+    return (unsigned long)p;
+}
+static inline void free_page(unsigned long addr) { free((void *)addr); }
+static inline unsigned long virt_to_phys(void *p) { return (unsigned long)p; }
+static inline void vm_flags_clear(struct vm_area_struct *vma, unsigned long flags) { vma->vm_flags &= ~flags; }
+static inline int remap_pfn_range(struct vm_area_struct *vma, unsigned long addr, unsigned long pfn,
+                                  unsigned long size, pgprot_t prot) { return -ENOSYS; }
+static inline unsigned long copy_from_user(void *to, const void *from, unsigned long n) {
+    memcpy(to, from, n);
+    return 0;
+}
+static inline ssize_t simple_read_from_buffer(void *to, size_t count, loff_t *ppos, const void *from, size_t available) {
+    if (*ppos >= available)
+        return 0;
+    count = min(count, available - (size_t)*ppos);
+    memcpy(to, (const char *)from + *ppos, count);
+    *ppos += count;
+    return count;
+}
+static inline long long noop_llseek(struct file *file, long long offset, int whence) { return 0; }
+static inline int misc_register(struct miscdevice *misc) { return 0; }
+static inline void misc_deregister(struct miscdevice *misc) { }
+
+/*
+ * DEBUGFS / SEQ_FILE : nothing is exported, a seq_file with a buffer is
+ * printed to by the simulator. The directories and files are only kept by
+ * name, for the simulator to hold one open while it is removed.
+ */
+struct seq_file { void *private; char *buf; size_t size; size_t count; };
+struct seq_operations {
+    void *(*start)(struct seq_file *m, loff_t *pos);
+    void (*stop)(struct seq_file *m, void *v);
+    void *(*next)(struct seq_file *m, void *v, loff_t *pos);
+    int (*show)(struct seq_file *m, void *v);
+};
+
+static inline __attribute__((format(printf, 2, 3))) int seq_printf(struct seq_file *m, const char *fmt, ...) {
+    va_list ap;
+    int len;
+
+    if (!m->buf || m->count >= m->size)
+        return 0;
+    va_start(ap, fmt);
+    len = vsnprintf(m->buf + m->count, m->size - m->count, fmt, ap);
+    va_end(ap);
+    m->count = min(m->count + len, m->size);
+    return 0;
+}
+#define DEFINE_SEQ_ATTRIBUTE(__name)							\
+static const struct seq_operations __name ## _sops = {					\
+    .start = __name ## _start, .next = __name ## _next, .stop = __name ## _stop, .show = __name ## _show,	\
+};											\
+static const struct file_operations __name ## _fops = { .open = NULL }
+#define DEFINE_SHOW_ATTRIBUTE(__name)							\
+static int __name ## _open(struct inode *inode, struct file *file) {			\
+    struct seq_file m = { .private = inode->i_private };				\
+    return __name ## _show(&m, NULL);							\
+}											\
+static const struct file_operations __name ## _fops = { .open = __name ## _open }
+
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent);
+struct dentry *debugfs_create_file(const char *name, umode_t mode, struct dentry *parent, void *data,
+                                   const struct file_operations *fops);
+static inline void debugfs_create_u32(const char *name, umode_t mode, struct dentry *parent, u32 *value) { }
+static inline void debugfs_create_u64(const char *name, umode_t mode, struct dentry *parent, u64 *value) { }
+static inline void debugfs_create_ulong(const char *name, umode_t mode, struct dentry *parent, unsigned long *value) { }
+void debugfs_remove_recursive(struct dentry *d);
+int debugfs_file_get(struct dentry *d);
+static inline void debugfs_file_put(struct dentry *d) { }
+
+/* TRACEPOINTS : compiled out */
+#define TP_PROTO(...)		__VA_ARGS__
+#define TP_ARGS(...)		__VA_ARGS__
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print) \
+    static inline void trace_ ## name(proto) { }
+
+/* INPUT : events are recorded on the device for the simulator to check */
+#define EV_KEY			0x01
+#define EV_ABS			0x03
+#define ABS_X			0x00
+#define ABS_Y			0x01
+#define ABS_THROTTLE		0x06
+#define ABS_CNT			0x40
+#define KEY_CNT			0x300
+#define BTN_A			0x130
+#define BTN_B			0x131
+#define BTN_C			0x132
+#define BTN_X			0x133
+#define BTN_Y			0x134
+#define BTN_Z			0x135
+#define BTN_TL			0x136
+#define BTN_TR			0x137
+#define BTN_TL2			0x138
+#define BTN_TR2			0x139
+#define BTN_SELECT		0x13a
+#define BTN_START		0x13b
+#define BUS_PARPORT		0x15
+
+struct input_id {
+    u16 bustype;
+    u16 vendor;
+    u16 product;
+    u16 version;
+};
+
+struct input_dev {
+    struct device dev;
+    const char *name;
+    const char *phys;
+    struct input_id id;
+    unsigned long evbit[1];
+    unsigned long keybit[KEY_CNT / (8 * sizeof(long))];
+    int (*open)(struct input_dev *dev);
+    void (*close)(struct input_dev *dev);
+    void *drvdata;
+    /* simulator state */
+    unsigned long key[KEY_CNT / (8 * sizeof(long))];
+    int abs[ABS_CNT];
+    ktime_t timestamp;
+    unsigned long events;
+    unsigned long syncs;
+};
+
+#define to_input_dev(d)		container_of(d, struct input_dev, dev)
+
+static inline struct input_dev *input_allocate_device(void) { return calloc(1, sizeof(struct input_dev)); }
+static inline void input_free_device(struct input_dev *dev) { free(dev); }
+static inline int input_register_device(struct input_dev *dev) { return 0; }
+static inline void input_unregister_device(struct input_dev *dev) { free(dev); }
+static inline void input_set_drvdata(struct input_dev *dev, void *data) { dev->drvdata = data; }
+static inline void *input_get_drvdata(struct input_dev *dev) { return dev->drvdata; }
+static inline void input_set_abs_params(struct input_dev *dev, unsigned int axis, int min, int max, int fuzz, int flat) {
+    dev->evbit[0] |= BIT_MASK(EV_ABS);
+}
+static inline void input_report_key(struct input_dev *dev, unsigned int code, int value) {
+    if (value)
+        set_bit(code, dev->key);
+    else
+        clear_bit(code, dev->key);
+    dev->events++;
+}
+static inline void input_report_abs(struct input_dev *dev, unsigned int code, int value) {
+    dev->abs[code] = value;
+    dev->events++;
+}
+static inline void input_set_timestamp(struct input_dev *dev, ktime_t timestamp) { dev->timestamp = timestamp; }
+static inline void input_sync(struct input_dev *dev) { dev->syncs++; }
+
+#endif /* _MK_SIM_KERNEL_H */
@@ -0,0 +1 @@
+/* tracepoints are compiled out in the simulator */
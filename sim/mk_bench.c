@@ -0,0 +1,511 @@
+/*
+ *  Arcade Joystick Driver for RaspberryPi - poll benchmark
+ *
+ *  Runs the driver timer tick against the simulated hardware for 1 to 18
+ *  pads (up to 2 on GPIO, the rest MCP23017 chips spread over both I2C
+ *  buses, 8 on each) while the switches move, and reports the cost of a tick and the
+ *  input events produced. Every tick the state reported to the input core
+ *  and the one published in the state page are checked against the
+ *  simulated switches.
+ *
+ *  With -g the GPIO pads are read through the gpiolib backend (gpiod=1),
+ *  with -c the pads past the GPIO ones, up to 10, are on a 74HC165 chain
+ *  instead of MCP23017 chips, with -s they are up to 8 MCP23S17 chips on
+ *  the SPI bus. With -a every run also has 2 MCP3008 analog pads whose
+ *  axes move between their ends and center, checked the same way. With -r
+ *  every read is recorded, and the last entry of each pad checked too.
+ *  With -l 4 pins of every MCP23017 and a GPIO drive LEDs that are turned
+ *  on and off as the inputs move, and their pins checked after every tick.
+ *  Then a few checks walk the driver through quarantine and the like, and
+ *  fail the bench as a mismatch does.
+ *
+ *  usage : mk_bench [ticks per run] [-g] [-c | -s] [-a] [-r] [-l] [-v]
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mk_sim.h"
+
+#define BENCH_MAX_PADS	(MK_SIM_MAX_GPIO_PADS + MK_SIM_MAX_MCP_PADS)
+#define BENCH_TICKS	200000
+#define BENCH_ADC_PADS	2
+#define BENCH_RECORD	1024
+
+// an analog axis at its min, center and max with the default calibration, the throttle center being its min
+static const int adc_raw[3] = { 0, 512, 1023 };
+static const int adc_stick[3] = { -32767, 0, 32767 };
+static const int adc_throttle_raw[3] = { 0, 0, 1023 };
+static const int adc_throttle[3] = { 0, 0, 32767 };
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t lcg(uint32_t *seed) {
+    *seed = *seed * 1664525u + 1013904223u;
+    return *seed >> 8;
+}
+
+/*
+ * CHECKS
+ *
+ * Once the runs are done, each check loads the driver on its own pads and
+ * walks it through what the runs never do. Whatever it finds wrong is
+ * printed and fails the bench as a mismatch would.
+ */
+#define CHECK_FAIL_MAX		3	/* MK_PAD_FAIL_MAX */
+#define CHECK_BACKOFF_MS	100	/* MK_QUARANTINE_MIN_MS */
+
+static const char *check_name;
+static unsigned long check_failures;
+
+static void expect(bool ok, const char *what) {
+    if (ok)
+        return;
+    printf("%s : %s\n", check_name, what);
+    check_failures++;
+}
+
+static bool check_load(int n_gpio, int n_mcp) {
+    if (mk_sim_setup(n_gpio, n_mcp)) {
+        expect(false, "driver setup failed");
+        return false;
+    }
+    return true;
+}
+
+// the I2C transfers and SPI frames of the next n ticks
+static unsigned long run_ticks(int n) {
+    unsigned long start = mk_sim_transfers();
+
+    while (n--)
+        mk_sim_tick();
+    return mk_sim_transfers() - start;
+}
+
+// an unplugged MCP23017 releases its buttons and costs one transfer per backoff until it is back
+static void check_quarantine(void) {
+    if (!check_load(0, 2))
+        return;
+    mk_sim_set_input(0, 0x30);
+    mk_sim_set_input(1, 0x50);
+    run_ticks(1);
+    expect(mk_sim_reported(0) == 0x30 && mk_sim_reported(1) == 0x50, "inputs not reported");
+
+    mk_sim_set_present(0, false);
+    run_ticks(CHECK_FAIL_MAX - 1);
+    expect(mk_sim_reported(0) == 0x30, "released before the failed reads add up");
+    expect(run_ticks(1) == 2, "failed read not retried");
+    expect(mk_sim_reported(0) == 0 && mk_sim_state_page()->pads[0].state == 0, "buttons held by a quarantined chip");
+    expect(mk_sim_reported(1) == 0x50, "the other chip lost its inputs");
+
+    expect(run_ticks(10) == 10, "quarantined chip read before its probe");
+    mk_sim_advance(CHECK_BACKOFF_MS);
+    expect(run_ticks(1) == 2, "quarantined chip not probed");
+    mk_sim_advance(CHECK_BACKOFF_MS);
+    expect(run_ticks(1) == 1, "backoff not doubled");
+    mk_sim_advance(CHECK_BACKOFF_MS);
+    expect(run_ticks(1) == 2, "quarantined chip not probed after its backoff");
+
+    mk_sim_set_present(0, true);
+    mk_sim_set_input(0, 0x30);
+    expect(run_ticks(1) == 1 && mk_sim_reported(0) == 0, "chip probed before its backoff");
+    mk_sim_advance(4 * CHECK_BACKOFF_MS);
+    run_ticks(1);
+    expect(mk_sim_reported(0) == 0x30, "chip back in not reported");
+    expect(run_ticks(10) == 20, "chip back in not read every tick");
+    mk_sim_teardown();
+}
+
+// a closed pad is not read nor reported, and the buses go quiet once all are closed
+static void check_open(void) {
+    int i;
+
+    if (!check_load(1, 4))
+        return;
+    expect(run_ticks(10) == 40, "open chips not read every tick");
+
+    mk_sim_set_open(0, false);
+    mk_sim_set_open(3, false);
+    mk_sim_set_input(0, 0x20);
+    mk_sim_set_input(3, 0x20);
+    mk_sim_set_input(4, 0x20);
+    expect(run_ticks(10) == 30, "closed chip read");
+    expect(mk_sim_reported(0) == 0 && mk_sim_reported(3) == 0, "closed pad reported");
+    expect(mk_sim_reported(4) == 0x20, "open pad not reported");
+
+    for (i = 1; i < 5; i++)
+        if (i != 3)
+            mk_sim_set_open(i, false);
+    expect(run_ticks(10) == 0, "bus traffic with every pad closed");
+
+    mk_sim_set_open(0, true);
+    mk_sim_set_open(3, true);
+    expect(run_ticks(1) == 1, "reopened chip not read");
+    expect(mk_sim_reported(0) == 0x20 && mk_sim_reported(3) == 0x20, "reopened pad not reported");
+    mk_sim_teardown();
+}
+
+// whether the pad reports want[0] on the next tick, want[1] on the one after and so on
+static bool reports(int pad, const uint32_t *want, int n) {
+    bool ok = true;
+
+    while (n--) {
+        mk_sim_tick();
+        ok &= mk_sim_reported(pad) == *want++;
+    }
+    return ok;
+}
+
+#define BTN_UP	(1u << 0)
+#define BTN_A	(1u << 6)
+#define BTN_B	(1u << 7)
+#define BTN_X	(1u << 10)
+
+// autofire pulses a held input on the tick clock, a macro plays its steps once per press
+static void check_timed(void) {
+    static const uint32_t autofire[] = { BTN_A, BTN_A, BTN_A, 0, 0, 0, BTN_A, BTN_A, BTN_A, 0 };
+    static const uint32_t macro[] = {
+        BTN_UP | BTN_A, BTN_UP | BTN_A, BTN_UP, BTN_UP | BTN_A | BTN_X, BTN_UP | BTN_A | BTN_X, BTN_UP | BTN_A | BTN_X, BTN_UP, BTN_UP
+    };
+    char buf[4096];
+    int len;
+
+    if (!check_load(0, 1))
+        return;
+    expect(mk_sim_attr_store(0, "autofire", "a 3") == 3 && mk_sim_attr_store(0, "autofire", "q 3") < 0, "autofire not set");
+    len = mk_sim_attr_show(0, "autofire", buf);
+    expect(len > 0 && !strncmp(buf, "a 3\n", len), "autofire not shown");
+    mk_sim_set_input(0, BTN_A);
+    expect(reports(0, autofire, 10), "autofire off its ticks");
+    mk_sim_set_input(0, 0);
+    expect(reports(0, autofire + 3, 1), "autofire outlives its input");
+    mk_sim_attr_store(0, "autofire", "a 0");
+    mk_sim_set_input(0, BTN_A);
+    expect(mk_sim_attr_show(0, "autofire", buf) == 0 && reports(0, autofire, 3) && reports(0, autofire, 3), "autofire not turned off");
+    mk_sim_set_input(0, 0);
+
+    expect(mk_sim_attr_store(0, "macro", "b a:2 none:1 a+x:3") > 0, "macro not set");
+    len = mk_sim_attr_show(0, "macro", buf);
+    expect(len > 0 && !strncmp(buf, "b a:2 none:1 a+x:3\n", len), "macro not shown");
+    mk_sim_set_input(0, BTN_UP | BTN_B);
+    expect(reports(0, macro, 8), "macro off its steps");
+    mk_sim_set_input(0, 0);
+    mk_sim_tick();
+    mk_sim_set_input(0, BTN_UP | BTN_B);
+    expect(reports(0, macro, 3), "macro not played again");
+    mk_sim_attr_store(0, "macro", "b");
+    expect(mk_sim_attr_show(0, "macro", buf) == 0 && reports(0, (uint32_t[]){ BTN_UP | BTN_B }, 1), "macro not cleared");
+    mk_sim_teardown();
+}
+
+static bool cfs_shows(struct config_item *item, const char *name, const char *value) {
+    char buf[4096];
+    int len = mk_sim_cfs_show(item, name, buf);
+
+    return len > 0 && len == (int)strlen(value) && !strncmp(buf, value, len);
+}
+
+// pads given at load are disabled, edited and enabled again, runtime pads made and removed, while the others keep being read
+static void check_configfs(void) {
+    struct config_item *item, *player, *clash;
+    struct mk_sim_file *replay;
+
+    if (!check_load(1, 2))
+        return;
+    expect(!mk_sim_cfs_lookup("input0") == mk_sim_gpiod, "GPIO pad given at load not in configfs");
+    item = mk_sim_cfs_lookup("input1");
+    if (!item) {
+        expect(false, "MCP23017 given at load not in configfs");
+        mk_sim_teardown();
+        return;
+    }
+    expect(cfs_shows(item, "type", "3\n") && cfs_shows(item, "bus", "0\n") && cfs_shows(item, "address", "0x20\n") &&
+           cfs_shows(item, "int_gpio", "-1\n") && cfs_shows(item, "enable", "1\n"), "pad given at load shown wrong");
+    expect(mk_sim_cfs_store(item, "address", "0x21") < 0, "enabled pad edited");
+
+    mk_sim_set_input(1, 0x10);
+    expect(mk_sim_cfs_store(item, "enable", "0") > 0 && mk_sim_pad_count() == 2, "pad given at load not disabled");
+    expect(run_ticks(10) == 10, "disabled chip still read");
+    expect(mk_sim_cfs_store(item, "address", "0x20") > 0 && mk_sim_cfs_store(item, "enable", "1") > 0 && mk_sim_pad_count() == 3,
+           "pad given at load not enabled again");
+    mk_sim_set_open(2, true);
+    run_ticks(1);
+    expect(mk_sim_reported(2) == 0x10 && run_ticks(10) == 20, "pad enabled again not read");
+
+    player = mk_sim_cfs_mkdir("player");
+    expect(player && mk_sim_cfs_store(player, "bus", "0") > 0 && mk_sim_cfs_store(player, "address", "0x21") > 0 &&
+           mk_sim_cfs_store(player, "type", "3") > 0 && mk_sim_cfs_store(player, "enable", "1") > 0 && mk_sim_pad_count() == 4,
+           "runtime pad not added");
+    if (mk_sim_pad_count() == 4) {
+        mk_sim_set_present(3, true);
+        mk_sim_set_open(3, true);
+        mk_sim_set_input(3, 0x40);
+        run_ticks(1);
+        expect(mk_sim_reported(3) == 0x40 && run_ticks(10) == 30, "runtime pad not read");
+    }
+
+    // the pins of the GPIO pad given at load
+    clash = mk_sim_cfs_mkdir("clash");
+    expect(clash && mk_sim_cfs_store(clash, "type", "1") > 0 && mk_sim_cfs_store(clash, "enable", "1") < 0 && mk_sim_pad_count() == 4,
+           "GPIO pad on pins in use added");
+    if (clash)
+        mk_sim_cfs_rmdir(clash);
+
+    // removed while its replay is being written, which is dropped on close
+    replay = mk_sim_pad_count() == 4 ? mk_sim_replay_open(3) : NULL;
+    expect(!replay || mk_sim_replay_write(replay, "0 0001 0001\n") == 0, "replay of a runtime pad not written");
+    if (player)
+        mk_sim_cfs_rmdir(player);
+    if (replay)
+        mk_sim_replay_close(replay);
+    expect(mk_sim_pad_count() == 3 && run_ticks(10) == 20, "runtime pad not removed");
+    mk_sim_teardown();
+}
+
+// a replay runs in place of the switches, on through a chip that stops answering, then is dropped
+static void check_replay(void) {
+    char buf[64];
+
+    if (!check_load(0, 2))
+        return;
+    mk_sim_set_input(0, 0x30);
+    expect(mk_sim_replay(0, "0 0001 0001\n50000000 0040 0040\n150000000 0008 0008\n") == 0, "replay not loaded");
+    mk_sim_tick();
+    mk_sim_replay_status(0, buf, sizeof(buf));
+    expect(mk_sim_reported(0) == 0x01 && !strcmp(buf, "1 3\n"), "first entry not replayed");
+    run_ticks(5);
+    expect(mk_sim_reported(0) == 0x01, "entry replayed before its time");
+    mk_sim_advance(100);
+    mk_sim_tick();
+    expect(mk_sim_reported(0) == 0x40, "second entry not replayed");
+
+    mk_sim_set_present(0, false);
+    run_ticks(CHECK_FAIL_MAX);
+    expect(mk_sim_reported(0) == 0x40, "replay stopped by failed reads");
+    mk_sim_advance(CHECK_BACKOFF_MS);
+    mk_sim_tick();
+    mk_sim_replay_status(0, buf, sizeof(buf));
+    expect(mk_sim_reported(0) == 0x08, "replay stopped by quarantine");
+    expect(!strcmp(buf, "0 0\n"), "replay kept past its end");
+    run_ticks(5);
+    expect(mk_sim_reported(0) == 0x08, "replay went on past its end");
+
+    mk_sim_set_present(0, true);
+    mk_sim_advance(2 * CHECK_BACKOFF_MS);
+    mk_sim_tick();
+    expect(mk_sim_reported(0) == 0x30, "switches not back after the replay");
+    expect(mk_sim_replay(0, "0 0002 0002\n") == 0 && mk_sim_replay(0, "") == 0, "replay not stopped");
+    mk_sim_tick();
+    expect(mk_sim_reported(0) == 0x30, "stopped replay still played");
+    mk_sim_teardown();
+}
+
+// a closed chip with LEDs costs one write per change and no read, GPIO LEDs light at once without the timer
+static void check_leds(void) {
+    int i;
+
+    mk_sim_leds = true;
+    if (!check_load(1, 2))
+        goto out;
+    for (i = 0; i < 3; i++)
+        mk_sim_set_open(i, false);
+    expect(run_ticks(10) == 0, "closed chips with LEDs read");
+    mk_sim_led_set("mk_arcade_pad1::gpb4", true);
+    expect(run_ticks(10) == 1 && mk_sim_led_pins(1) == 0x1000, "LED change of a closed chip not written alone");
+    expect(mk_sim_reported(1) == 0, "closed chip reported");
+    mk_sim_set_open(1, true);
+    mk_sim_set_input(1, 0x30);
+    expect(run_ticks(10) == 10 && mk_sim_reported(1) == 0x30, "chip opened again not read");
+    mk_sim_teardown();
+
+    if (!check_load(1, 0))
+        goto out;
+    mk_sim_set_open(0, false);
+    expect(!mk_sim_timer_active(), "timer kept running for the GPIO LEDs");
+    mk_sim_led_set("mk_arcade::gpio31", true);
+    expect(mk_sim_gpio_leds() == 1u << MK_SIM_LED_GPIO, "GPIO LED not lit at once");
+    mk_sim_led_set("mk_arcade::gpio31", false);
+    expect(mk_sim_gpio_leds() == 0, "GPIO LED not put out at once");
+    mk_sim_teardown();
+out:
+    mk_sim_leds = false;
+}
+
+// a calibration out of the ADC range is refused, a valid one scales the axis
+static void check_calibration(void) {
+    char buf[4096];
+
+    mk_sim_adc_pads = 1;
+    if (!check_load(0, 0))
+        goto out;
+    expect(mk_sim_attr_store(0, "calibration", "x 65536 512 1023 0\n") < 0, "min past the u16 range accepted");
+    expect(mk_sim_attr_store(0, "calibration", "x 1024 512 1023 0\n") < 0, "min past the ADC range accepted");
+    expect(mk_sim_attr_store(0, "calibration", "throttle 900 0 800 0\n") < 0, "min past max accepted");
+    expect(mk_sim_attr_store(0, "calibration", "x 100 500 900 10\n") > 0, "valid calibration refused");
+    expect(mk_sim_attr_show(0, "calibration", buf) > 0 && !strncmp(buf, "x 100 500 900 10\n", 17), "calibration not shown");
+    mk_sim_set_adc(0, 100);
+    mk_sim_tick();
+    expect(mk_sim_reported_abs(0, 0) == -32767, "calibrated min not at the end of the axis");
+    mk_sim_teardown();
+out:
+    mk_sim_adc_pads = 0;
+}
+
+static void run_check(const char *name, void (*check)(void)) {
+    unsigned long failures = check_failures;
+
+    check_name = name;
+    check();
+    printf("check %-12s %s\n", name, check_failures == failures ? "ok" : "failed");
+}
+
+int main(int argc, char **argv) {
+    long ticks = BENCH_TICKS;
+    unsigned long mismatches = 0;
+    uint32_t input[BENCH_MAX_PADS];
+    uint16_t leds[BENCH_MAX_PADS];
+    uint32_t gpio_leds;
+    int adc_pos[BENCH_ADC_PADS][3];
+    uint32_t seed = 1;
+    int max_pads, n, i, p;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-v"))
+            mk_sim_verbose = true;
+        else if (!strcmp(argv[i], "-g"))
+            mk_sim_gpiod = true;
+        else if (!strcmp(argv[i], "-c"))
+            mk_sim_hc165 = true;
+        else if (!strcmp(argv[i], "-s"))
+            mk_sim_spi = true;
+        else if (!strcmp(argv[i], "-a"))
+            mk_sim_adc_pads = BENCH_ADC_PADS;
+        else if (!strcmp(argv[i], "-r"))
+            mk_sim_record = BENCH_RECORD;
+        else if (!strcmp(argv[i], "-l"))
+            mk_sim_leds = true;
+        else
+            ticks = atol(argv[i]);
+    }
+    if (ticks <= 0 || (mk_sim_hc165 && mk_sim_spi)) {
+        fprintf(stderr, "usage : %s [ticks per run] [-g] [-c | -s] [-a] [-r] [-l] [-v]\n", argv[0]);
+        return 2;
+    }
+
+    printf("%4s %4s %4s %10s %12s %10s\n", "pads", "gpio", mk_sim_hc165 ? "hc165" : mk_sim_spi ? "spi" : "mcp", "ns/tick", "events/s", "mismatch");
+
+    max_pads = MK_SIM_MAX_GPIO_PADS + mk_sim_max_mcp_pads();
+    for (n = 1; n <= max_pads; n++) {
+        int n_gpio = n < MK_SIM_MAX_GPIO_PADS ? n : MK_SIM_MAX_GPIO_PADS;
+        unsigned long run_mismatches = 0;
+        unsigned long events;
+        uint64_t start, elapsed;
+        long t;
+
+        if (mk_sim_setup(n_gpio, n - n_gpio)) {
+            fprintf(stderr, "driver setup failed for %d pads\n", n);
+            return 1;
+        }
+        memset(input, 0, sizeof(input));
+        memset(leds, 0, sizeof(leds));
+        gpio_leds = 0;
+        memset(adc_pos, 0, sizeof(adc_pos));
+        for (i = 0; i < mk_sim_adc_pads * 3; i++)
+            mk_sim_set_adc(i, adc_raw[0]);
+
+        // the analog pads come last and have no slot in the state page
+        if (mk_sim_state_page()->hdr.n_pads != n)
+            run_mismatches++;
+
+        events = mk_sim_events();
+        start = now_ns();
+        for (t = 0; t < ticks; t++) {
+            // every pad moves one input every 8 ticks
+            for (p = 0; p < n; p++) {
+                if (((t + p) & 7) == 0) {
+                    input[p] ^= 1u << (lcg(&seed) % mk_sim_pad_bits(p));
+                    // a stick is never up and down, or left and right, at once
+                    if ((input[p] & 0x3) == 0x3 || (input[p] & 0xc) == 0xc)
+                        input[p] &= ~0xfu;
+                    // an LED pin is no input
+                    input[p] &= ~(uint32_t)mk_sim_pad_leds(p);
+                    mk_sim_set_input(p, input[p]);
+                }
+                // and every pad with LEDs switches one, in between
+                if (mk_sim_pad_leds(p) && ((t + p) & 7) == 2) {
+                    char name[32];
+
+                    i = 12 + lcg(&seed) % 4;
+                    leds[p] ^= 1u << i;
+                    snprintf(name, sizeof(name), "mk_arcade_pad%d::gpb%d", p, i - 8);
+                    mk_sim_led_set(name, leds[p] & (1u << i));
+                }
+            }
+            if (mk_sim_leds && (t & 15) == 6) {
+                gpio_leds ^= 1u << MK_SIM_LED_GPIO;
+                mk_sim_led_set("mk_arcade::gpio31", gpio_leds);
+            }
+            // and every analog pad one axis, in between
+            for (p = 0; p < mk_sim_adc_pads; p++) {
+                if (((t + p) & 7) == 4) {
+                    i = lcg(&seed) % 3;
+                    adc_pos[p][i] = lcg(&seed) % 3;
+                    mk_sim_set_adc(p * 3 + i, (i == 2 ? adc_throttle_raw : adc_raw)[adc_pos[p][i]]);
+                }
+            }
+            mk_sim_tick();
+            for (p = 0; p < n; p++) {
+                const struct mk_state_pad *sp = &mk_sim_state_page()->pads[p];
+                uint32_t raw, state;
+
+                if (mk_sim_reported(p) != input[p] || sp->state != input[p] || (sp->seq & 1))
+                    run_mismatches++;
+                if (mk_sim_record && (mk_sim_recorded(p, &raw, &state) != t + 1 || raw != input[p] || state != input[p]))
+                    run_mismatches++;
+                if (mk_sim_pad_leds(p) && mk_sim_led_pins(p) != leds[p])
+                    run_mismatches++;
+            }
+            if (mk_sim_leds && mk_sim_gpio_leds() != gpio_leds)
+                run_mismatches++;
+            for (p = 0; p < mk_sim_adc_pads; p++)
+                for (i = 0; i < 3; i++)
+                    if (mk_sim_reported_abs(n + p, i) != (i == 2 ? adc_throttle : adc_stick)[adc_pos[p][i]])
+                        run_mismatches++;
+        }
+        elapsed = now_ns() - start;
+        events = mk_sim_events() - events;
+
+        printf("%4d %4d %4d %10.1f %12.0f %10lu\n", n, n_gpio, n - n_gpio,
+               (double)elapsed / ticks, events * 1e9 / elapsed, run_mismatches);
+
+        mismatches += run_mismatches;
+        mk_sim_teardown();
+    }
+
+    // the checks pick their pads themselves
+    mk_sim_hc165 = mk_sim_spi = mk_sim_leds = false;
+    mk_sim_adc_pads = 0;
+    mk_sim_record = 0;
+    printf("\n");
+    run_check("quarantine", check_quarantine);
+    run_check("open", check_open);
+    run_check("timed", check_timed);
+    run_check("configfs", check_configfs);
+    run_check("replay", check_replay);
+    run_check("leds", check_leds);
+    run_check("calibration", check_calibration);
+
+    return mismatches || check_failures ? 1 : 0;
+}
@@ -0,0 +1,1026 @@
+/*
+ *  Arcade Joystick Driver for RaspberryPi - userspace simulator
+ *
+ *  The driver is built in this translation unit, on top of the kernel shim
+ *  in include/, with its registers backed by the models below :
+ *   - GPIO : a level register driven by the simulated switches, every other
+ *     register is plain memory
+ *   - BSC : a controller that runs each transfer as soon as it is started,
+ *     with its FIFO, DONE/ERR/RXD status bits and write-1-to-clear status
+ *   - MCP23017 : register file, address pointer with sequential and byte
+ *     (IOCON.SEQOP) modes, GPIOA/GPIOB reading the simulated switches on
+ *     inputs and the output latches on outputs, and writing those latches
+ *   - gpiolib : a chip labelled "mk-sim" whose lines are the pins of the
+ *     GPIO model, for the gpiod pads
+ *   - 74HC165 : a chain on GPIO 28 (SH/LD), 29 (CLK) and 30 (QH), loaded
+ *     while SH/LD is low and shifted on the rising edges of CLK
+ *   - SPI : spi0.0 and spi0.1, whose queued messages run at the end of the
+ *     tick, with MCP23S17 chips on spi0.0 : the MCP23017 register file
+ *     behind an opcode that carries the hardware address (IOCON.HAEN), and
+ *     an MCP3008 on spi0.1, converting the channel values set by the test
+ *   - LED class : a list of the registered LEDs, set by name
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include "../mk_arcade_joystick_rpi.c"
+
+#include "mk_sim.h"
+
+bool mk_sim_verbose;
+s64 mk_sim_clock_skew;
+bool mk_sim_gpiod;
+bool mk_sim_hc165;
+bool mk_sim_spi;
+int mk_sim_adc_pads;
+unsigned int mk_sim_record;
+bool mk_sim_leds;
+
+/* GPIO MODEL */
+#define SIM_GPIO_REGS	(0xB0 / 4)
+
+static unsigned sim_gpio_regs[SIM_GPIO_REGS];
+static u32 sim_gpio_low;	// pins pulled to ground by a pressed switch
+static u32 sim_gpio_out;	// levels driven by GPSET0/GPCLR0
+
+/* 74HC165 CHAIN MODEL */
+#define SIM_HC165_LOAD	28
+#define SIM_HC165_CLOCK	29
+#define SIM_HC165_DATA	30
+
+static u16 sim_hc165_low[MK_SIM_MAX_HC165_PADS];		// inputs pulled to ground, per pad
+static u16 sim_hc165_latch[MK_SIM_MAX_HC165_PADS];	// inputs loaded in the chain
+static int sim_hc165_pos;	// chain bit on QH
+
+static void sim_hc165_pins(u32 old, u32 out) {
+    if (!(out & BIT(SIM_HC165_LOAD))) {
+        memcpy(sim_hc165_latch, sim_hc165_low, sizeof(sim_hc165_latch));
+        sim_hc165_pos = 0;
+    } else if (!(old & BIT(SIM_HC165_CLOCK)) && (out & BIT(SIM_HC165_CLOCK))) {
+        sim_hc165_pos++;
+    }
+}
+
+// past the end of the chain QH shows the serial input of the last chip, tied high
+static bool sim_hc165_qh_low(void) {
+    int pad = sim_hc165_pos / MK_HC165_BITS;
+
+    return pad < MK_SIM_MAX_HC165_PADS && (sim_hc165_latch[pad] & BIT(sim_hc165_pos % MK_HC165_BITS));
+}
+
+static u32 sim_gpio_read(int reg) {
+    u32 lev;
+
+    if (reg != GPIO_GPLEV0)
+        return sim_gpio_regs[reg];
+
+    lev = ~sim_gpio_low;
+    if (mk_sim_hc165 && sim_hc165_qh_low())
+        lev &= ~BIT(SIM_HC165_DATA);
+    return lev;
+}
+
+static void sim_gpio_write(int reg, u32 val) {
+    u32 old = sim_gpio_out;
+
+    if (reg == GPIO_GPSET0)
+        sim_gpio_out |= val;
+    else if (reg == GPIO_GPCLR0)
+        sim_gpio_out &= ~val;
+    else if (reg != GPIO_GPLEV0)
+        sim_gpio_regs[reg] = val;
+    if (mk_sim_hc165)
+        sim_hc165_pins(old, sim_gpio_out);
+}
+
+/* MCP23017 MODEL */
+#define SIM_MCP_REGS	0x16
+
+struct sim_mcp {
+    bool present;
+    u8 regs[SIM_MCP_REGS];
+    u8 ptr;
+    u16 low;		// GPIOB:GPIOA pins pulled to ground by a pressed switch
+};
+
+static void sim_mcp_reset(struct sim_mcp *c) {
+    memset(c, 0, sizeof(*c));
+    c->present = true;
+    c->regs[MPC23017_GPIOA_MODE] = 0xff;
+    c->regs[MPC23017_GPIOB_MODE] = 0xff;
+}
+
+static void sim_mcp_advance(struct sim_mcp *c) {
+    if (c->regs[MPC23017_IOCON] & MPC23017_IOCON_SEQOP)
+        c->ptr ^= 1;		// byte mode with BANK=0 : toggle within the A/B pair
+    else
+        c->ptr = (c->ptr + 1) % SIM_MCP_REGS;
+}
+
+// GPIOB:GPIOA levels, the outputs at their latch
+static u16 sim_mcp_pins(struct sim_mcp *c) {
+    u16 dir = c->regs[MPC23017_GPIOA_MODE] | (c->regs[MPC23017_GPIOB_MODE] << 8);
+    u16 olat = c->regs[MPC23017_OLATA] | (c->regs[MPC23017_OLATA + 1] << 8);
+
+    return (~c->low & dir) | (olat & ~dir);
+}
+
+static u8 sim_mcp_read(struct sim_mcp *c) {
+    u8 val;
+
+    if (c->ptr == MPC23017_GPIOA_READ)
+        val = sim_mcp_pins(c) & 0xff;
+    else if (c->ptr == MPC23017_GPIOB_READ)
+        val = sim_mcp_pins(c) >> 8;
+    else
+        val = c->regs[c->ptr];
+    sim_mcp_advance(c);
+    return val;
+}
+
+static void sim_mcp_write(struct sim_mcp *c, u8 val) {
+    // a write to GPIOA/GPIOB goes to the output latch
+    if (c->ptr == MPC23017_GPIOA_READ || c->ptr == MPC23017_GPIOB_READ)
+        c->regs[c->ptr + 2] = val;
+    else
+        c->regs[c->ptr] = val;
+    // IOCON is mirrored at 0x0a and 0x0b
+    if (c->ptr == MPC23017_IOCON || c->ptr == MPC23017_IOCON + 1)
+        c->regs[MPC23017_IOCON] = c->regs[MPC23017_IOCON + 1] = val;
+    sim_mcp_advance(c);
+}
+
+/* BSC MODEL */
+#define SIM_BSC_FIFO	16
+
+struct sim_bsc {
+    unsigned regs[0x20 / 4];
+    u8 fifo[SIM_BSC_FIFO];
+    int fifo_len;
+    int fifo_pos;
+    u32 status;
+    struct sim_mcp chips[8];	// 0x20..0x27
+};
+
+static struct sim_bsc sim_bsc[2];
+static unsigned long sim_transfers;
+
+static struct sim_mcp *sim_bsc_chip(struct sim_bsc *b) {
+    unsigned addr = b->regs[BSC_A];
+
+    if (addr < 0x20 || addr > 0x27 || !b->chips[addr - 0x20].present)
+        return NULL;
+    return &b->chips[addr - 0x20];
+}
+
+static void sim_bsc_transfer(struct sim_bsc *b) {
+    struct sim_mcp *chip = sim_bsc_chip(b);
+    unsigned len = b->regs[BSC_DLEN];
+    unsigned i;
+
+    sim_transfers++;
+    if (!chip) {
+        b->status |= BSC_S_ERR | BSC_S_DONE;
+        return;
+    }
+
+    if (b->regs[BSC_C] & BSC_C_READ) {
+        b->fifo_len = b->fifo_pos = 0;
+        for (i = 0; i < len && i < SIM_BSC_FIFO; i++)
+            b->fifo[b->fifo_len++] = sim_mcp_read(chip);
+    } else {
+        // first byte sets the register address, the rest are written from there
+        for (i = 0; i < len && b->fifo_pos < b->fifo_len; i++) {
+            if (i == 0)
+                chip->ptr = b->fifo[b->fifo_pos++] % SIM_MCP_REGS;
+            else
+                sim_mcp_write(chip, b->fifo[b->fifo_pos++]);
+        }
+        b->fifo_len = b->fifo_pos = 0;
+    }
+    b->status |= BSC_S_DONE;
+}
+
+static u32 sim_bsc_read(struct sim_bsc *b, int reg) {
+    u32 s;
+
+    switch (reg) {
+    case BSC_S:
+        s = b->status;
+        if ((b->regs[BSC_C] & BSC_C_READ) && b->fifo_pos < b->fifo_len)
+            s |= BSC_S_RXD;
+        if (b->fifo_len - b->fifo_pos < SIM_BSC_FIFO)
+            s |= BSC_S_TXD;
+        if (b->fifo_pos == b->fifo_len)
+            s |= BSC_S_TXE;
+        return s;
+    case BSC_FIFO:
+        return b->fifo_pos < b->fifo_len ? b->fifo[b->fifo_pos++] : 0;
+    default:
+        return reg < ARRAY_SIZE(b->regs) ? b->regs[reg] : 0;
+    }
+}
+
+static void sim_bsc_write(struct sim_bsc *b, int reg, u32 val) {
+    switch (reg) {
+    case BSC_S:
+        b->status &= ~(val & (BSC_S_CLKT | BSC_S_ERR | BSC_S_DONE));
+        break;
+    case BSC_FIFO:
+        if (b->fifo_len < SIM_BSC_FIFO)
+            b->fifo[b->fifo_len++] = val;
+        break;
+    case BSC_C:
+        b->regs[BSC_C] = val;
+        if (val & BSC_C_CLEAR)
+            b->fifo_len = b->fifo_pos = 0;
+        if (val & BSC_C_ST)
+            sim_bsc_transfer(b);
+        break;
+    default:
+        if (reg < ARRAY_SIZE(b->regs))
+            b->regs[reg] = val;
+    }
+}
+
+/* MCP23S17 MODEL */
+static struct sim_mcp sim_spi_chips[MK_SIM_MAX_SPI_PADS];	// by hardware address
+
+// with HAEN clear a chip ignores the address in the opcode, except A2 (errata)
+static bool sim_spi_selected(int addr, u8 opcode) {
+    struct sim_mcp *c = &sim_spi_chips[addr];
+    int op_addr = (opcode >> 1) & 7;
+
+    if (!c->present)
+        return false;
+    if (c->regs[MPC23017_IOCON] & MPC23017_IOCON_HAEN)
+        return addr == op_addr;
+    return (addr & 4) == (op_addr & 4);
+}
+
+// one chip select frame : opcode, register address, then data from there
+static void sim_spi_frame(const u8 *tx, u8 *rx, unsigned len) {
+    bool driven = false;
+    unsigned i, j;
+
+    memset(rx, 0xff, len);	// nobody drives MISO
+    if (len < 2 || (tx[0] & 0xf0) != MCP23S17_OPCODE)
+        return;
+    for (i = 0; i < MK_SIM_MAX_SPI_PADS; i++) {
+        struct sim_mcp *c = &sim_spi_chips[i];
+
+        if (!sim_spi_selected(i, tx[0]))
+            continue;
+        c->ptr = tx[1] % SIM_MCP_REGS;
+        for (j = 2; j < len; j++) {
+            if (tx[0] & MCP23S17_READ)
+                rx[j] &= sim_mcp_read(c);	// chips answering together pull MISO low
+            else
+                sim_mcp_write(c, tx[j]);
+        }
+        driven = true;
+    }
+    if (driven)
+        sim_transfers++;
+}
+
+/* MCP3008 MODEL */
+static u16 sim_adc_values[MCP3008_CHANNELS];
+
+// start bit, single ended and channel bits, then the null bit and B9..B0 at the end of the frame
+static void sim_adc_frame(const u8 *tx, u8 *rx, unsigned len) {
+    u16 v;
+
+    memset(rx, 0xff, len);
+    if (len != MK_ADC_XFER_LEN || tx[0] != MCP3008_START || !(tx[1] & MCP3008_SINGLE))
+        return;
+    v = sim_adc_values[(tx[1] >> 4) & 7];
+    rx[1] = 0xf8 | v >> 8;
+    rx[2] = v & 0xff;
+    sim_transfers++;
+}
+
+/* SPI BUS MODEL */
+struct sim_spi_dev {
+    struct spi_device spi;
+    void (*frame)(const u8 *tx, u8 *rx, unsigned len);
+    struct spi_message *queued;
+};
+
+static struct sim_spi_dev sim_spi[] = {
+    { .spi = { .dev = { .name = "spi0.0" } }, .frame = sim_spi_frame },
+    { .spi = { .dev = { .name = "spi0.1" } }, .frame = sim_adc_frame },
+};
+struct bus_type spi_bus_type = { .name = "spi" };
+
+struct device *bus_find_device_by_name(struct bus_type *bus, struct device *start, const char *name) {
+    int i;
+
+    for (i = 0; bus == &spi_bus_type && i < ARRAY_SIZE(sim_spi); i++)
+        if (!strcmp(name, sim_spi[i].spi.dev.name))
+            return &sim_spi[i].spi.dev;
+    return NULL;
+}
+
+int spi_async(struct spi_device *spi, struct spi_message *message) {
+    struct sim_spi_dev *d = container_of(spi, struct sim_spi_dev, spi);
+
+    if (d->queued)
+        return -EBUSY;
+    d->queued = message;
+    return 0;
+}
+
+int spi_write_then_read(struct spi_device *spi, const void *txbuf, unsigned n_tx, void *rxbuf, unsigned n_rx) {
+    struct sim_spi_dev *d = container_of(spi, struct sim_spi_dev, spi);
+    u8 tx[32] = { 0 }, rx[32];
+
+    if (n_tx + n_rx > sizeof(tx))
+        return -EINVAL;
+    memcpy(tx, txbuf, n_tx);
+    d->frame(tx, rx, n_tx + n_rx);
+    memcpy(rxbuf, rx + n_tx, n_rx);
+    return 0;
+}
+
+// every transfer of the driver ends with a chip select change
+static void sim_spi_run(void) {
+    struct spi_message *m;
+    struct spi_transfer *x;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(sim_spi); i++) {
+        if (!(m = sim_spi[i].queued))
+            continue;
+        sim_spi[i].queued = NULL;
+        for (x = m->transfers; x; x = x->next)
+            sim_spi[i].frame(x->tx_buf, x->rx_buf, x->len);
+        m->status = 0;
+        m->complete(m->context);
+    }
+}
+
+/* LED CLASS MODEL */
+#define SIM_LEDS	128
+
+static struct led_classdev *sim_leds[SIM_LEDS];
+
+int led_classdev_register(struct device *parent, struct led_classdev *led_cdev) {
+    int i;
+
+    for (i = 0; i < SIM_LEDS; i++) {
+        if (!sim_leds[i]) {
+            sim_leds[i] = led_cdev;
+            return 0;
+        }
+    }
+    return -ENOMEM;
+}
+
+// as the kernel does, the LED is turned off on its way out
+void led_classdev_unregister(struct led_classdev *led_cdev) {
+    int i;
+
+    for (i = 0; i < SIM_LEDS; i++)
+        if (sim_leds[i] == led_cdev)
+            sim_leds[i] = NULL;
+    led_cdev->brightness_set(led_cdev, LED_OFF);
+}
+
+/* WORKQUEUE MODEL : a list of the queued works, oldest first */
+static struct work_struct *sim_works;
+
+bool schedule_work(struct work_struct *w) {
+    struct work_struct **p;
+
+    if (w->pending)
+        return false;
+    for (p = &sim_works; *p; p = &(*p)->next)
+        ;
+    w->next = NULL;
+    w->pending = true;
+    *p = w;
+    return true;
+}
+
+bool cancel_work_sync(struct work_struct *w) {
+    struct work_struct **p;
+
+    for (p = &sim_works; *p; p = &(*p)->next) {
+        if (*p == w) {
+            *p = w->next;
+            w->pending = false;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void sim_works_run(void) {
+    struct work_struct *w;
+
+    while ((w = sim_works)) {
+        sim_works = w->next;
+        w->pending = false;
+        w->func(w);
+    }
+}
+
+/* DEBUGFS MODEL : the tree by name, a removed entry kept until the teardown */
+struct dentry {
+    char name[32];
+    struct dentry *d_parent;
+    struct dentry *next;    // all of them, newest first
+    bool removed;
+};
+
+static struct dentry *sim_dentries;
+
+static struct dentry *sim_dentry_add(const char *name, struct dentry *parent) {
+    struct dentry *d = calloc(1, sizeof(*d));
+
+    if (!d)
+        return NULL;
+    snprintf(d->name, sizeof(d->name), "%s", name);
+    d->d_parent = parent;
+    d->next = sim_dentries;
+    sim_dentries = d;
+    return d;
+}
+
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent) {
+    return sim_dentry_add(name, parent);
+}
+
+struct dentry *debugfs_create_file(const char *name, umode_t mode, struct dentry *parent, void *data,
+                                   const struct file_operations *fops) {
+    return sim_dentry_add(name, parent);
+}
+
+void debugfs_remove_recursive(struct dentry *d) {
+    if (d)
+        d->removed = true;
+}
+
+// a file under a removed directory is gone too
+int debugfs_file_get(struct dentry *d) {
+    for (; d; d = d->d_parent)
+        if (d->removed)
+            return -EIO;
+    return 0;
+}
+
+static struct dentry *sim_dentry_find(struct dentry *parent, const char *name) {
+    struct dentry *d;
+
+    for (d = sim_dentries; d; d = d->next)
+        if (d->d_parent == parent && !d->removed && !strcmp(d->name, name))
+            return d;
+    return NULL;
+}
+
+static void sim_dentries_free(void) {
+    struct dentry *d;
+
+    while ((d = sim_dentries)) {
+        sim_dentries = d->next;
+        free(d);
+    }
+}
+
+/* REGISTER BACKEND */
+void *ioremap(unsigned long phys, unsigned long size) {
+    if (phys == GPIO_BASE)
+        return sim_gpio_regs;
+    if (phys == BSC0_BASE)
+        return sim_bsc[0].regs;
+    if (phys == BSC1_BASE)
+        return sim_bsc[1].regs;
+    return NULL;
+}
+
+void iounmap(volatile void *addr) {
+}
+
+u32 mk_readl(volatile unsigned *base, int reg) {
+    if (base == sim_gpio_regs)
+        return sim_gpio_read(reg);
+    if (base == sim_bsc[0].regs)
+        return sim_bsc_read(&sim_bsc[0], reg);
+    return sim_bsc_read(&sim_bsc[1], reg);
+}
+
+void mk_writel(volatile unsigned *base, int reg, u32 val) {
+    if (base == sim_gpio_regs)
+        sim_gpio_write(reg, val);
+    else if (base == sim_bsc[0].regs)
+        sim_bsc_write(&sim_bsc[0], reg, val);
+    else
+        sim_bsc_write(&sim_bsc[1], reg, val);
+}
+
+/* GPIOLIB MODEL */
+#define SIM_GPIOD_CHIP		"mk-sim"
+#define SIM_GPIOD_TABLES	16
+
+struct gpio_desc {
+    u16 hwnum;
+    bool active_low;
+};
+
+static struct gpiod_lookup_table *sim_gpiod_tables[SIM_GPIOD_TABLES];
+
+struct platform_device *platform_device_register_simple(const char *name, int id, const void *res, unsigned int num) {
+    struct platform_device *pdev = calloc(1, sizeof(*pdev));
+
+    if (!pdev)
+        return ERR_PTR(-ENOMEM);
+    snprintf(pdev->name, sizeof(pdev->name), "%s.%d", name, id);
+    pdev->dev.name = pdev->name;
+    return pdev;
+}
+
+void platform_device_unregister(struct platform_device *pdev) {
+    free(pdev);
+}
+
+void gpiod_add_lookup_table(struct gpiod_lookup_table *table) {
+    int i;
+
+    for (i = 0; i < SIM_GPIOD_TABLES; i++) {
+        if (!sim_gpiod_tables[i]) {
+            sim_gpiod_tables[i] = table;
+            return;
+        }
+    }
+}
+
+void gpiod_remove_lookup_table(struct gpiod_lookup_table *table) {
+    int i;
+
+    for (i = 0; i < SIM_GPIOD_TABLES; i++)
+        if (sim_gpiod_tables[i] == table)
+            sim_gpiod_tables[i] = NULL;
+}
+
+struct gpio_descs *gpiod_get_array(struct device *dev, const char *con_id, enum gpiod_flags flags) {
+    struct gpiod_lookup_table *table = NULL;
+    struct gpio_descs *descs;
+    unsigned int i, n;
+
+    for (i = 0; i < SIM_GPIOD_TABLES; i++)
+        if (sim_gpiod_tables[i] && !strcmp(sim_gpiod_tables[i]->dev_id, dev_name(dev)))
+            table = sim_gpiod_tables[i];
+    if (!table)
+        return ERR_PTR(-ENOENT);
+
+    for (n = 0; table->table[n].key; n++) {
+        if (strcmp(table->table[n].key, SIM_GPIOD_CHIP) || table->table[n].chip_hwnum > 31)
+            return ERR_PTR(-ENODEV);
+    }
+
+    descs = calloc(1, sizeof(*descs) + n * (sizeof(descs->desc[0]) + sizeof(struct gpio_desc)));
+    if (!descs)
+        return ERR_PTR(-ENOMEM);
+    descs->ndescs = n;
+    for (i = 0; i < n; i++) {
+        struct gpio_desc *d = (struct gpio_desc *)&descs->desc[n] + i;
+
+        d->hwnum = table->table[i].chip_hwnum;
+        d->active_low = table->table[i].flags & GPIO_ACTIVE_LOW;
+        descs->desc[table->table[i].idx] = d;
+    }
+    return descs;
+}
+
+void gpiod_put_array(struct gpio_descs *descs) {
+    free(descs);
+}
+
+int gpiod_get_array_value(unsigned int n, struct gpio_desc **desc, struct gpio_array *info, unsigned long *values) {
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        bool high = !(sim_gpio_low & BIT(desc[i]->hwnum));
+
+        if (high != desc[i]->active_low)
+            set_bit(i, values);
+        else
+            clear_bit(i, values);
+    }
+    return 0;
+}
+
+int gpiod_get_array_value_cansleep(unsigned int n, struct gpio_desc **desc, struct gpio_array *info, unsigned long *values) {
+    return gpiod_get_array_value(n, desc, info, values);
+}
+
+int gpiod_cansleep(const struct gpio_desc *desc) {
+    return 0;
+}
+
+/* SIMULATOR API */
+int mk_sim_setup(int n_gpio, int n_mcp) {
+    int i, err;
+
+    if (n_gpio > MK_SIM_MAX_GPIO_PADS || n_mcp > mk_sim_max_mcp_pads() || mk_sim_adc_pads > MK_SIM_MAX_ADC_PADS)
+        return -EINVAL;
+
+    // left by a setup that failed
+    sim_dentries_free();
+    memset(&mk_cfg, 0, sizeof(mk_cfg));
+    memset(&i2c0_cfg, 0, sizeof(i2c0_cfg));
+    memset(&i2c1_cfg, 0, sizeof(i2c1_cfg));
+    memset(sim_gpio_regs, 0, sizeof(sim_gpio_regs));
+    memset(sim_bsc, 0, sizeof(sim_bsc));
+    memset(&gpiod_cfg, 0, sizeof(gpiod_cfg));
+    memset(&hc165_cfg, 0, sizeof(hc165_cfg));
+    memset(sim_hc165_low, 0, sizeof(sim_hc165_low));
+    memset(&mcp23s17_cfg, 0, sizeof(mcp23s17_cfg));
+    memset(sim_spi_chips, 0, sizeof(sim_spi_chips));
+    memset(&mcp3008_cfg, 0, sizeof(mcp3008_cfg));
+    memset(&i2c0_leds_cfg, 0, sizeof(i2c0_leds_cfg));
+    memset(&i2c1_leds_cfg, 0, sizeof(i2c1_leds_cfg));
+    memset(&gpio_leds_cfg, 0, sizeof(gpio_leds_cfg));
+    memset(sim_adc_values, 0, sizeof(sim_adc_values));
+    for (i = 0; i < ARRAY_SIZE(sim_spi); i++)
+        sim_spi[i].queued = NULL;
+    sim_gpio_low = 0;
+    sim_gpio_out = 0;
+    hc165_pads = 0;
+    state_page = true;
+    record = mk_sim_record;
+    gpiod_chip = SIM_GPIOD_CHIP;
+
+    for (i = 0; i < n_gpio; i++) {
+        mk_cfg.args[mk_cfg.nargs++] = MK_ARCADE_GPIO + i;
+        gpiod_cfg.args[gpiod_cfg.nargs++] = mk_sim_gpiod;
+    }
+    if (mk_sim_hc165) {
+        hc165_cfg.args[hc165_cfg.nargs++] = SIM_HC165_LOAD;
+        hc165_cfg.args[hc165_cfg.nargs++] = SIM_HC165_CLOCK;
+        hc165_cfg.args[hc165_cfg.nargs++] = SIM_HC165_DATA;
+        hc165_pads = n_mcp;
+        n_mcp = 0;
+    }
+    if (mk_sim_spi) {
+        for (i = 0; i < n_mcp; i++) {
+            mcp23s17_cfg.args[mcp23s17_cfg.nargs++] = i;
+            sim_mcp_reset(&sim_spi_chips[i]);
+        }
+        n_mcp = 0;
+    }
+    // channels 0, 1, 2 for the first pad, 3, 4, 5 for the next, the last has no throttle
+    for (i = 0; i < mk_sim_adc_pads * MK_ADC_AXES; i++)
+        mcp3008_cfg.args[mcp3008_cfg.nargs++] = i < MCP3008_CHANNELS ? i : -1;
+    for (i = 0; i < n_mcp; i++) {
+        struct mk_config *cfg = i % 2 ? &i2c1_cfg : &i2c0_cfg;
+        int addr = 0x20 + i / 2;
+
+        cfg->args[cfg->nargs++] = addr;
+        sim_mcp_reset(&sim_bsc[i % 2].chips[addr - 0x20]);
+        if (mk_sim_leds) {
+            cfg = i % 2 ? &i2c1_leds_cfg : &i2c0_leds_cfg;
+            cfg->args[cfg->nargs++] = MK_SIM_LED_PINS;
+        }
+    }
+    if (mk_sim_leds)
+        gpio_leds_cfg.args[gpio_leds_cfg.nargs++] = MK_SIM_LED_GPIO;
+
+    err = mk_init();
+    if (err)
+        return err;
+
+    for (i = 0; i < mk_base->count; i++)
+        mk_base->pads[i]->dev->open(mk_base->pads[i]->dev);
+    return 0;
+}
+
+void mk_sim_teardown(void) {
+    int i;
+
+    for (i = 0; i < mk_base->count; i++)
+        mk_base->pads[i]->dev->close(mk_base->pads[i]->dev);
+    mk_exit();
+    mk_base = NULL;
+    sim_dentries_free();
+    memset(&mk_hc165, 0, sizeof(mk_hc165));
+
+    // the bus state is static in the driver, start the next run from scratch
+    for (i = 0; i < ARRAY_SIZE(mk_bsc); i++) {
+        unsigned long base = mk_bsc[i].base;
+
+        memset(&mk_bsc[i], 0, sizeof(mk_bsc[i]));
+        mk_bsc[i].base = base;
+    }
+}
+
+int mk_sim_max_mcp_pads(void) {
+    if (mk_sim_hc165)
+        return MK_SIM_MAX_HC165_PADS;
+    return mk_sim_spi ? MK_SIM_MAX_SPI_PADS : MK_SIM_MAX_MCP_PADS;
+}
+
+int mk_sim_pad_count(void) {
+    return mk_base->count;
+}
+
+int mk_sim_pad_bits(int pad) {
+    enum mk_type type = mk_base->pads[pad]->type;
+
+    if (type == MK_ARCADE_MCP23017 || type == MK_ARCADE_74HC165 || type == MK_ARCADE_MCP23S17)
+        return mk_max_mcp_arcade_buttons;
+    return type == MK_ARCADE_MCP3008 ? 0 : mk_max_arcade_buttons;
+}
+
+uint16_t mk_sim_pad_leds(int pad) {
+    return mk_base->pads[pad]->led_mask;
+}
+
+int mk_sim_led_set(const char *name, bool on) {
+    int i;
+
+    for (i = 0; i < SIM_LEDS; i++) {
+        if (sim_leds[i] && !strcmp(sim_leds[i]->name, name)) {
+            sim_leds[i]->brightness_set(sim_leds[i], on ? LED_ON : LED_OFF);
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+
+uint16_t mk_sim_led_pins(int idx) {
+    struct mk_pad *pad = mk_base->pads[idx];
+
+    return sim_mcp_pins(&sim_bsc[pad->i2cdev].chips[pad->i2caddr - 0x20]) & pad->led_mask;
+}
+
+uint32_t mk_sim_gpio_leds(void) {
+    return sim_gpio_out & mk_gpio_leds.mask;
+}
+
+void mk_sim_set_adc(int channel, int value) {
+    sim_adc_values[channel] = value;
+}
+
+int mk_sim_reported_abs(int idx, int axis) {
+    return mk_base->pads[idx]->dev->abs[mk_adc_abs[axis]];
+}
+
+void mk_sim_set_input(int idx, uint32_t state) {
+    struct mk_pad *pad = mk_base->pads[idx];
+    int i;
+
+    if (pad->type == MK_ARCADE_MCP23017) {
+        sim_bsc[pad->i2cdev].chips[pad->i2caddr - 0x20].low = state;
+        return;
+    }
+    if (pad->type == MK_ARCADE_74HC165) {
+        sim_hc165_low[pad->hc165_pos] = state;
+        return;
+    }
+    if (pad->type == MK_ARCADE_MCP23S17) {
+        sim_spi_chips[pad->spi_addr].low = state;
+        return;
+    }
+
+    for (i = 0; i < mk_max_arcade_buttons; i++) {
+        if (pad->gpio_maps[i] == -1)
+            continue;
+        if (state & BIT(i))
+            sim_gpio_low |= BIT(pad->gpio_maps[i]);
+        else
+            sim_gpio_low &= ~BIT(pad->gpio_maps[i]);
+    }
+}
+
+void mk_sim_set_present(int idx, bool present) {
+    struct mk_pad *pad = mk_base->pads[idx];
+    struct sim_mcp *chip = &sim_bsc[pad->i2cdev].chips[pad->i2caddr - 0x20];
+    u16 low = chip->low;
+
+    if (present) {
+        sim_mcp_reset(chip);
+        chip->low = low;
+    } else {
+        chip->present = false;
+    }
+}
+
+void mk_sim_set_open(int idx, bool open) {
+    struct input_dev *dev = mk_base->pads[idx]->dev;
+
+    if (open)
+        dev->open(dev);
+    else
+        dev->close(dev);
+}
+
+unsigned long mk_sim_transfers(void) {
+    return sim_transfers;
+}
+
+static struct device_attribute *sim_attr(struct input_dev *dev, const char *name) {
+    const struct attribute_group **g;
+    struct attribute **a;
+
+    for (g = dev->dev.groups; g && *g; g++)
+        for (a = (*g)->attrs; *a; a++)
+            if (!strcmp((*a)->name, name))
+                return container_of(*a, struct device_attribute, attr);
+    return NULL;
+}
+
+int mk_sim_attr_store(int idx, const char *name, const char *value) {
+    struct input_dev *dev = mk_base->pads[idx]->dev;
+    struct device_attribute *attr = sim_attr(dev, name);
+
+    if (!attr)
+        return -ENOENT;
+    return attr->store(&dev->dev, attr, value, strlen(value));
+}
+
+int mk_sim_attr_show(int idx, const char *name, char *buf) {
+    struct input_dev *dev = mk_base->pads[idx]->dev;
+    struct device_attribute *attr = sim_attr(dev, name);
+
+    if (!attr)
+        return -ENOENT;
+    return attr->show(&dev->dev, attr, buf);
+}
+
+struct config_item *mk_sim_cfs_mkdir(const char *name) {
+    struct config_group *group = mk_cfs.su_group.cg_item.ci_type->ct_group_ops->make_group(&mk_cfs.su_group, name);
+
+    return IS_ERR(group) ? NULL : &group->cg_item;
+}
+
+struct config_item *mk_sim_cfs_lookup(const char *name) {
+    struct config_group *g;
+
+    for (g = mk_cfs.su_group.cg_default; g; g = g->cg_next)
+        if (!strcmp(config_item_name(&g->cg_item), name))
+            return &g->cg_item;
+    return NULL;
+}
+
+int mk_sim_cfs_store(struct config_item *item, const char *name, const char *value) {
+    struct configfs_attribute **a;
+
+    for (a = item->ci_type->ct_attrs; *a; a++)
+        if (!strcmp((*a)->ca_name, name))
+            return (*a)->store(item, value, strlen(value));
+    return -ENOENT;
+}
+
+int mk_sim_cfs_show(struct config_item *item, const char *name, char *buf) {
+    struct configfs_attribute **a;
+
+    for (a = item->ci_type->ct_attrs; *a; a++)
+        if (!strcmp((*a)->ca_name, name))
+            return (*a)->show(item, buf);
+    return -ENOENT;
+}
+
+void mk_sim_cfs_rmdir(struct config_item *item) {
+    mk_cfs.su_group.cg_item.ci_type->ct_group_ops->drop_item(&mk_cfs.su_group, item);
+}
+
+unsigned long mk_sim_recorded(int idx, uint32_t *raw, uint32_t *state) {
+    struct mk_rec *r = mk_base->pads[idx]->rec;
+    const struct mk_rec_entry *e;
+
+    if (!r || !r->head)
+        return 0;
+    e = &r->entries[(r->head - 1) & r->mask];
+    *raw = e->raw;
+    *state = e->state;
+    return r->head;
+}
+
+int mk_sim_record_read(int idx, char *buf, size_t size) {
+    struct seq_file m = { .private = mk_base->pads[idx]->rec, .buf = buf, .size = size };
+    loff_t pos = 0;
+    void *v;
+
+    if (!m.private)
+        return -ENOENT;
+    for (v = mk_record_sops.start(&m, &pos); v; v = mk_record_sops.next(&m, v, &pos))
+        mk_record_sops.show(&m, v);
+    mk_record_sops.stop(&m, v);
+    buf[min(m.count, size - 1)] = '\0';
+    return m.count;
+}
+
+struct mk_sim_file {
+    struct inode inode;
+    struct file file;
+    loff_t pos;
+};
+
+struct mk_sim_file *mk_sim_replay_open(int idx) {
+    struct mk_sim_file *f = calloc(1, sizeof(*f));
+    struct mk_pad *pad = mk_base->pads[idx];
+
+    if (!f)
+        return NULL;
+    f->inode.i_private = pad;
+    f->file.f_mode = FMODE_WRITE;
+    f->file.f_path.dentry = sim_dentry_find(pad->debugfs, "replay");
+    if (mk_replay_fops.open(&f->inode, &f->file)) {
+        free(f);
+        return NULL;
+    }
+    return f;
+}
+
+// as a shell would, in writes of a few lines
+int mk_sim_replay_write(struct mk_sim_file *f, const char *text) {
+    size_t len = strlen(text), done, n;
+    ssize_t ret = 0;
+
+    for (done = 0; done < len && ret >= 0; done += n) {
+        n = min(len - done, (size_t)100);
+        ret = mk_replay_fops.write(&f->file, text + done, n, &f->pos);
+    }
+    return ret < 0 ? ret : 0;
+}
+
+void mk_sim_replay_close(struct mk_sim_file *f) {
+    mk_replay_fops.release(&f->inode, &f->file);
+    free(f);
+}
+
+int mk_sim_replay(int idx, const char *text) {
+    struct mk_sim_file *f = mk_sim_replay_open(idx);
+    int err;
+
+    if (!f)
+        return -ENOMEM;
+    err = mk_sim_replay_write(f, text);
+    mk_sim_replay_close(f);
+    return err;
+}
+
+int mk_sim_replay_status(int idx, char *buf, size_t size) {
+    struct inode inode = { .i_private = mk_base->pads[idx] };
+    struct file file = { .f_mode = 0 };
+    loff_t pos = 0;
+    ssize_t len;
+
+    mk_replay_fops.open(&inode, &file);
+    len = mk_replay_fops.read(&file, buf, size - 1, &pos);
+    mk_replay_fops.release(&inode, &file);
+    buf[len > 0 ? len : 0] = '\0';
+    return len;
+}
+
+uint32_t mk_sim_reported(int idx) {
+    struct input_dev *dev = mk_base->pads[idx]->dev;
+    uint32_t state = 0;
+    int j;
+
+    if (dev->abs[ABS_Y] < 0)
+        state |= BIT(0);
+    if (dev->abs[ABS_Y] > 0)
+        state |= BIT(1);
+    if (dev->abs[ABS_X] < 0)
+        state |= BIT(2);
+    if (dev->abs[ABS_X] > 0)
+        state |= BIT(3);
+    for (j = 4; j < mk_sim_pad_bits(idx); j++)
+        if (test_bit(mk_arcade_gpio_btn[j - 4], dev->key))
+            state |= BIT(j);
+    return state;
+}
+
+const struct mk_state_page *mk_sim_state_page(void) {
+    return mk_state;
+}
+
+bool mk_sim_timer_active(void) {
+    return mk_base->timer.active;
+}
+
+void mk_sim_tick(void) {
+    if (mk_base->timer.active)
+        mk_base->timer.function(&mk_base->timer);
+    sim_spi_run();
+    sim_works_run();
+}
+
+void mk_sim_advance(unsigned int ms) {
+    mk_sim_clock_skew += (s64)ms * NSEC_PER_MSEC;
+}
+
+unsigned long mk_sim_events(void) {
+    unsigned long events = 0;
+    int i;
+
+    for (i = 0; i < mk_base->count; i++)
+        events += mk_base->pads[i]->dev->events;
+    return events;
+}
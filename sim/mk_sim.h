@@ -0,0 +1,139 @@
+/*
+ *  Arcade Joystick Driver for RaspberryPi - userspace simulator
+ *
+ *  Runs the driver poll and report code against a model of the BCM2835
+ *  GPIO level register and of MCP23017 chips behind the BSC controllers.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#ifndef _MK_SIM_H
+#define _MK_SIM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../mk_arcade_joystick_rpi_state.h"
+
+#define MK_SIM_MAX_GPIO_PADS	2	/* map=1,2 */
+#define MK_SIM_MAX_MCP_PADS	16	/* 8 chips on each bus */
+#define MK_SIM_MAX_HC165_PADS	10	/* MK_MAX_DEVICES */
+#define MK_SIM_MAX_SPI_PADS	8	/* MCP23S17 addresses 0..7 on spi0.0 */
+#define MK_SIM_MAX_ADC_PADS	3	/* 8 MCP3008 channels on spi0.1, 3 per pad */
+#define MK_SIM_LED_PINS		0xf000	/* GPB4..GPB7 of every MCP23017 with mk_sim_leds */
+#define MK_SIM_LED_GPIO		31
+
+/*
+ * Loads the driver with n_gpio GPIO pads (map=1,2) then n_mcp MCP23017
+ * pads, spread over i2c-0 and i2c-1, then mk_sim_adc_pads MCP3008 pads,
+ * and opens all of them.
+ * Returns the driver init result.
+ */
+int mk_sim_setup(int n_gpio, int n_mcp);
+void mk_sim_teardown(void);
+
+/* Most pads mk_sim_setup() takes past the GPIO ones, for the bus in use. */
+int mk_sim_max_mcp_pads(void);
+
+int mk_sim_pad_count(void);
+
+/* Drives the inputs of a pad from a packed state (bit set = pressed). */
+void mk_sim_set_input(int pad, uint32_t state);
+
+/*
+ * Unplugs the MCP23017 of a pad, or plugs it back in fresh out of reset.
+ * An unplugged chip does not ACK.
+ */
+void mk_sim_set_present(int pad, bool present);
+
+/* Opens or closes the evdev of a pad, as a reader of /dev/input would. */
+void mk_sim_set_open(int pad, bool open);
+
+/* I2C transfers started on both buses, and SPI frames answered, so far. */
+unsigned long mk_sim_transfers(void);
+
+/*
+ * Writes or reads a sysfs attribute of the input device of a pad (autofire,
+ * macro), buf holding a page. Returns what the attribute returns.
+ */
+int mk_sim_attr_store(int pad, const char *name, const char *value);
+int mk_sim_attr_show(int pad, const char *name, char *buf);
+
+/*
+ * Makes a runtime pad as mkdir in configfs does, finds the directory of a
+ * pad given at load (inputN), writes or reads one of its attributes (type,
+ * gpio, bus, address, int_gpio, leds, enable) and removes it. A pad that
+ * is enabled comes after the others, as mk_sim_pad_count() grows.
+ */
+struct config_item;
+struct config_item *mk_sim_cfs_mkdir(const char *name);
+struct config_item *mk_sim_cfs_lookup(const char *name);
+int mk_sim_cfs_store(struct config_item *item, const char *name, const char *value);
+int mk_sim_cfs_show(struct config_item *item, const char *name, char *buf);
+void mk_sim_cfs_rmdir(struct config_item *item);
+
+/*
+ * With mk_sim_record set, the entries recorded for a pad so far and the
+ * last one, 0 if none. mk_sim_record_read() prints padN/record to buf.
+ */
+unsigned long mk_sim_recorded(int pad, uint32_t *raw, uint32_t *state);
+int mk_sim_record_read(int pad, char *buf, size_t size);
+
+/* Writes text to padN/replay and closes it, or reads where the replay is. */
+int mk_sim_replay(int pad, const char *text);
+int mk_sim_replay_status(int pad, char *buf, size_t size);
+
+/* padN/replay held open across other calls, as a slow writer would, NULL if it cannot be opened. */
+struct mk_sim_file;
+struct mk_sim_file *mk_sim_replay_open(int pad);
+int mk_sim_replay_write(struct mk_sim_file *f, const char *text);
+void mk_sim_replay_close(struct mk_sim_file *f);
+
+/* The packed state the pad last reported to the input core. */
+uint32_t mk_sim_reported(int pad);
+
+/* Number of inputs of a pad in its packed state, 0 for an analog pad. */
+int mk_sim_pad_bits(int pad);
+
+/*
+ * The LED pins of a pad, set by name as a write to the brightness of an
+ * LED class device does, and the levels of the LED pins of its MCP23017 or
+ * of the GPIO LEDs.
+ */
+uint16_t mk_sim_pad_leds(int pad);
+int mk_sim_led_set(const char *name, bool on);
+uint16_t mk_sim_led_pins(int pad);
+uint32_t mk_sim_gpio_leds(void);
+
+/* Sets the voltage on an MCP3008 channel, in ADC steps (0-1023). */
+void mk_sim_set_adc(int channel, int value);
+
+/* The value an analog pad last reported for an axis : 0 X, 1 Y, 2 throttle. */
+int mk_sim_reported_abs(int pad, int axis);
+
+/* The shared state page, the driver is loaded with state_page=1. */
+const struct mk_state_page *mk_sim_state_page(void);
+
+/* Runs one timer tick of the driver, none while its timer is stopped. */
+void mk_sim_tick(void);
+bool mk_sim_timer_active(void);
+
+/* Moves the clock of the driver ms forward, as if they passed before the next tick. */
+void mk_sim_advance(unsigned int ms);
+
+/* Input events reported so far by all pads. */
+unsigned long mk_sim_events(void);
+
+extern bool mk_sim_verbose;
+extern bool mk_sim_gpiod;	/* GPIO pads read through gpiolib (gpiod=1) */
+extern bool mk_sim_hc165;	/* the n_mcp pads are on a 74HC165 chain instead */
+extern bool mk_sim_spi;		/* the n_mcp pads are MCP23S17 chips on spi0.0 instead */
+extern int mk_sim_adc_pads;	/* MCP3008 pads on spi0.1, after all the others */
+extern unsigned int mk_sim_record;	/* entries recorded per pad (record=) */
+extern bool mk_sim_leds;	/* MK_SIM_LED_PINS of every MCP23017 and GPIO MK_SIM_LED_GPIO drive LEDs */
+
+#endif /* _MK_SIM_H */
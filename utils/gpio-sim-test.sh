@@ -0,0 +1,53 @@
+#!/bin/bash
+# Loads the driver with a gpiod pad on a gpio-sim chip and presses its start
+# button by pulling the line down, no Pi or wiring needed.
+# Needs root, configfs, the gpio-sim module and evtest.
+#   usage : utils/gpio-sim-test.sh [path to mk_arcade_joystick_rpi.ko]
+ko=${1:-mk_arcade_joystick_rpi.ko}
+[ ! -e "$ko" ] && echo "usage : utils/gpio-sim-test.sh [path to mk_arcade_joystick_rpi.ko]" && exit 1
+
+cfg=/sys/kernel/config/gpio-sim/mk-test
+label=mk-sim
+start=10	# BCM GPIO of start on map=1
+
+cleanup() {
+	exec 3<&-
+	rmmod mk_arcade_joystick_rpi 2>/dev/null
+	if [ -d "$cfg" ]; then
+		echo 0 > "$cfg/live"
+		rmdir "$cfg/bank0"
+		rmdir "$cfg"
+	fi
+}
+trap cleanup EXIT
+
+modprobe gpio-sim || { echo "ERROR : Unable to load gpio-sim" && exit 1 ;}
+mkdir "$cfg" "$cfg/bank0" || { echo "ERROR : Unable to create the gpio-sim chip" && exit 1 ;}
+echo 32 > "$cfg/bank0/num_lines"
+echo "$label" > "$cfg/bank0/label"
+echo 1 > "$cfg/live"
+pull="/sys/devices/platform/$(cat $cfg/dev_name)/$(cat $cfg/bank0/chip_name)/sim_gpio$start/pull"
+
+insmod "$ko" map=1 gpiod=1 gpiod_chip=$label || { echo "ERROR : Unable to load the driver" && exit 1 ;}
+sleep 0.1
+event=$(grep -l "GPIO Controller 1" /sys/class/input/event*/device/name | head -1 | cut -d/ -f5)
+[ -z "$event" ] && echo "ERROR : No input device for the pad" && exit 1
+
+# only an open pad is polled, and evtest --query closes the device at once :
+# it stays open on fd 3 meanwhile, and each query waits for a few ticks
+exec 3</dev/input/$event || { echo "ERROR : Unable to open /dev/input/$event" && exit 1 ;}
+sleep 0.1
+
+# evtest --query exits with 10 when the key is down
+evtest --query /dev/input/$event EV_KEY BTN_START
+[ $? -ne 0 ] && echo "FAIL : start reported down before the press" && exit 1
+echo pull-down > "$pull"
+sleep 0.1
+evtest --query /dev/input/$event EV_KEY BTN_START
+[ $? -ne 10 ] && echo "FAIL : start not reported down after the press" && exit 1
+echo pull-up > "$pull"
+sleep 0.1
+evtest --query /dev/input/$event EV_KEY BTN_START
+[ $? -ne 0 ] && echo "FAIL : start still down after the release" && exit 1
+
+echo "gpiod backend OK"
@@ -17,6 +17,8 @@ mkdir -p "$srcdir"
 cp dkms.conf "$srcdir"
 cp Makefile "$srcdir"
 cp mk_arcade_joystick_rpi.c "$srcdir"
+cp mk_arcade_joystick_rpi_trace.h "$srcdir"
+cp mk_arcade_joystick_rpi_state.h "$srcdir"
 
 mkdir -p "$sharedir"
 cp LICENSE "$sharedir"